@@ -14,6 +14,7 @@ GLULIB =$(shell pkg-config --libs   glu)
 GLUTINC=
 GLUTLIB=-lglut
 MLIB   =-lm
+OMPFLAGS=-fopenmp
 
 # includes and libs
 INCS=-I. -I/usr/X11/include/ ${GLINC} ${GLUINC} ${GLUTINC} -I /opt/local/include/eigen3 -I /Users/tomasz/libkdtree/
@@ -25,6 +26,6 @@ SRCDIR   = src
 
 # compiler and additional flags
 COMPILER = g++ #-mp-4.3
-FLAGS    = -Wall -DVERSION=\"${VERSION}\" ${INCS} ${LIBS}
+FLAGS    = -Wall -DVERSION=\"${VERSION}\" ${OMPFLAGS} ${INCS} ${LIBS}
 RFLAGS   = ${FLAGS} -O3 #-std=c++0x
 DFLAGS   = ${FLAGS} -g
@@ -0,0 +1,146 @@
+/*******************************************************************************
+ *
+ *       Filename:  bench.cpp
+ *
+ *    Description:  Camera-path recording and replay for reproducible render
+ *                  benchmarks.
+ *
+ *                  A camera path is a text file with one view state per
+ *                  line:
+ *                    tx ty tz rx ry rz zoom index wmode wstart wend wtrail
+ *                  Lines starting with # are comments.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "bench.h"
+
+static FILE *      g_bench_rec  = NULL;
+static viewstate_t g_bench_last;
+static int         g_bench_have = 0;
+
+
+/*******************************************************************************
+ *         Name:  benchStartRecording
+ *  Description:  Open the camera-path file for writing.
+ ******************************************************************************/
+int benchStartRecording( const char * filename ) {
+
+  g_bench_rec = fopen( filename, "w" );
+  if ( !g_bench_rec ) {
+    fprintf( stderr, "error: Could not open »%s«.\n", filename );
+    return 0;
+  }
+  fprintf( g_bench_rec, "# ptsviewer camera path\n"
+           "# tx ty tz rx ry rz zoom index wmode wstart wend wtrail\n" );
+  g_bench_have = 0;
+  printf( "Recording camera path to %s\n", filename );
+  return 1;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  benchRecord
+ *  Description:  Append a view state unless it equals the previous one.
+ ******************************************************************************/
+void benchRecord( const viewstate_t * view ) {
+
+  if ( !g_bench_rec ) {
+    return;
+  }
+  if ( g_bench_have && !memcmp( view, &g_bench_last, sizeof( viewstate_t ) ) ) {
+    return;
+  }
+  fprintf( g_bench_rec, "%.17g %.17g %.17g %.17g %.17g %.17g %.17g %d %d %d %d %d\n",
+           view->tx, view->ty, view->tz, view->rx, view->ry, view->rz,
+           view->zoom, view->index, view->window_mode, view->window_start,
+           view->window_end, view->window_trail );
+  fflush( g_bench_rec );
+  g_bench_last = *view;
+  g_bench_have = 1;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  benchLoadPath
+ *  Description:  Read all view states of a camera-path file.
+ ******************************************************************************/
+int benchLoadPath( const char * filename, viewstate_t ** views ) {
+
+  FILE * f = fopen( filename, "r" );
+  if ( !f ) {
+    fprintf( stderr, "error: Could not open »%s«.\n", filename );
+    return -1;
+  }
+
+  int n = 0;
+  int size = 1024;
+  *views = (viewstate_t *) malloc( size * sizeof( viewstate_t ) );
+  char line[1024];
+  while ( fgets( line, sizeof( line ), f ) ) {
+    if ( *line == '#' ) {
+      continue;
+    }
+    viewstate_t v;
+    memset( &v, 0, sizeof( viewstate_t ) );
+    if ( sscanf( line, "%lf %lf %lf %lf %lf %lf %lf %d %d %d %d %d",
+                 &v.tx, &v.ty, &v.tz, &v.rx, &v.ry, &v.rz, &v.zoom,
+                 &v.index, &v.window_mode, &v.window_start, &v.window_end,
+                 &v.window_trail ) != 12 ) {
+      continue;
+    }
+    if ( n == size ) {
+      size *= 2;
+      *views = (viewstate_t *) realloc( *views, size * sizeof( viewstate_t ) );
+    }
+    (*views)[n++] = v;
+  }
+  fclose( f );
+  return n;
+
+}
+
+
+double benchNow() {
+
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  benchReport
+ *  Description:  Print frame time statistics (nearest-rank percentiles).
+ ******************************************************************************/
+void benchReport( FILE * out, double * frame_ms, int n ) {
+
+  if ( n <= 0 ) {
+    fprintf( out, "bench: no frames\n" );
+    return;
+  }
+  std::sort( frame_ms, frame_ms + n );
+  double sum = 0;
+  int i;
+  for ( i = 0; i < n; i++ ) {
+    sum += frame_ms[i];
+  }
+#define PERCENTILE(p) frame_ms[ std::max( 0, (int) ceil( (p) / 100.0 * n ) - 1 ) ]
+  fprintf( out, "bench: %d frames, total %.2f ms\n", n, sum );
+  fprintf( out, "bench: mean %.3f ms  min %.3f ms  max %.3f ms\n",
+           sum / n, frame_ms[0], frame_ms[n-1] );
+  fprintf( out, "bench: p50 %.3f ms  p95 %.3f ms  p99 %.3f ms\n",
+           PERCENTILE( 50 ), PERCENTILE( 95 ), PERCENTILE( 99 ) );
+#undef PERCENTILE
+
+}
@@ -0,0 +1,44 @@
+/*******************************************************************************
+ *
+ *       Filename:  bench.h
+ *
+ *    Description:  Camera-path recording and replay for reproducible render
+ *                  benchmarks.
+ *
+ ******************************************************************************/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+/* Everything that determines what a frame shows. */
+typedef struct {
+  double tx, ty, tz;
+  double rx, ry, rz;
+  double zoom;
+  int    index;
+  int    window_mode;
+  int    window_start;
+  int    window_end;
+  int    window_trail;
+} viewstate_t;
+
+/* Start recording into a camera-path file. Returns 0 on error. */
+int  benchStartRecording( const char * filename );
+
+/* Append a view state if recording and if it differs from the last one. */
+void benchRecord( const viewstate_t * view );
+
+/* Load a camera-path file. Returns the number of states or -1 on error,
+ * the states have to be freed by the caller. */
+int  benchLoadPath( const char * filename, viewstate_t ** views );
+
+/* Monotonic time in milliseconds. */
+double benchNow();
+
+/* Print count, mean and the p50/p95/p99 percentiles of frame times. The
+ * array is sorted in place. */
+void benchReport( FILE * out, double * frame_ms, int n );
+
+#endif /* BENCH_H */
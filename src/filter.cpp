@@ -0,0 +1,297 @@
+/*******************************************************************************
+ *
+ *       Filename:  filter.cpp
+ *
+ *    Description:  Export filters.
+ *
+ *                  Whole clouds are tested first: the corners of their
+ *                  bounds are mapped into the box, clouds which miss it are
+ *                  skipped without touching their points and the points of
+ *                  clouds completely inside need no test. Remaining points
+ *                  are tested by the clip kernels while they are
+ *                  transformed. Subsampling depends on the scan and the
+ *                  position of a point only, so a filter keeps the same
+ *                  points in every pass and with any number of threads.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+
+/*******************************************************************************
+ *         Name:  filterParseList
+ *  Description:  Parse up to max comma separated numbers. Returns their
+ *                number or -1 on invalid input.
+ ******************************************************************************/
+static int filterParseList( const char * arg, double * v, int max ) {
+
+  int n = 0;
+  const char * p = arg;
+  while ( n < max ) {
+    char * end;
+    v[n++] = strtod( p, &end );
+    if ( end == p ) {
+      return -1;
+    }
+    if ( *end == '\0' ) {
+      return n;
+    }
+    if ( *end != ',' ) {
+      return -1;
+    }
+    p = end + 1;
+  }
+  return -1;
+
+}
+
+
+int filterParseBox( filter_t * f, const char * arg ) {
+
+  double v[6];
+  if ( filterParseList( arg, v, 6 ) != 6 ) {
+    return 0;
+  }
+  memset( f->axes, 0, sizeof( f->axes ) );
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    if ( v[ q + 3 ] < v[q] ) {
+      return 0;
+    }
+    f->center[q] = ( v[q] + v[ q + 3 ] ) / 2;
+    f->half[q]   = ( v[ q + 3 ] - v[q] ) / 2;
+    f->axes[ 4 * q ] = 1;
+  }
+  f->box = 1;
+  return 1;
+
+}
+
+
+int filterParseOrientedBox( filter_t * f, const char * arg ) {
+
+  double v[9] = { 0 };
+  int n = filterParseList( arg, v, 9 );
+  if ( n != 7 && n != 9 ) {
+    return 0;
+  }
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    if ( v[ q + 3 ] < 0 ) {
+      return 0;
+    }
+    f->center[q] = v[q];
+    f->half[q]   = v[ q + 3 ] / 2;
+  }
+
+  /* R = Rz(yaw) Ry(pitch) Rx(roll), the box axes are the columns of R */
+  double cy = cos( v[6] * M_PI / 180 ), sy = sin( v[6] * M_PI / 180 );
+  double cp = cos( v[7] * M_PI / 180 ), sp = sin( v[7] * M_PI / 180 );
+  double cr = cos( v[8] * M_PI / 180 ), sr = sin( v[8] * M_PI / 180 );
+  double R[9] = {
+    cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr,
+    sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr,
+    -sp,     cp * sr,                cp * cr };
+  int r, c;
+  for ( r = 0; r < 3; r++ ) {
+    for ( c = 0; c < 3; c++ ) {
+      f->axes[ 3 * c + r ] = R[ 3 * r + c ];
+    }
+  }
+  f->box = 1;
+  return 1;
+
+}
+
+
+int filterParseScans( filter_t * f, const char * arg ) {
+
+  const char * colon = strchr( arg, ':' );
+  if ( !colon ) {
+    return 0;
+  }
+  char * end;
+  f->first_scan = colon == arg ? 0 : strtol( arg, &end, 10 );
+  if ( colon != arg && end != colon ) {
+    return 0;
+  }
+  f->last_scan = colon[1] == '\0' ? INT32_MAX : strtol( colon + 1, &end, 10 );
+  if ( colon[1] != '\0' && *end != '\0' ) {
+    return 0;
+  }
+  f->scans = 1;
+  return f->first_scan <= f->last_scan;
+
+}
+
+
+int filterParseSample( filter_t * f, const char * arg ) {
+
+  double v[2] = { 0, 0 };
+  int n = filterParseList( arg, v, 2 );
+  if ( n < 1 || v[0] <= 0 || v[0] > 1 ) {
+    return 0;
+  }
+  f->sample   = 1;
+  f->fraction = v[0];
+  f->seed     = (uint32_t) v[1];
+  return 1;
+
+}
+
+
+int filterSet( const filter_t * f ) {
+
+  return f->box || f->scans || filterPerPoint( f );
+
+}
+
+
+int filterPerPoint( const filter_t * f ) {
+
+  return f->box || f->stride > 1 || f->sample || f->masked;
+
+}
+
+
+int filterScan( const filter_t * f, int scan ) {
+
+  return !f->scans || ( scan >= f->first_scan && scan <= f->last_scan );
+
+}
+
+
+int filterCloud( const filter_t * f, const double * mat, const double * min,
+    const double * max, int scan, filtercloud_t * fc ) {
+
+  static const double identity[16] = {
+    1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+  if ( !mat ) {
+    mat = identity;
+  }
+  xformAffine( mat, &fc->a );
+  fc->scan    = scan;
+  fc->clipped = 0;
+  fc->keep    = NULL;
+  if ( !f->box ) {
+    return 1;
+  }
+
+  /* Row k of the clip transform is axis k of the box applied to the pose,
+   * scaled by the half edge length. Degenerate boxes keep nothing. */
+  double clip[12];
+  int k, q;
+  for ( k = 0; k < 3; k++ ) {
+    const double * axis = f->axes + 3 * k;
+    double s = f->half[k] > 0 ? 1 / f->half[k] : INFINITY;
+    for ( q = 0; q < 4; q++ ) {
+      double d = axis[0] * mat[ 4 * q ] + axis[1] * mat[ 4 * q + 1 ]
+        + axis[2] * mat[ 4 * q + 2 ];
+      if ( q == 3 ) {
+        d -= axis[0] * f->center[0] + axis[1] * f->center[1]
+          + axis[2] * f->center[2];
+      }
+      clip[ 3 * q + k ] = d * s;
+    }
+  }
+  for ( q = 0; q < 12; q++ ) {
+    fc->clip.m[q] = (float) clip[q];
+  }
+
+  fc->clipped = 1;
+  if ( !min || !max ) {
+    return 1;
+  }
+  if ( min[0] > max[0] ) {
+    return 0;                            /* empty cloud */
+  }
+
+  /* Bounds of the corners of the cloud bounds in the box */
+  double lo[3] = { INFINITY, INFINITY, INFINITY };
+  double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+  int corner;
+  for ( corner = 0; corner < 8; corner++ ) {
+    double p[3] = { corner & 1 ? max[0] : min[0], corner & 2 ? max[1] : min[1],
+      corner & 4 ? max[2] : min[2] };
+    for ( k = 0; k < 3; k++ ) {
+      double u = clip[k] * p[0] + clip[ 3 + k ] * p[1] + clip[ 6 + k ] * p[2]
+        + clip[ 9 + k ];
+      lo[k] = fmin( lo[k], u );
+      hi[k] = fmax( hi[k], u );
+    }
+  }
+  int inside = 1;
+  for ( k = 0; k < 3; k++ ) {
+    if ( lo[k] > 1 || hi[k] < -1 ) {
+      return 0;
+    }
+    /* margin for the float rounding of the clip kernels */
+    inside &= lo[k] >= -0.999 && hi[k] <= 0.999;
+  }
+  fc->clipped = !inside;
+  return 1;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  filterKeep
+ *  Description:  Subsample decision for the point at position i of a scan.
+ ******************************************************************************/
+static inline int filterKeep( const filter_t * f, int scan, size_t i ) {
+
+  if ( f->stride > 1 && i % f->stride ) {
+    return 0;
+  }
+  if ( f->sample ) {
+    /* splitmix64 finalizer of scan, position and seed */
+    uint64_t h = ( (uint64_t) scan << 32 ) ^ i ^ ( (uint64_t) f->seed << 48 );
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return ( h >> 11 ) * ( 1.0 / 9007199254740992.0 ) < f->fraction;
+  }
+  return 1;
+
+}
+
+
+size_t filterPoints( const filter_t * f, const filtercloud_t * fc,
+    const float * src, size_t n, size_t first, float * dst, uint32_t * index ) {
+
+  size_t kept, i;
+  if ( fc->clipped ) {
+    kept = xformClip( &fc->a, &fc->clip, src, dst, index, n );
+  } else {
+    xformPoints( &fc->a, src, dst, n );
+    for ( i = 0; i < n; i++ ) {
+      index[i] = i;
+    }
+    kept = n;
+  }
+  if ( f->stride <= 1 && !f->sample && !fc->keep ) {
+    return kept;
+  }
+
+  size_t k = 0;
+  for ( i = 0; i < kept; i++ ) {
+    if ( ( !fc->keep || fc->keep[ first + index[i] ] )
+        && filterKeep( f, fc->scan, first + index[i] ) ) {
+      memmove( dst + 3 * k, dst + 3 * i, 3 * sizeof( float ) );
+      index[ k++ ] = index[i];
+    }
+  }
+  return k;
+
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ *
+ *       Filename:  filter.h
+ *
+ *    Description:  Export filters: an axis-aligned or oriented box, a range
+ *                  of scans and a stride or random subsample of the points.
+ *
+ ******************************************************************************/
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xform.h"
+
+/* A zeroed filter keeps everything. */
+typedef struct {
+  int      box;              /* points must lie within the box */
+  double   center[3];
+  double   axes[9];          /* box axes in world coordinates, one per row */
+  double   half[3];          /* half edge lengths */
+  int      scans;            /* only scans first_scan to last_scan */
+  int      first_scan;
+  int      last_scan;
+  int      stride;           /* keep every stride-th point if > 1 */
+  int      sample;           /* keep a random fraction of the points */
+  double   fraction;
+  uint32_t seed;
+  int      masked;           /* clouds come with flags of kept points */
+} filter_t;
+
+/* Transforms of one cloud for filterPoints */
+typedef struct {
+  affine_t a;                /* cloud to world */
+  affine_t clip;             /* cloud to the box as the cube [-1, 1]^3 */
+  int      clipped;          /* points need the box test */
+  int      scan;
+  const uint8_t * keep;      /* flag per point of the cloud or NULL */
+} filtercloud_t;
+
+/* Parse the option arguments. Boxes are "xmin,ymin,zmin,xmax,ymax,zmax" or
+ * "cx,cy,cz,sx,sy,sz,yaw[,pitch,roll]" with edge lengths and angles in
+ * degrees, scan ranges "first:last" where either end may be left out,
+ * samples "fraction[,seed]". Return 0 on invalid input. */
+int  filterParseBox( filter_t * f, const char * arg );
+int  filterParseOrientedBox( filter_t * f, const char * arg );
+int  filterParseScans( filter_t * f, const char * arg );
+int  filterParseSample( filter_t * f, const char * arg );
+
+/* Whether any filter is set and whether points need to be tested. */
+int  filterSet( const filter_t * f );
+int  filterPerPoint( const filter_t * f );
+
+/* Whether the scan range includes scan. */
+int  filterScan( const filter_t * f, int scan );
+
+/* Prepare the transforms of a cloud with pose mat, NULL for points in world
+ * coordinates. min/max are the bounds of the cloud in its own coordinates
+ * or NULL if unknown. Returns 0 if the cloud lies outside the box, the
+ * points of a cloud completely inside skip the box test. The keep flags are
+ * cleared, they are set by the caller if the filter is masked. */
+int  filterCloud( const filter_t * f, const double * mat, const double * min,
+    const double * max, int scan, filtercloud_t * fc );
+
+/* Transform n points of a cloud, which are the points first to first + n - 1
+ * of the cloud, and keep those passing the filter. The kept points are packed
+ * into dst, their positions in src into index. Returns the number of kept
+ * points. */
+size_t filterPoints( const filter_t * f, const filtercloud_t * fc,
+    const float * src, size_t n, size_t first, float * dst, uint32_t * index );
+
+#endif /* FILTER_H */
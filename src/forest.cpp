@@ -0,0 +1,192 @@
+/*******************************************************************************
+ *
+ *       Filename:  forest.cpp
+ *
+ *    Description:  One kd-tree per scan over its untransformed points.
+ *
+ *                  The world box of a scan bounds the corners of its box in
+ *                  the scan frame, moved by the pose. A query visits the
+ *                  frames whose boxes it comes close enough to and searches
+ *                  their trees with the best distance found so far as the
+ *                  bound, so most trees are left after their root.
+ *
+ ******************************************************************************/
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "forest.h"
+
+
+int forestBuild( kdforest_t * forest, const float * const * vertices,
+    const size_t * counts, int n, const char * index ) {
+
+  forest->count  = n;
+  forest->points = (kdpoints_t *) malloc( n * sizeof( kdpoints_t ) );
+  forest->trees  = (kdtree_t **) calloc( n, sizeof( kdtree_t * ) );
+  forest->boxes  = (float *) malloc( 6 * n * sizeof( float ) );
+  if ( !forest->points || !forest->trees || !forest->boxes ) {
+    forestFree( forest );
+    return 0;
+  }
+
+  #pragma omp parallel for schedule( dynamic, 64 )
+  for ( int i = 0; i < n; i++ ) {
+    float * box = forest->boxes + 6 * i;
+    forest->points[i].xyz = vertices[i];
+    forest->points[i].n   = counts[i];
+    int q;
+    for ( q = 0; q < 3; q++ ) {
+      box[q]     =  FLT_MAX;
+      box[q + 3] = -FLT_MAX;
+    }
+    if ( !counts[i] ) {
+      continue;
+    }
+    size_t k;
+    for ( k = 0; k < counts[i]; k++ ) {
+      for ( q = 0; q < 3; q++ ) {
+        float v = vertices[i][ 3 * k + q ];
+        box[q]     = v < box[q]     ? v : box[q];
+        box[q + 3] = v > box[q + 3] ? v : box[q + 3];
+      }
+    }
+    forest->trees[i] = new kdtree_t( 3, forest->points[i],
+        nanoflann::KDTreeSingleIndexAdaptorParams( KDTREE_LEAF ) );
+  }
+  kdtreeBuild( forest->trees, n, index );
+  return 1;
+
+}
+
+
+void forestFree( kdforest_t * forest ) {
+
+  int i;
+  if ( forest->trees ) {
+    for ( i = 0; i < forest->count; i++ ) {
+      delete forest->trees[i];
+    }
+  }
+  free( forest->trees );
+  free( forest->points );
+  free( forest->boxes );
+  forest->trees  = NULL;
+  forest->points = NULL;
+  forest->boxes  = NULL;
+  forest->count  = 0;
+
+}
+
+
+int forestFrame( const kdforest_t * forest, int i, const double * mat,
+    const double * invmat, kdframe_t * frame ) {
+
+  if ( !forest->trees[i] ) {
+    return 0;
+  }
+  frame->scan = i;
+  xformAffine( invmat, &frame->inv );
+
+  /* Corners of the scan box in world coordinates, widened by the rounding
+   * of the points moved in single precision */
+  const float * box = forest->boxes + 6 * i;
+  affine_t T;
+  xformAffine( mat, &T );
+  float corner[24], world[24];
+  int c, q;
+  for ( c = 0; c < 8; c++ ) {
+    for ( q = 0; q < 3; q++ ) {
+      corner[ 3 * c + q ] = box[ ( c >> q & 1 ) * 3 + q ];
+    }
+  }
+  xformPoints( &T, corner, world, 8 );
+  for ( q = 0; q < 3; q++ ) {
+    frame->min[q] =  FLT_MAX;
+    frame->max[q] = -FLT_MAX;
+  }
+  for ( c = 0; c < 8; c++ ) {
+    for ( q = 0; q < 3; q++ ) {
+      float v = world[ 3 * c + q ];
+      frame->min[q] = v < frame->min[q] ? v : frame->min[q];
+      frame->max[q] = v > frame->max[q] ? v : frame->max[q];
+    }
+  }
+  for ( q = 0; q < 3; q++ ) {
+    float slack = 1e-5f * ( fabsf( frame->min[q] ) + fabsf( frame->max[q] ) );
+    frame->min[q] -= slack;
+    frame->max[q] += slack;
+  }
+  return 1;
+
+}
+
+
+int forestSelect( kdframe_t * frames, int n, const float * min,
+    const float * max, float pad ) {
+
+  int i, kept = 0, q;
+  for ( i = 0; i < n; i++ ) {
+    for ( q = 0; q < 3; q++ ) {
+      if ( frames[i].min[q] > max[q] + pad || frames[i].max[q] < min[q] - pad ) {
+        break;
+      }
+    }
+    if ( q == 3 ) {
+      frames[ kept++ ] = frames[i];
+    }
+  }
+  return kept;
+
+}
+
+
+int forestNearest( const kdforest_t * forest, const kdframe_t * frames,
+    int n, int first, const float * p, float maxdist, uint32_t * index,
+    float * dist ) {
+
+  int best = -1, k;
+  float bound = maxdist;
+  for ( k = -1; k < n; k++ ) {
+    int i = k < 0 ? first : k;
+    if ( i < 0 || i >= n || ( k >= 0 && i == first ) ) {
+      continue;
+    }
+
+    /* Squared distance of p to the world box of the frame */
+    float d = 0;
+    int q;
+    for ( q = 0; q < 3; q++ ) {
+      float e = p[q] < frames[i].min[q] ? frames[i].min[q] - p[q]
+        : p[q] > frames[i].max[q] ? p[q] - frames[i].max[q] : 0;
+      d += e * e;
+    }
+    if ( d > bound ) {
+      continue;
+    }
+
+    const float * m = frames[i].inv.m;
+    float local[3];
+    local[0] = m[0] * p[0] + m[3] * p[1] + m[6] * p[2] + m[ 9];
+    local[1] = m[1] * p[0] + m[4] * p[1] + m[7] * p[2] + m[10];
+    local[2] = m[2] * p[0] + m[5] * p[1] + m[8] * p[2] + m[11];
+    uint32_t idx;
+    float    dst;
+    nanoflann::KNNResultSet<float, uint32_t> result( 1 );
+    result.init( &idx, &dst );
+    dst = bound;
+    forest->trees[ frames[i].scan ]->findNeighbors( result, local,
+        nanoflann::SearchParams() );
+    if ( result.size() && dst < bound ) {
+      bound  = dst;
+      best   = i;
+      *index = idx;
+    }
+  }
+  if ( best >= 0 ) {
+    *dist = bound;
+  }
+  return best;
+
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *
+ *       Filename:  forest.h
+ *
+ *    Description:  One kd-tree per scan over its untransformed points. A
+ *                  query in world coordinates is taken into the frame of
+ *                  each candidate scan with its inverse pose, so changing a
+ *                  pose never rebuilds an index.
+ *
+ ******************************************************************************/
+
+#ifndef FOREST_H
+#define FOREST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree.h"
+#include "xform.h"
+
+typedef struct {
+  int          count;        /* scans */
+  kdpoints_t * points;       /* adaptors of the trees */
+  kdtree_t **  trees;        /* NULL for scans without points */
+  float *      boxes;        /* min and max xyz of every scan, scan frame */
+} kdforest_t;
+
+/* A candidate scan of a query: the pose taking world coordinates into the
+ * scan frame and the world box of the scan */
+typedef struct {
+  int      scan;
+  affine_t inv;
+  float    min[3], max[3];
+} kdframe_t;
+
+/* Build the trees of n scans in parallel, or load them from the file index
+ * if set (see kdtreeBuild). The points must outlive the forest. Returns 0
+ * on error. */
+int  forestBuild( kdforest_t * forest, const float * const * vertices,
+    const size_t * counts, int n, const char * index );
+
+void forestFree( kdforest_t * forest );
+
+/* Candidate of scan i in the pose mat with inverse invmat, column-major.
+ * Returns 0 if the scan has no points. */
+int  forestFrame( const kdforest_t * forest, int i, const double * mat,
+    const double * invmat, kdframe_t * frame );
+
+/* Keep the n frames whose world boxes come within pad of the box min, max.
+ * Returns the number of frames kept, packed in order. */
+int  forestSelect( kdframe_t * frames, int n, const float * min,
+    const float * max, float pad );
+
+/* Nearest point within squared distance maxdist of the world point p among
+ * the n frames. The frame first, usually the one of the previous query, is
+ * searched first to tighten the bound early, -1 for none. Returns the
+ * position of the frame of the point, -1 if there is none, and stores its
+ * index and squared distance. */
+int  forestNearest( const kdforest_t * forest, const kdframe_t * frames,
+    int n, int first, const float * p, float maxdist, uint32_t * index,
+    float * dist );
+
+#endif /* FOREST_H */
@@ -0,0 +1,234 @@
+/*******************************************************************************
+ *
+ *       Filename:  hudtext.c
+ *
+ *    Description:  Batched HUD text rendering from a glyph atlas.
+ *
+ *                  The printable ASCII glyphs of GLUT_BITMAP_8_BY_13 are
+ *                  rendered once into the back buffer and copied into a
+ *                  texture. Text is then a list of textured quads in one
+ *                  vertex buffer, which replaces one glRasterPos plus one
+ *                  glutBitmapCharacter call per character.
+ *
+ ******************************************************************************/
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glut.h>
+#include <GL/gl.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hudtext.h"
+
+/* 16 x 6 cells of 8 x 16 pixels hold the glyphs 32 to 127 */
+#define HUD_ATLAS_SIZE 128
+#define HUD_ATLAS_COLS  16
+#define HUD_FIRST_CHAR  32
+#define HUD_LAST_CHAR  127
+#define HUD_DESCENT      3
+
+typedef struct {
+	GLfloat x, y;
+	GLfloat u, v;
+	GLubyte r, g, b, a;
+} hudvertex_t;
+
+static GLuint        g_hud_tex    = 0;
+static GLuint        g_hud_vbo    = 0;
+static hudvertex_t * g_hud_verts  = NULL;
+static size_t        g_hud_count  = 0;
+static size_t        g_hud_size   = 0;
+static GLsizei       g_hud_drawn  = 0;
+
+
+/*******************************************************************************
+ *         Name:  hudInit
+ *  Description:  Render all glyphs into the back buffer and copy them into
+ *                the atlas texture.
+ ******************************************************************************/
+void hudInit() {
+
+	if ( g_hud_tex ) {
+		return;
+	}
+
+	GLint viewport[4];
+	GLfloat clear[4];
+	glGetIntegerv( GL_VIEWPORT, viewport );
+	glGetFloatv( GL_COLOR_CLEAR_VALUE, clear );
+
+	glPushAttrib( GL_ENABLE_BIT );
+	glDisable( GL_DEPTH_TEST );
+	glDisable( GL_TEXTURE_2D );
+	glViewport( 0, 0, HUD_ATLAS_SIZE, HUD_ATLAS_SIZE );
+	glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
+	glClear( GL_COLOR_BUFFER_BIT );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho( 0, HUD_ATLAS_SIZE, 0, HUD_ATLAS_SIZE, -1, 1 );
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	glColor3f( 1.0f, 1.0f, 1.0f );
+	int c;
+	for ( c = HUD_FIRST_CHAR; c < HUD_LAST_CHAR; c++ ) {
+		int cell = c - HUD_FIRST_CHAR;
+		glRasterPos2i( ( cell % HUD_ATLAS_COLS ) * HUD_GLYPH_W,
+				( cell / HUD_ATLAS_COLS ) * HUD_GLYPH_H + HUD_DESCENT );
+		glutBitmapCharacter( GLUT_BITMAP_8_BY_13, c );
+	}
+
+	/* Intensity puts the glyph coverage into alpha as well. */
+	glGenTextures( 1, &g_hud_tex );
+	glBindTexture( GL_TEXTURE_2D, g_hud_tex );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glCopyTexImage2D( GL_TEXTURE_2D, 0, GL_INTENSITY, 0, 0,
+			HUD_ATLAS_SIZE, HUD_ATLAS_SIZE, 0 );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	glPopMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+
+	glClearColor( clear[0], clear[1], clear[2], clear[3] );
+	glViewport( viewport[0], viewport[1], viewport[2], viewport[3] );
+	glPopAttrib();
+
+	glGenBuffers( 1, &g_hud_vbo );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  hudClear
+ *  Description:  Discard all text of the current batch.
+ ******************************************************************************/
+void hudClear() {
+
+	g_hud_count = 0;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  hudPrint
+ *  Description:  Append one quad per character to the current batch.
+ ******************************************************************************/
+int hudPrint( int x, int y, float r, float g, float b, const char * text ) {
+
+	size_t len = strlen( text );
+	if ( g_hud_count + 4 * len > g_hud_size ) {
+		g_hud_size = ( g_hud_count + 4 * len ) * 2;
+		g_hud_verts = (hudvertex_t *) realloc( g_hud_verts,
+				g_hud_size * sizeof( hudvertex_t ) );
+	}
+
+	GLubyte cr = (GLubyte) ( r * 255 );
+	GLubyte cg = (GLubyte) ( g * 255 );
+	GLubyte cb = (GLubyte) ( b * 255 );
+	const float s = 1.0f / HUD_ATLAS_SIZE;
+	size_t i;
+	for ( i = 0; i < len; i++ ) {
+		int c = (unsigned char) text[i];
+		if ( c < HUD_FIRST_CHAR || c >= HUD_LAST_CHAR ) {
+			c = '?';
+		}
+		int cell = c - HUD_FIRST_CHAR;
+		float u0 = ( cell % HUD_ATLAS_COLS ) * HUD_GLYPH_W * s;
+		float v0 = ( cell / HUD_ATLAS_COLS ) * HUD_GLYPH_H * s;
+		float u1 = u0 + HUD_GLYPH_W * s;
+		float v1 = v0 + HUD_GLYPH_H * s;
+
+		/* The atlas has its origin at the bottom, the HUD at the top. */
+		hudvertex_t * q = g_hud_verts + g_hud_count;
+		hudvertex_t q0 = { (GLfloat) x,               (GLfloat) y,               u0, v1, cr, cg, cb, 255 };
+		hudvertex_t q1 = { (GLfloat) x + HUD_GLYPH_W, (GLfloat) y,               u1, v1, cr, cg, cb, 255 };
+		hudvertex_t q2 = { (GLfloat) x + HUD_GLYPH_W, (GLfloat) y + HUD_GLYPH_H, u1, v0, cr, cg, cb, 255 };
+		hudvertex_t q3 = { (GLfloat) x,               (GLfloat) y + HUD_GLYPH_H, u0, v0, cr, cg, cb, 255 };
+		q[0] = q0;
+		q[1] = q1;
+		q[2] = q2;
+		q[3] = q3;
+		g_hud_count += 4;
+		x += HUD_GLYPH_W;
+	}
+	return x;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  hudUpload
+ *  Description:  Upload the current batch into the vertex buffer.
+ ******************************************************************************/
+void hudUpload() {
+
+	glBindBuffer( GL_ARRAY_BUFFER, g_hud_vbo );
+	glBufferData( GL_ARRAY_BUFFER, g_hud_count * sizeof( hudvertex_t ),
+			g_hud_verts, GL_DYNAMIC_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	g_hud_drawn = (GLsizei) g_hud_count;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  hudDraw
+ *  Description:  Draw the uploaded batch in window coordinates.
+ ******************************************************************************/
+void hudDraw( int w, int h ) {
+
+	if ( !g_hud_drawn ) {
+		return;
+	}
+
+	glPushAttrib( GL_ENABLE_BIT );
+	glDisable( GL_DEPTH_TEST );
+	glEnable( GL_TEXTURE_2D );
+	glEnable( GL_ALPHA_TEST );
+	glAlphaFunc( GL_GREATER, 0.5f );
+	glTexEnvi( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE );
+	glBindTexture( GL_TEXTURE_2D, g_hud_tex );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho( 0, w, h, 0, -1, 1 );
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	glBindBuffer( GL_ARRAY_BUFFER, g_hud_vbo );
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+	glEnableClientState( GL_COLOR_ARRAY );
+	glVertexPointer(   2, GL_FLOAT,         sizeof( hudvertex_t ),
+			(const GLvoid *) offsetof( hudvertex_t, x ) );
+	glTexCoordPointer( 2, GL_FLOAT,         sizeof( hudvertex_t ),
+			(const GLvoid *) offsetof( hudvertex_t, u ) );
+	glColorPointer(    4, GL_UNSIGNED_BYTE, sizeof( hudvertex_t ),
+			(const GLvoid *) offsetof( hudvertex_t, r ) );
+
+	glDrawArrays( GL_QUADS, 0, g_hud_drawn );
+
+	glDisableClientState( GL_COLOR_ARRAY );
+	glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+	glDisableClientState( GL_VERTEX_ARRAY );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+	glPopMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+
+	glBindTexture( GL_TEXTURE_2D, 0 );
+	glPopAttrib();
+
+}
@@ -0,0 +1,43 @@
+/*******************************************************************************
+ *
+ *       Filename:  hudtext.h
+ *
+ *    Description:  Batched HUD text rendering from a glyph atlas. All text of
+ *                  a frame is collected into one vertex buffer which is only
+ *                  rebuilt when the text changes and drawn with one call.
+ *
+ ******************************************************************************/
+
+#ifndef HUDTEXT_H
+#define HUDTEXT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of one glyph cell in pixels */
+#define HUD_GLYPH_W  8
+#define HUD_GLYPH_H 16
+
+/* Build the glyph atlas from GLUT_BITMAP_8_BY_13. Needs a current GL context
+ * and renders into the back buffer, so call it before clearing a frame. */
+void hudInit();
+
+/* Discard all text of the current batch. */
+void hudClear();
+
+/* Append text with its top left corner at pixel position x, y (origin at the
+ * top left of the window). Returns the x position after the last glyph. */
+int  hudPrint( int x, int y, float r, float g, float b, const char * text );
+
+/* Upload the current batch into the vertex buffer. */
+void hudUpload();
+
+/* Draw the uploaded batch on top of a w x h window. */
+void hudDraw( int w, int h );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HUDTEXT_H */
@@ -0,0 +1,373 @@
+/*******************************************************************************
+ *
+ *       Filename:  icp.cpp
+ *
+ *    Description:  Point-to-plane ICP refinement of a trajectory.
+ *
+ *                  Every scan has a kd-tree over its own points and normals
+ *                  estimated from it, both in scan coordinates, so no index
+ *                  is built again when a pose changes. A scan is matched
+ *                  against the trees of its neighbours whose boxes are close
+ *                  to it, the matches and normals are moved into the world
+ *                  with the pose of their scan. Its strided points are
+ *                  transformed with the SIMD kernels of xformPoints in every
+ *                  iteration and the 6x6 normal equations are summed over
+ *                  fixed chunks of points in order.
+ *
+ *                  The map of scan i holds the scans i - window to
+ *                  i + window, so scans window + 1 apart never read each
+ *                  others poses. The scans are refined in window + 1
+ *                  rounds, round r takes the scans i with
+ *                  i % ( window + 1 ) == r in parallel. Each scan starts
+ *                  from the poses the earlier rounds left, independent of
+ *                  the number of threads.
+ *
+ ******************************************************************************/
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "icp.h"
+#include "xform.h"
+
+/* Points per chunk of the normal equation sums */
+#define ICP_CHUNK 4096
+
+/* Update below which a scan has converged, radians and units of the points */
+#define ICP_EPSILON 1e-7
+
+/* Relative damping of the normal equations */
+#define ICP_DAMPING 1e-6
+
+typedef Eigen::Matrix<double, 6, 6> mat6_t;
+typedef Eigen::Matrix<double, 6, 1> vec6_t;
+
+
+/*******************************************************************************
+ *         Name:  icpNormals
+ *  Description:  Normal of every point of a scan from a plane fit to its
+ *                k nearest neighbours, facing the scanner at the origin.
+ *                Points without a plane get a zero normal.
+ ******************************************************************************/
+static void icpNormals( const kdtree_t & tree, const float * xyz, size_t n,
+    int k, float * normals ) {
+
+  if ( n < 3 ) {
+    memset( normals, 0, 3 * n * sizeof( float ) );
+    return;
+  }
+  if ( (size_t) k > n ) {
+    k = n;
+  }
+  std::vector<uint32_t> idx( n * k );
+  std::vector<float>    dist( n * k );
+  kdtreeKnnBatch( &tree, xyz, n, k, &idx[0], &dist[0] );
+  size_t i;
+  for ( i = 0; i < n; i++ ) {
+    const float * p = xyz + 3 * i;
+    const uint32_t * nb = &idx[ k * i ];
+
+    Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+    int j;
+    for ( j = 0; j < k; j++ ) {
+      mean += Eigen::Map<const Eigen::Vector3f>( xyz + 3 * nb[j] );
+    }
+    mean /= k;
+    Eigen::Matrix3f cov = Eigen::Matrix3f::Zero();
+    for ( j = 0; j < k; j++ ) {
+      Eigen::Vector3f d = Eigen::Map<const Eigen::Vector3f>( xyz + 3 * nb[j] ) - mean;
+      cov += d * d.transpose();
+    }
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> eig;
+    eig.computeDirect( cov );
+    Eigen::Vector3f nrm = eig.eigenvectors().col( 0 );
+    /* Collinear or coincident neighbours do not define a plane */
+    if ( k < 3 || !( eig.eigenvalues()( 1 ) > 0 ) || !nrm.allFinite() ) {
+      nrm.setZero();
+    } else if ( nrm.dot( Eigen::Map<const Eigen::Vector3f>( p ) ) > 0 ) {
+      nrm = -nrm;
+    }
+    Eigen::Map<Eigen::Vector3f>( normals + 3 * i ) = nrm;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  icpAlign
+ *  Description:  Align n points in scan coordinates against the scans
+ *                targets of the model, starting from the pose mat, which
+ *                receives the result. rms receives the residual of the first
+ *                and the last iteration. Returns 0 if there are too few
+ *                correspondences.
+ ******************************************************************************/
+static int icpAlign( const icpmodel_t * model, const icpscan_t * scans,
+    const int * targets, int ntargets, const float * vertices, size_t n,
+    double * mat, const icpparams_t * params, double * rms ) {
+
+  /* Frames of the targets, and their poses to move matches into the world */
+  std::vector<kdframe_t> frames( ntargets ), near( ntargets );
+  std::vector<affine_t> poses( model->forest.count );
+  int nframes = 0, j;
+  for ( j = 0; j < ntargets; j++ ) {
+    int t = targets[j];
+    Eigen::Matrix4d inv = Eigen::Map<const Eigen::Matrix4d>( scans[t].mat ).inverse();
+    if ( forestFrame( &model->forest, t, scans[t].mat, inv.data(), &frames[ nframes ] ) ) {
+      xformAffine( scans[t].mat, &poses[t] );
+      nframes++;
+    }
+  }
+  if ( !nframes ) {
+    return 0;
+  }
+
+  /* Strided points of the scan */
+  size_t m = ( n + params->stride - 1 ) / params->stride;
+  float * src = (float *) malloc( 3 * m * sizeof( float ) );
+  float * dst = (float *) malloc( 3 * m * sizeof( float ) );
+  size_t k;
+  for ( k = 0; k < m; k++ ) {
+    memcpy( src + 3 * k, vertices + 3 * k * params->stride, 3 * sizeof( float ) );
+  }
+
+  const long chunks = ( m + ICP_CHUNK - 1 ) / ICP_CHUNK;
+  std::vector<mat6_t, Eigen::aligned_allocator<mat6_t> > H( chunks );
+  std::vector<vec6_t, Eigen::aligned_allocator<vec6_t> > g( chunks );
+  std::vector<double> sse( chunks );
+  std::vector<size_t> matched( chunks );
+  const float maxdist = params->distance * params->distance;
+  Eigen::Map<Eigen::Matrix4d> pose( mat );
+  int ok = 0, it;
+  for ( it = 0; it < params->iterations; it++ ) {
+    affine_t T;
+    xformAffine( mat, &T );
+    xformPoints( &T, src, dst, m );
+    const Eigen::Vector3d pivot = pose.block<3, 1>( 0, 3 );
+
+    /* Targets within reach of the box of the moved points */
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for ( k = 0; k < m; k++ ) {
+      for ( int q = 0; q < 3; q++ ) {
+        lo[q] = dst[ 3 * k + q ] < lo[q] ? dst[ 3 * k + q ] : lo[q];
+        hi[q] = dst[ 3 * k + q ] > hi[q] ? dst[ 3 * k + q ] : hi[q];
+      }
+    }
+    std::copy( frames.begin(), frames.begin() + nframes, near.begin() );
+    const int nnear = forestSelect( &near[0], nframes, lo, hi, params->distance );
+
+    #pragma omp parallel for schedule( dynamic, 1 )
+    for ( long c = 0; c < chunks; c++ ) {
+      mat6_t Hc = mat6_t::Zero();
+      vec6_t gc = vec6_t::Zero();
+      double e = 0;
+      size_t hits = 0;
+      int last = -1;
+      size_t end = ( c + 1 ) * ICP_CHUNK < (long) m ? ( c + 1 ) * ICP_CHUNK : m;
+      for ( size_t s = c * ICP_CHUNK; s < end; s++ ) {
+        uint32_t idx;
+        float    dist;
+        int f = forestNearest( &model->forest, &near[0], nnear, last,
+            dst + 3 * s, maxdist, &idx, &dist );
+        if ( f < 0 ) {
+          continue;
+        }
+        last = f;
+        const int t = near[f].scan;
+        Eigen::Vector3f nl = Eigen::Map<const Eigen::Vector3f>( model->normals[t] + 3 * idx );
+        if ( nl.squaredNorm() == 0 ) {
+          continue;
+        }
+        Eigen::Map<const Eigen::Matrix<float, 3, 4> > P( poses[t].m );
+        Eigen::Vector3d nrm = ( P.block<3, 3>( 0, 0 ) * nl ).cast<double>();
+        Eigen::Vector3d q = ( P.block<3, 3>( 0, 0 ) *
+            Eigen::Map<const Eigen::Vector3f>( scans[t].vertices + 3 * idx ) + P.col( 3 ) ).cast<double>();
+        Eigen::Vector3d p = Eigen::Map<const Eigen::Vector3f>( dst + 3 * s ).cast<double>();
+        double r = nrm.dot( p - q );
+        vec6_t J;
+        J << ( p - pivot ).cross( nrm ), nrm;
+        Hc.selfadjointView<Eigen::Upper>().rankUpdate( J );
+        gc += J * r;
+        e  += r * r;
+        hits++;
+      }
+      H[c]       = Hc;
+      g[c]       = gc;
+      sse[c]     = e;
+      matched[c] = hits;
+    }
+
+    mat6_t Hs = mat6_t::Zero();
+    vec6_t gs = vec6_t::Zero();
+    double e = 0;
+    size_t hits = 0;
+    for ( long c = 0; c < chunks; c++ ) {
+      Hs += H[c];
+      gs += g[c];
+      e  += sse[c];
+      hits += matched[c];
+    }
+    if ( hits < 6 ) {
+      break;
+    }
+    if ( !it ) {
+      rms[0] = sqrt( e / hits );
+    }
+    rms[1] = sqrt( e / hits );
+    ok = 1;
+
+    /* Damping keeps directions the map does not constrain, like sliding
+     * along a single plane, from moving */
+    Hs = Hs.selfadjointView<Eigen::Upper>();
+    Hs.diagonal().array() += ICP_DAMPING * Hs.trace() / 6 + 1e-12;
+    vec6_t x = -Hs.ldlt().solve( gs );
+    if ( !x.allFinite() ) {
+      break;
+    }
+
+    /* Rotation about the scanner position, then translation */
+    Eigen::Vector3d w = x.head<3>();
+    Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+    if ( w.norm() > 0 ) {
+      R = Eigen::AngleAxisd( w.norm(), w.normalized() ).toRotationMatrix();
+    }
+    Eigen::Matrix4d D = Eigen::Matrix4d::Identity();
+    D.block<3, 3>( 0, 0 ) = R;
+    D.block<3, 1>( 0, 3 ) = pivot - R * pivot + x.tail<3>();
+    pose = D * pose;
+    if ( x.norm() < ICP_EPSILON ) {
+      break;
+    }
+  }
+
+  free( dst );
+  free( src );
+  return ok;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  icpScan
+ *  Description:  Align scan i against its neighbours.
+ ******************************************************************************/
+static int icpScan( const icpmodel_t * model, icpscan_t * scans, int n, int i,
+    const icpparams_t * params, double * rms ) {
+
+  std::vector<int> targets;
+  int j;
+  int lo = i - params->window > 0 ? i - params->window : 0;
+  int hi = i + params->window < n - 1 ? i + params->window : n - 1;
+  for ( j = lo; j <= hi; j++ ) {
+    if ( j != i && scans[j].count ) {
+      targets.push_back( j );
+    }
+  }
+  if ( targets.empty() ) {
+    return 0;
+  }
+  return icpAlign( model, scans, &targets[0], targets.size(), scans[i].vertices,
+      scans[i].count, scans[i].mat, params, rms );
+
+}
+
+
+int icpModelBuild( icpmodel_t * model, const icpscan_t * scans, int n,
+    const icpparams_t * params, const char * index ) {
+
+  std::vector<const float *> vertices( n );
+  std::vector<size_t> counts( n );
+  for ( int i = 0; i < n; i++ ) {
+    vertices[i] = scans[i].vertices;
+    counts[i]   = scans[i].count;
+  }
+  model->normals = (float **) calloc( n, sizeof( float * ) );
+  if ( !model->normals || !forestBuild( &model->forest, &vertices[0], &counts[0], n, index ) ) {
+    free( model->normals );
+    model->normals = NULL;
+    return 0;
+  }
+  #pragma omp parallel for schedule( dynamic, 1 )
+  for ( int i = 0; i < n; i++ ) {
+    if ( scans[i].count ) {
+      model->normals[i] = (float *) malloc( 3 * scans[i].count * sizeof( float ) );
+      icpNormals( *model->forest.trees[i], scans[i].vertices, scans[i].count,
+          params->normals, model->normals[i] );
+    }
+  }
+  return 1;
+
+}
+
+
+void icpModelFree( icpmodel_t * model ) {
+
+  int i;
+  if ( model->normals ) {
+    for ( i = 0; i < model->forest.count; i++ ) {
+      free( model->normals[i] );
+    }
+  }
+  free( model->normals );
+  model->normals = NULL;
+  forestFree( &model->forest );
+
+}
+
+
+int icpPair( const icpmodel_t * model, const icpscan_t * scans, int a, int b,
+    const icpparams_t * params, double * mat, double * rms ) {
+
+  if ( !scans[a].count || !scans[b].count ) {
+    return 0;
+  }
+  return icpAlign( model, scans, &b, 1, scans[a].vertices, scans[a].count, mat,
+      params, rms );
+
+}
+
+
+int icpRefine( icpscan_t * scans, int n, const icpparams_t * params,
+    const char * index ) {
+
+  icpmodel_t model;
+  if ( !icpModelBuild( &model, scans, n, params, index ) ) {
+    fprintf( stderr, "error: Cannot allocate the ICP model.\n" );
+    return 0;
+  }
+
+  std::vector<double> before( n, 0 ), after( n, 0 );
+  std::vector<int> refined( n, 0 );
+  const int rounds = params->window + 1;
+  for ( int r = 0; r < rounds; r++ ) {
+    #pragma omp parallel for schedule( dynamic, 1 )
+    for ( int i = r; i < n; i += rounds ) {
+      double rms[2] = { 0, 0 };
+      if ( scans[i].count && icpScan( &model, scans, n, i, params, rms ) ) {
+        refined[i] = 1;
+        before[i]  = rms[0];
+        after[i]   = rms[1];
+      }
+    }
+  }
+
+  int count = 0;
+  double b = 0, a = 0;
+  for ( int i = 0; i < n; i++ ) {
+    count += refined[i];
+    b += before[i];
+    a += after[i];
+  }
+  icpModelFree( &model );
+  printf( "ICP: refined %d scans, mean residual %g before, %g after\n", count,
+      count ? b / count : 0.0, count ? a / count : 0.0 );
+  return count;
+
+}
@@ -0,0 +1,60 @@
+/*******************************************************************************
+ *
+ *       Filename:  icp.h
+ *
+ *    Description:  Point-to-plane ICP refinement of a trajectory. Every scan
+ *                  is aligned against a local map made of its neighbours in
+ *                  the sequence, in their current poses.
+ *
+ ******************************************************************************/
+
+#ifndef ICP_H
+#define ICP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest.h"
+
+typedef struct {
+  int   window;              /* neighbours on either side forming the map */
+  int   iterations;          /* per scan */
+  float distance;            /* max distance of a correspondence */
+  int   stride;              /* every stride-th point of a scan is matched */
+  int   normals;             /* neighbours of the plane fit of a map point */
+} icpparams_t;
+
+typedef struct {
+  const float * vertices;    /* xyz in scan coordinates */
+  size_t        count;       /* 0 for scans without a pose */
+  double *      mat;         /* column-major 4x4 pose, updated in place */
+} icpscan_t;
+
+/* Trees and normals of all scans in scan coordinates, independent of the
+ * poses */
+typedef struct {
+  kdforest_t forest;
+  float **   normals;
+} icpmodel_t;
+
+/* Build the model of n scans, its trees are kept in the file index if set
+ * (see kdtreeBuild). Returns 0 on error. */
+int  icpModelBuild( icpmodel_t * model, const icpscan_t * scans, int n,
+    const icpparams_t * params, const char * index );
+
+void icpModelFree( icpmodel_t * model );
+
+/* Refine the poses of n scans in sequence order. Scans whose maps do not
+ * overlap are refined in parallel, the result does not depend on the number
+ * of threads. Returns the number of refined scans. */
+int  icpRefine( icpscan_t * scans, int n, const icpparams_t * params,
+    const char * index );
+
+/* Align scan a against scan b of the model in its pose, starting from the
+ * pose of a in mat, which receives the result. rms receives the residual of
+ * the first and the last iteration. Returns 0 if the scans do not
+ * overlap. */
+int  icpPair( const icpmodel_t * model, const icpscan_t * scans, int a, int b,
+    const icpparams_t * params, double * mat, double * rms );
+
+#endif /* ICP_H */
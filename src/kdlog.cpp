@@ -0,0 +1,151 @@
+/*******************************************************************************
+ *
+ *       Filename:  kdlog.cpp
+ *
+ *    Description:  Growing point index for streamed scans.
+ *
+ *                  A full buffer, or a batch that fills it, becomes a block
+ *                  of its own. While the level of the block size holds a
+ *                  tree, the points of that level join the block and the
+ *                  level is emptied; the block is then indexed once at the
+ *                  level of its final size. Like the carries of a binary
+ *                  counter, a point takes part in O(log n) builds over n
+ *                  appended points, so an append costs amortised
+ *                  O(m log^2 n) for m points instead of a full rebuild.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kdlog.h"
+
+
+int kdlogInit( kdlog_t * log ) {
+
+  memset( log, 0, sizeof( *log ) );
+  log->pending = (float *) malloc( 3 * KDLOG_BASE * sizeof( float ) );
+  return log->pending != NULL;
+
+}
+
+
+/* Level of a block: floor( log2( n / KDLOG_BASE ) ) */
+static int kdlogLevel( size_t n ) {
+
+  int l = 0;
+  while ( l < KDLOG_LEVELS - 1 && n >= (size_t) KDLOG_BASE << ( l + 1 ) ) {
+    l++;
+  }
+  return l;
+
+}
+
+
+static void kdlogClear( kdlevel_t * level ) {
+
+  delete level->tree;
+  free( level->xyz );
+  free( level->ids );
+  memset( level, 0, sizeof( *level ) );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  kdlogBlock
+ *  Description:  Index a block of n points with their stream positions,
+ *                taking over both arrays, together with the levels it
+ *                carries into. Stream positions are 32 bit, so the carries
+ *                end before the last level.
+ ******************************************************************************/
+static int kdlogBlock( kdlog_t * log, float * xyz, uint32_t * ids, size_t n ) {
+
+  size_t total = n;
+  int l = kdlogLevel( total );
+  while ( log->levels[l].tree ) {
+    total += log->levels[l].count;
+    l = kdlogLevel( total );
+  }
+  float *    x = (float *) realloc( xyz, 3 * total * sizeof( float ) );
+  uint32_t * i = x ? (uint32_t *) realloc( ids, total * sizeof( uint32_t ) ) : NULL;
+  if ( !x || !i ) {
+    free( x ? x : xyz );
+    free( ids );
+    return 0;
+  }
+  xyz = x;
+  ids = i;
+
+  l = kdlogLevel( n );
+  while ( log->levels[l].tree ) {
+    kdlevel_t * level = log->levels + l;
+    memcpy( xyz + 3 * n, level->xyz, 3 * level->count * sizeof( float ) );
+    memcpy( ids + n, level->ids, level->count * sizeof( uint32_t ) );
+    n += level->count;
+    kdlogClear( level );
+    l = kdlogLevel( n );
+  }
+  kdlevel_t * level = log->levels + l;
+  level->xyz        = xyz;
+  level->ids        = ids;
+  level->count      = n;
+  level->points.xyz = xyz;
+  level->points.n   = n;
+  level->tree = new kdtree_t( 3, level->points,
+      nanoflann::KDTreeSingleIndexAdaptorParams( KDTREE_LEAF ) );
+  level->tree->buildIndex();
+  return 1;
+
+}
+
+
+int kdlogAppend( kdlog_t * log, const float * xyz, size_t n ) {
+
+  if ( n > UINT32_MAX - log->count ) {
+    return 0;
+  }
+  if ( log->waiting + n < KDLOG_BASE ) {
+    memcpy( log->pending + 3 * log->waiting, xyz, 3 * n * sizeof( float ) );
+    log->waiting += n;
+    log->count   += n;
+    return 1;
+  }
+
+  /* The buffer and the batch become one block */
+  size_t m = log->waiting + n;
+  float *    block = (float *) malloc( 3 * m * sizeof( float ) );
+  uint32_t * ids   = (uint32_t *) malloc( m * sizeof( uint32_t ) );
+  if ( !block || !ids ) {
+    free( block );
+    free( ids );
+    return 0;
+  }
+  memcpy( block, log->pending, 3 * log->waiting * sizeof( float ) );
+  memcpy( block + 3 * log->waiting, xyz, 3 * n * sizeof( float ) );
+  size_t i;
+  for ( i = 0; i < m; i++ ) {
+    ids[i] = log->count - log->waiting + i;
+  }
+  if ( !kdlogBlock( log, block, ids, m ) ) {
+    return 0;
+  }
+  log->count  += n;
+  log->waiting = 0;
+  return 1;
+
+}
+
+
+void kdlogFree( kdlog_t * log ) {
+
+  int l;
+  for ( l = 0; l < KDLOG_LEVELS; l++ ) {
+    kdlogClear( log->levels + l );
+  }
+  free( log->pending );
+  log->pending = NULL;
+  log->waiting = 0;
+  log->count   = 0;
+
+}
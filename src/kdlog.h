@@ -0,0 +1,105 @@
+/*******************************************************************************
+ *
+ *       Filename:  kdlog.h
+ *
+ *    Description:  Growing point index for streamed scans. Appended points
+ *                  are kept in static kd-trees of doubling sizes, merged
+ *                  like the digits of a binary counter, so every point is
+ *                  indexed again only a logarithmic number of times.
+ *
+ ******************************************************************************/
+
+#ifndef KDLOG_H
+#define KDLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree.h"
+
+/* Trees and the points of the smallest tree */
+#define KDLOG_LEVELS 32
+#define KDLOG_BASE   1024
+
+/* Points of a level with their positions in the appended stream */
+typedef struct {
+  float *    xyz;
+  uint32_t * ids;
+  size_t     count;
+  kdpoints_t points;         /* adaptor of the tree */
+  kdtree_t * tree;
+} kdlevel_t;
+
+/* Passes the hits of a level to a result set with their stream positions */
+template <class RESULT>
+struct kdlogids_t {
+
+  RESULT &         result;
+  const uint32_t * ids;
+
+  inline bool full() const {
+    return result.full();
+  }
+
+  inline float worstDist() const {
+    return result.worstDist();
+  }
+
+  inline bool addPoint( float dist, uint32_t index ) {
+    return result.addPoint( dist, ids[index] );
+  }
+
+};
+
+/* Level l holds none or from KDLOG_BASE << l to twice as many points. The
+ * last points appended, fewer than KDLOG_BASE, wait in a buffer that is
+ * searched point by point. The index holds pointers into itself and must
+ * not be copied. */
+struct kdlog_t {
+
+  kdlevel_t levels[KDLOG_LEVELS];
+  float *   pending;         /* KDLOG_BASE points */
+  size_t    waiting;         /* points in pending */
+  size_t    count;           /* points appended */
+
+  /* Search all levels and the buffer with a nanoflann result set, which
+   * receives stream positions. Returns false if the result set stopped the
+   * search. */
+  template <class RESULT>
+  bool findNeighbors( RESULT & result, const float * q ) const {
+    int l;
+    for ( l = KDLOG_LEVELS - 1; l >= 0; l-- ) {
+      if ( !levels[l].tree ) {
+        continue;
+      }
+      kdlogids_t<RESULT> hits = { result, levels[l].ids };
+      if ( !levels[l].tree->findNeighbors( hits, q, nanoflann::SearchParams() ) ) {
+        return false;
+      }
+    }
+    const uint32_t first = count - waiting;
+    size_t i;
+    for ( i = 0; i < waiting; i++ ) {
+      const float * p = pending + 3 * i;
+      float dx = q[0] - p[0];
+      float dy = q[1] - p[1];
+      float dz = q[2] - p[2];
+      float dist = dx * dx + dy * dy + dz * dz;
+      if ( dist < result.worstDist() && !result.addPoint( dist, first + i ) ) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+};
+
+int  kdlogInit( kdlog_t * log );
+
+/* Append n interleaved xyz points, copied, as stream positions count to
+ * count + n - 1. Returns 0 on error. */
+int  kdlogAppend( kdlog_t * log, const float * xyz, size_t n );
+
+void kdlogFree( kdlog_t * log );
+
+#endif /* KDLOG_H */
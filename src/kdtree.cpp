@@ -0,0 +1,841 @@
+/*******************************************************************************
+ *
+ *       Filename:  kdtree.cpp
+ *
+ *    Description:  Batch queries, storage and flat copies of built
+ *                  nanoflann indices.
+ *
+ *                  A file holds a header and one section per tree: the
+ *                  content hash and count of its points, its nodes in
+ *                  preorder with children as node positions, and the
+ *                  permutation of the points. Loading maps the file,
+ *                  checks every section against the points of its tree
+ *                  and the bounds of every node, copies the permutation
+ *                  and links the nodes into one pool allocation, which
+ *                  costs a fraction of a build. Files are written to a
+ *                  temporary name first and renamed, so a reader never
+ *                  sees a partial file.
+ *
+ *                  Batch queries are sorted along a Morton curve so that
+ *                  consecutive queries walk the same nodes, and run in
+ *                  parallel chunks of that order.
+ *
+ ******************************************************************************/
+
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "kdtree.h"
+
+#define KDTREE_MAGIC "KDTREE01"
+
+/* Words per chunk of the content hash */
+#define KDTREE_HASH_CHUNK ( 1 << 20 )
+
+/* Queries per chunk of a batch */
+#define KDTREE_BATCH 1024
+
+/* No child, marks leaves */
+#define KDTREE_NONE 0xffffffffu
+
+typedef struct {
+  char     magic[8];
+  uint32_t trees;
+  uint32_t leaf;
+} kdheader_t;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t points;
+  uint64_t nodes;
+  float    bbox[6];              /* low and high of every dimension */
+} kdsection_t;
+
+typedef struct {
+  uint32_t child1, child2;       /* KDTREE_NONE for leaves */
+  uint32_t feat;
+  uint32_t low, high;            /* leaves: range of the permutation,
+                                    others: float bits of the split */
+} kdnode_t;
+
+
+namespace nanoflann {
+
+template <typename T> struct KDTreeAccess;
+
+template <>
+struct KDTreeAccess<kdtree_t> {
+
+  typedef kdtree_t::Node node_t;
+
+  static const kdpoints_t & points( const kdtree_t * tree ) {
+    return tree->dataset;
+  }
+
+  static uint32_t flatten( const node_t * node, std::vector<kdnode_t> & out ) {
+    uint32_t k = out.size();
+    out.push_back( kdnode_t() );
+    kdnode_t r;
+    if ( !node->child1 && !node->child2 ) {
+      r.child1 = r.child2 = KDTREE_NONE;
+      r.feat = 0;
+      r.low  = node->lr.left;
+      r.high = node->lr.right;
+    } else {
+      r.feat = node->sub.divfeat;
+      memcpy( &r.low,  &node->sub.divlow,  sizeof( float ) );
+      memcpy( &r.high, &node->sub.divhigh, sizeof( float ) );
+      r.child1 = flatten( node->child1, out );
+      r.child2 = flatten( node->child2, out );
+    }
+    out[k] = r;
+    return k;
+  }
+
+  static void save( const kdtree_t * tree, uint64_t hash, FILE * f, int * ok ) {
+    kdsection_t s;
+    memset( &s, 0, sizeof( s ) );
+    s.hash = hash;
+    std::vector<kdnode_t> nodes;
+    if ( tree ) {
+      s.points = tree->m_size;
+      flatten( tree->root_node, nodes );
+      s.nodes = nodes.size();
+      for ( int d = 0; d < 3; d++ ) {
+        s.bbox[d]     = tree->root_bbox[d].low;
+        s.bbox[d + 3] = tree->root_bbox[d].high;
+      }
+    }
+    *ok &= fwrite( &s, sizeof( s ), 1, f ) == 1;
+    if ( tree ) {
+      *ok &= fwrite( &nodes[0], sizeof( kdnode_t ), nodes.size(), f ) == nodes.size();
+      *ok &= fwrite( &tree->vind[0], sizeof( uint32_t ), s.points, f ) == s.points;
+    }
+  }
+
+  /* Length of the section at p if it fits into size bytes, 0 otherwise */
+  static size_t length( const char * p, size_t size ) {
+    kdsection_t s;
+    if ( size < sizeof( s ) ) {
+      return 0;
+    }
+    memcpy( &s, p, sizeof( s ) );
+    size -= sizeof( s );
+    if ( s.nodes > size / sizeof( kdnode_t )
+        || s.points > ( size - s.nodes * sizeof( kdnode_t ) ) / sizeof( uint32_t ) ) {
+      return 0;
+    }
+    return sizeof( s ) + s.nodes * sizeof( kdnode_t ) + s.points * sizeof( uint32_t );
+  }
+
+  /* Check a section which fits against the points of tree, which may be
+   * NULL, and the bounds of its nodes. Preorder puts children after their
+   * parent, which rules out cycles. */
+  static int check( const kdtree_t * tree, uint64_t hash, const char * p ) {
+    kdsection_t s;
+    memcpy( &s, p, sizeof( s ) );
+    const uint64_t n = tree ? tree->dataset.n : 0;
+    if ( s.hash != hash || s.points != n || !s.nodes != !n ) {
+      return 0;
+    }
+    const char * q = p + sizeof( s );
+    uint64_t k;
+    for ( k = 0; k < s.nodes; k++ ) {
+      kdnode_t r;
+      memcpy( &r, q + k * sizeof( r ), sizeof( r ) );
+      if ( r.child1 == KDTREE_NONE && r.child2 == KDTREE_NONE ) {
+        if ( r.low > r.high || r.high > n ) {
+          return 0;
+        }
+      } else if ( r.child1 <= k || r.child2 <= k || r.child1 >= s.nodes
+          || r.child2 >= s.nodes || r.feat > 2 ) {
+        return 0;
+      }
+    }
+    q += s.nodes * sizeof( kdnode_t );
+    for ( k = 0; k < n; k++ ) {
+      uint32_t v;
+      memcpy( &v, q + k * sizeof( v ), sizeof( v ) );
+      if ( v >= n ) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  /* Take over a checked section, returns 0 if out of memory */
+  static int link( kdtree_t * tree, const char * p ) {
+    kdsection_t s;
+    memcpy( &s, p, sizeof( s ) );
+    const char * q = p + sizeof( s );
+    tree->freeIndex();
+    node_t * pool = tree->pool.allocate<node_t>( s.nodes );
+    if ( !pool ) {
+      return 0;
+    }
+    uint64_t k;
+    for ( k = 0; k < s.nodes; k++ ) {
+      kdnode_t r;
+      memcpy( &r, q + k * sizeof( r ), sizeof( r ) );
+      node_t * node = pool + k;
+      if ( r.child1 == KDTREE_NONE ) {
+        node->child1 = node->child2 = NULL;
+        node->lr.left  = r.low;
+        node->lr.right = r.high;
+      } else {
+        node->child1 = pool + r.child1;
+        node->child2 = pool + r.child2;
+        node->sub.divfeat = r.feat;
+        memcpy( &node->sub.divlow,  &r.low,  sizeof( float ) );
+        memcpy( &node->sub.divhigh, &r.high, sizeof( float ) );
+      }
+    }
+    q += s.nodes * sizeof( kdnode_t );
+    tree->vind.resize( s.points );
+    memcpy( &tree->vind[0], q, s.points * sizeof( uint32_t ) );
+    tree->m_size = s.points;
+    tree->root_bbox.resize( 3 );
+    for ( int d = 0; d < 3; d++ ) {
+      tree->root_bbox[d].low  = s.bbox[d];
+      tree->root_bbox[d].high = s.bbox[d + 3];
+    }
+    tree->root_node = pool;
+    return 1;
+  }
+
+  /* Copy the nodes breadth first, so the children of a node are adjacent */
+  static int flat( const kdtree_t * tree, kdflat_t * flat ) {
+    std::vector<const node_t *> queue( 1, tree->root_node );
+    size_t k;
+    for ( k = 0; k < queue.size(); k++ ) {
+      if ( queue[k]->child1 ) {
+        queue.push_back( queue[k]->child1 );
+        queue.push_back( queue[k]->child2 );
+      }
+    }
+    const size_t n = tree->m_size;
+    flat->count = queue.size();
+    flat->nodes = (kdflatnode_t *) malloc( flat->count * sizeof( kdflatnode_t ) );
+    flat->xyz   = (float *) malloc( 3 * n * sizeof( float ) );
+    flat->index = (uint32_t *) malloc( n * sizeof( uint32_t ) );
+    if ( !flat->nodes || !flat->xyz || !flat->index ) {
+      return 0;
+    }
+    uint32_t next = 1;
+    for ( k = 0; k < flat->count; k++ ) {
+      const node_t * node = queue[k];
+      kdflatnode_t * r = flat->nodes + k;
+      if ( !node->child1 ) {
+        r->range[0] = node->lr.left;
+        r->range[1] = node->lr.right;
+        r->child    = 0;
+        r->feat     = KDFLAT_LEAF;
+      } else {
+        r->split[0] = node->sub.divlow;
+        r->split[1] = node->sub.divhigh;
+        r->child    = next;
+        r->feat     = node->sub.divfeat;
+        next += 2;
+      }
+    }
+    const float * xyz = tree->dataset.xyz;
+    for ( k = 0; k < n; k++ ) {
+      memcpy( flat->xyz + 3 * k, xyz + 3 * (size_t) tree->vind[k], 3 * sizeof( float ) );
+      flat->index[k] = tree->vind[k];
+    }
+    for ( int d = 0; d < 3; d++ ) {
+      flat->bbox[d]     = tree->root_bbox[d].low;
+      flat->bbox[d + 3] = tree->root_bbox[d].high;
+    }
+    return 1;
+  }
+
+  /* A node of b still close enough to the current node of a */
+  struct candidate_t {
+    const node_t * node;
+    float          box[6];     /* frame of b */
+    float          moved[6];   /* bounds of box in the frame of a */
+  };
+
+  struct overlap_t {
+    const kdtree_t *         a;
+    const kdtree_t *         b;
+    float                    m[12];    /* b into a, column-major */
+    float                    radius;   /* squared */
+    size_t                   limit;    /* stop at this count, 0 for none */
+    size_t                   found;
+    std::vector<candidate_t> stack;    /* candidates of every level */
+  };
+
+  static void root( const kdtree_t * tree, float * box ) {
+    for ( int d = 0; d < 3; d++ ) {
+      box[d]     = tree->root_bbox[d].low;
+      box[d + 3] = tree->root_bbox[d].high;
+    }
+  }
+
+  /* Boxes of the children: the points of the first lie at most at the low
+   * bound of the split, those of the second at least at the high bound */
+  static void split( const node_t * node, const float * box, float * first,
+      float * second ) {
+    memcpy( first,  box, 6 * sizeof( float ) );
+    memcpy( second, box, 6 * sizeof( float ) );
+    first[ node->sub.divfeat + 3 ] = node->sub.divlow;
+    second[ node->sub.divfeat ]    = node->sub.divhigh;
+  }
+
+  static size_t size( const node_t * node ) {
+    const node_t * left = node, * right = node;
+    while ( left->child1 ) {
+      left = left->child1;
+    }
+    while ( right->child2 ) {
+      right = right->child2;
+    }
+    return right->lr.right - left->lr.left;
+  }
+
+  static float side( const float * box ) {
+    float s = 0;
+    for ( int d = 0; d < 3; d++ ) {
+      s = std::max( s, box[d + 3] - box[d] );
+    }
+    return s;
+  }
+
+  /* Bounds of a box of b in the frame of a: the centre is moved, the half
+   * extents are taken through the absolute rotation */
+  static void move( const float * m, const float * box, float * out ) {
+    float c[3], h[3];
+    int d;
+    for ( d = 0; d < 3; d++ ) {
+      c[d] = 0.5f * ( box[d] + box[d + 3] );
+      h[d] = 0.5f * ( box[d + 3] - box[d] );
+    }
+    for ( d = 0; d < 3; d++ ) {
+      float cd = m[d] * c[0] + m[d + 3] * c[1] + m[d + 6] * c[2] + m[d + 9];
+      float hd = fabsf( m[d] ) * h[0] + fabsf( m[d + 3] ) * h[1]
+        + fabsf( m[d + 6] ) * h[2];
+      hd += 1e-5f * ( fabsf( cd ) + hd );
+      out[d]     = cd - hd;
+      out[d + 3] = cd + hd;
+    }
+  }
+
+  /* Squared smallest and largest distance between the points of two boxes */
+  static float nearest( const float * p, const float * q ) {
+    float s = 0;
+    for ( int d = 0; d < 3; d++ ) {
+      float e = std::max( 0.0f, std::max( q[d] - p[d + 3], p[d] - q[d + 3] ) );
+      s += e * e;
+    }
+    return s;
+  }
+
+  static float farthest( const float * p, const float * q ) {
+    float s = 0;
+    for ( int d = 0; d < 3; d++ ) {
+      float e = std::max( q[d + 3] - p[d], p[d + 3] - q[d] );
+      s += e * e;
+    }
+    return s;
+  }
+
+  /* Whether a point of the subtree of b lies within the radius of p, given
+   * in the frame of b */
+  static bool hit( const overlap_t & o, const node_t * node, const float * box,
+      const float * p ) {
+    float s = 0;
+    for ( int d = 0; d < 3; d++ ) {
+      float e = std::max( 0.0f, std::max( box[d] - p[d], p[d] - box[d + 3] ) );
+      s += e * e;
+    }
+    if ( s >= o.radius ) {
+      return false;
+    }
+    if ( !node->child1 ) {
+      const float * xyz = o.b->dataset.xyz;
+      for ( uint32_t i = node->lr.left; i < node->lr.right; i++ ) {
+        const float * q = xyz + 3 * (size_t) o.b->vind[i];
+        float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+        if ( dx * dx + dy * dy + dz * dz < o.radius ) {
+          return true;
+        }
+      }
+      return false;
+    }
+    float first[6], second[6];
+    split( node, box, first, second );
+    if ( p[ node->sub.divfeat ] - node->sub.divlow
+        + p[ node->sub.divfeat ] - node->sub.divhigh < 0 ) {
+      return hit( o, node->child1, first, p ) || hit( o, node->child2, second, p );
+    }
+    return hit( o, node->child2, second, p ) || hit( o, node->child1, first, p );
+  }
+
+  /* Count the points of the subtree of a with a hit among the candidates
+   * from begin on. The candidates close to the node are pushed for its
+   * children, those larger than the node are split first. */
+  static void count( overlap_t & o, const node_t * node, const float * box,
+      size_t begin ) {
+    if ( o.limit && o.found >= o.limit ) {
+      return;
+    }
+    const size_t end = o.stack.size();
+    const float  s   = side( box );
+    for ( size_t k = begin; k < end; k++ ) {
+      candidate_t c = o.stack[k];
+      if ( nearest( box, c.moved ) >= o.radius ) {
+        continue;
+      }
+      if ( farthest( box, c.moved ) < o.radius ) {
+        o.stack.resize( end );
+        o.found += size( node );
+        return;
+      }
+      if ( !node->child1 || !c.node->child1 || side( c.moved ) <= s ) {
+        o.stack.push_back( c );
+        continue;
+      }
+      candidate_t first, second;
+      first.node  = c.node->child1;
+      second.node = c.node->child2;
+      split( c.node, c.box, first.box, second.box );
+      move( o.m, first.box, first.moved );
+      move( o.m, second.box, second.moved );
+      o.stack.push_back( first );
+      o.stack.push_back( second );
+    }
+    if ( o.stack.size() == end ) {
+      return;
+    }
+    if ( !node->child1 ) {
+      /* Every point of the leaf, taken into the frame of b */
+      const float * m   = o.m;
+      const float * xyz = o.a->dataset.xyz;
+      for ( uint32_t i = node->lr.left; i < node->lr.right; i++ ) {
+        const float * p = xyz + 3 * (size_t) o.a->vind[i];
+        float v[3] = { p[0] - m[9], p[1] - m[10], p[2] - m[11] };
+        float q[3];
+        for ( int d = 0; d < 3; d++ ) {
+          q[d] = m[3 * d] * v[0] + m[3 * d + 1] * v[1] + m[3 * d + 2] * v[2];
+        }
+        for ( size_t k = end; k < o.stack.size(); k++ ) {
+          if ( hit( o, o.stack[k].node, o.stack[k].box, q ) ) {
+            o.found++;
+            break;
+          }
+        }
+      }
+    } else {
+      float first[6], second[6];
+      split( node, box, first, second );
+      count( o, node->child1, first, end );
+      count( o, node->child2, second, end );
+    }
+    o.stack.resize( end );
+  }
+
+  static size_t overlap( const kdtree_t * a, const kdtree_t * b,
+      const double * mat, float radius, size_t limit ) {
+    if ( !a->root_node || !b->root_node ) {
+      return 0;
+    }
+    overlap_t o;
+    o.a = a;
+    o.b = b;
+    o.radius = radius * radius;
+    o.limit  = limit;
+    o.found  = 0;
+    for ( int c = 0; c < 4; c++ ) {
+      for ( int d = 0; d < 3; d++ ) {
+        o.m[ 3 * c + d ] = mat ? mat[ 4 * c + d ] : c == d;
+      }
+    }
+    candidate_t r;
+    r.node = b->root_node;
+    root( b, r.box );
+    move( o.m, r.box, r.moved );
+    o.stack.push_back( r );
+    float box[6];
+    root( a, box );
+    count( o, a->root_node, box, 0 );
+    return o.found;
+  }
+
+};
+
+}
+
+typedef nanoflann::KDTreeAccess<kdtree_t> kdaccess_t;
+
+
+/*******************************************************************************
+ *         Name:  kdtreeHash
+ *  Description:  Content hash of the points of a tree, over fixed chunks in
+ *                parallel, combined in order.
+ ******************************************************************************/
+static uint64_t kdtreeHash( const kdtree_t * tree ) {
+
+  if ( !tree ) {
+    return 0;
+  }
+  const kdpoints_t & pts = kdaccess_t::points( tree );
+  const uint32_t * w = (const uint32_t *) pts.xyz;
+  const size_t words = 3 * pts.n;
+  const long chunks = ( words + KDTREE_HASH_CHUNK - 1 ) / KDTREE_HASH_CHUNK;
+  std::vector<uint64_t> part( chunks );
+  #pragma omp parallel for schedule( static )
+  for ( long c = 0; c < chunks; c++ ) {
+    size_t end = ( c + 1 ) * (size_t) KDTREE_HASH_CHUNK < words
+      ? ( c + 1 ) * (size_t) KDTREE_HASH_CHUNK : words;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( size_t i = c * (size_t) KDTREE_HASH_CHUNK; i < end; i++ ) {
+      h = ( h ^ w[i] ) * 0x100000001b3ULL;
+    }
+    part[c] = h;
+  }
+  uint64_t h = pts.n;
+  for ( long c = 0; c < chunks; c++ ) {
+    /* splitmix64 finalizer */
+    h ^= part[c];
+    h += 0x9e3779b97f4a7c15ULL;
+    h = ( h ^ ( h >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    h = ( h ^ ( h >> 27 ) ) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+  }
+  return h;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  kdtreeLoad
+ *  Description:  Load the trees from path if it holds all of them.
+ ******************************************************************************/
+static int kdtreeLoad( kdtree_t * const * trees, int n, const uint64_t * hash,
+    const char * path ) {
+
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) {
+    return 0;
+  }
+  struct stat st;
+  void * map = MAP_FAILED;
+  if ( !fstat( fd, &st ) && st.st_size > (off_t) sizeof( kdheader_t ) ) {
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  }
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    return 0;
+  }
+
+  const char * p = (const char *) map;
+  size_t size = st.st_size;
+  kdheader_t h;
+  memcpy( &h, p, sizeof( h ) );
+  int ok = !memcmp( h.magic, KDTREE_MAGIC, 8 ) && h.trees == (uint32_t) n
+    && h.leaf == KDTREE_LEAF;
+  size_t offset = sizeof( h );
+
+  /* Locate the sections, then check all of them before any tree is
+   * touched, so a stale file leaves the trees as they were */
+  std::vector<size_t> first( n );
+  int i;
+  for ( i = 0; ok && i < n; i++ ) {
+    first[i] = offset;
+    size_t length = kdaccess_t::length( p + offset, size - offset );
+    ok = length > 0;
+    offset += length;
+  }
+  ok = ok && offset == size;
+  std::vector<char> valid( n, 1 );
+  if ( ok ) {
+    #pragma omp parallel for schedule( dynamic, 1 )
+    for ( int i = 0; i < n; i++ ) {
+      valid[i] = kdaccess_t::check( trees[i], hash[i], p + first[i] );
+    }
+    for ( i = 0; i < n; i++ ) {
+      ok &= valid[i];
+    }
+  }
+  if ( ok ) {
+    #pragma omp parallel for schedule( dynamic, 1 )
+    for ( int i = 0; i < n; i++ ) {
+      if ( trees[i] ) {
+        valid[i] = kdaccess_t::link( trees[i], p + first[i] );
+      }
+    }
+    for ( i = 0; i < n; i++ ) {
+      ok &= valid[i];
+    }
+  }
+  munmap( map, size );
+  return ok;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  kdtreeSave
+ *  Description:  Store the built trees in path.
+ ******************************************************************************/
+static int kdtreeSave( kdtree_t * const * trees, int n, const uint64_t * hash,
+    const char * path ) {
+
+  std::string tmp = std::string( path ) + ".tmp";
+  FILE * f = fopen( tmp.c_str(), "wb" );
+  if ( !f ) {
+    return 0;
+  }
+  kdheader_t h;
+  memcpy( h.magic, KDTREE_MAGIC, 8 );
+  h.trees = n;
+  h.leaf  = KDTREE_LEAF;
+  int ok = fwrite( &h, sizeof( h ), 1, f ) == 1;
+  int i;
+  for ( i = 0; ok && i < n; i++ ) {
+    kdaccess_t::save( trees[i], hash[i], f, &ok );
+  }
+  ok &= !fclose( f );
+  if ( !ok || rename( tmp.c_str(), path ) ) {
+    remove( tmp.c_str() );
+    return 0;
+  }
+  return 1;
+
+}
+
+
+/* Spread the low 21 bits of v to every third bit */
+static inline uint64_t kdtreeSpread( uint32_t v ) {
+
+  uint64_t x = v & 0x1fffff;
+  x = ( x | x << 32 ) & 0x1f00000000ffffULL;
+  x = ( x | x << 16 ) & 0x1f0000ff0000ffULL;
+  x = ( x | x << 8 )  & 0x100f00f00f00f00fULL;
+  x = ( x | x << 4 )  & 0x10c30c30c30c30c3ULL;
+  x = ( x | x << 2 )  & 0x1249249249249249ULL;
+  return x;
+
+}
+
+
+typedef struct {
+  uint64_t code;
+  uint32_t index;
+} kdmorton_t;
+
+
+static bool kdtreeMortonLess( const kdmorton_t & a, const kdmorton_t & b ) {
+
+  return a.code < b.code || ( a.code == b.code && a.index < b.index );
+
+}
+
+
+void kdtreeMortonOrder( const float * xyz, size_t n, uint32_t * order ) {
+
+  if ( !n ) {
+    return;
+  }
+  float lo[3], hi[3];
+  int d;
+  for ( d = 0; d < 3; d++ ) {
+    float l = xyz[d], h = xyz[d];
+    #pragma omp parallel for reduction( min:l ) reduction( max:h )
+    for ( size_t i = 1; i < n; i++ ) {
+      float v = xyz[ 3 * i + d ];
+      l = v < l ? v : l;
+      h = v > h ? v : h;
+    }
+    lo[d] = l;
+    hi[d] = h;
+  }
+  float scale[3];
+  for ( d = 0; d < 3; d++ ) {
+    scale[d] = hi[d] > lo[d] ? 2097151.0f / ( hi[d] - lo[d] ) : 0;
+  }
+  std::vector<kdmorton_t> keys( n );
+  #pragma omp parallel for schedule( static )
+  for ( size_t i = 0; i < n; i++ ) {
+    uint64_t code = 0;
+    for ( int d = 0; d < 3; d++ ) {
+      float v = ( xyz[ 3 * i + d ] - lo[d] ) * scale[d];
+      uint32_t c = v > 0 ? ( v < 2097151.0f ? (uint32_t) v : 2097151 ) : 0;
+      code |= kdtreeSpread( c ) << d;
+    }
+    keys[i].code  = code;
+    keys[i].index = i;
+  }
+  std::sort( keys.begin(), keys.end(), kdtreeMortonLess );
+  for ( size_t i = 0; i < n; i++ ) {
+    order[i] = keys[i].index;
+  }
+
+}
+
+
+void kdtreeKnnBatch( const kdtree_t * tree, const float * q, size_t n, int k,
+    uint32_t * idx, float * dist ) {
+
+  std::vector<uint32_t> order( n );
+  kdtreeMortonOrder( q, n, &order[0] );
+  const long chunks = ( n + KDTREE_BATCH - 1 ) / KDTREE_BATCH;
+  #pragma omp parallel for schedule( dynamic, 1 )
+  for ( long c = 0; c < chunks; c++ ) {
+    size_t end = ( c + 1 ) * KDTREE_BATCH < (long) n ? ( c + 1 ) * KDTREE_BATCH : n;
+    for ( size_t s = c * KDTREE_BATCH; s < end; s++ ) {
+      size_t i = order[s];
+      nanoflann::KNNResultSet<float, uint32_t> result( k );
+      result.init( idx + k * i, dist + k * i );
+      tree->findNeighbors( result, q + 3 * i, nanoflann::SearchParams() );
+      for ( size_t j = result.size(); j < (size_t) k; j++ ) {
+        idx[ k * i + j ]  = UINT32_MAX;
+        dist[ k * i + j ] = FLT_MAX;
+      }
+    }
+  }
+
+}
+
+
+int kdtreeRadiusBatch( const kdtree_t * tree, const float * q, size_t n,
+    float maxdist, kdcsr_t * out ) {
+
+  std::vector<uint32_t> order( n );
+  kdtreeMortonOrder( q, n, &order[0] );
+  out->first = (size_t *) malloc( ( n + 1 ) * sizeof( size_t ) );
+  out->idx   = NULL;
+  out->dist  = NULL;
+  if ( !out->first ) {
+    return 0;
+  }
+
+  /* Every chunk of queries collects its neighbours in order, which are
+   * moved to the positions of their queries once all counts are known */
+  const long chunks = ( n + KDTREE_BATCH - 1 ) / KDTREE_BATCH;
+  std::vector<std::vector<std::pair<uint32_t, float> > > hits( chunks );
+  #pragma omp parallel
+  {
+    std::vector<std::pair<uint32_t, float> > found;
+    #pragma omp for schedule( dynamic, 1 )
+    for ( long c = 0; c < chunks; c++ ) {
+      size_t end = ( c + 1 ) * KDTREE_BATCH < (long) n ? ( c + 1 ) * KDTREE_BATCH : n;
+      for ( size_t s = c * KDTREE_BATCH; s < end; s++ ) {
+        size_t i = order[s];
+        nanoflann::RadiusResultSet<float, uint32_t> result( maxdist, found );
+        tree->findNeighbors( result, q + 3 * i, nanoflann::SearchParams() );
+        out->first[ i + 1 ] = found.size();
+        hits[c].insert( hits[c].end(), found.begin(), found.end() );
+      }
+    }
+  }
+  out->first[0] = 0;
+  size_t i;
+  for ( i = 0; i < n; i++ ) {
+    out->first[ i + 1 ] += out->first[i];
+  }
+  out->idx  = (uint32_t *) malloc( ( out->first[n] + 1 ) * sizeof( uint32_t ) );
+  out->dist = (float *) malloc( ( out->first[n] + 1 ) * sizeof( float ) );
+  if ( !out->idx || !out->dist ) {
+    kdcsrFree( out );
+    return 0;
+  }
+  #pragma omp parallel for schedule( dynamic, 1 )
+  for ( long c = 0; c < chunks; c++ ) {
+    size_t end = ( c + 1 ) * KDTREE_BATCH < (long) n ? ( c + 1 ) * KDTREE_BATCH : n;
+    size_t h = 0;
+    for ( size_t s = c * KDTREE_BATCH; s < end; s++ ) {
+      size_t i = order[s];
+      for ( size_t j = out->first[i]; j < out->first[ i + 1 ]; j++, h++ ) {
+        out->idx[j]  = hits[c][h].first;
+        out->dist[j] = hits[c][h].second;
+      }
+    }
+    std::vector<std::pair<uint32_t, float> >().swap( hits[c] );
+  }
+  return 1;
+
+}
+
+
+size_t kdtreeOverlap( const kdtree_t * a, const kdtree_t * b,
+    const double * mat, float radius, size_t limit ) {
+
+  return kdaccess_t::overlap( a, b, mat, radius, limit );
+
+}
+
+
+void kdcsrFree( kdcsr_t * csr ) {
+
+  free( csr->first );
+  free( csr->idx );
+  free( csr->dist );
+  csr->first = NULL;
+  csr->idx   = NULL;
+  csr->dist  = NULL;
+
+}
+
+
+int kdflatBuild( kdflat_t * flat, const kdtree_t * tree ) {
+
+  memset( flat, 0, sizeof( *flat ) );
+  if ( !kdaccess_t::flat( tree, flat ) ) {
+    kdflatFree( flat );
+    return 0;
+  }
+  return 1;
+
+}
+
+
+void kdflatFree( kdflat_t * flat ) {
+
+  free( flat->nodes );
+  free( flat->xyz );
+  free( flat->index );
+  flat->nodes = NULL;
+  flat->xyz   = NULL;
+  flat->index = NULL;
+  flat->count = 0;
+
+}
+
+
+int kdtreeBuild( kdtree_t * const * trees, int n, const char * path ) {
+
+  std::vector<uint64_t> hash( n );
+  if ( path ) {
+    for ( int i = 0; i < n; i++ ) {
+      hash[i] = kdtreeHash( trees[i] );
+    }
+    if ( kdtreeLoad( trees, n, &hash[0], path ) ) {
+      return 1;
+    }
+  }
+  #pragma omp parallel for schedule( dynamic, 1 )
+  for ( int i = 0; i < n; i++ ) {
+    if ( trees[i] ) {
+      trees[i]->buildIndex();
+    }
+  }
+  if ( path && !kdtreeSave( trees, n, &hash[0], path ) ) {
+    fprintf( stderr, "warning: Cannot write the index %s.\n", path );
+  }
+  return 0;
+
+}
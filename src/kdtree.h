@@ -0,0 +1,198 @@
+/*******************************************************************************
+ *
+ *       Filename:  kdtree.h
+ *
+ *    Description:  nanoflann index over interleaved xyz float points. The
+ *                  adaptor reads the point buffer in place, the index only
+ *                  adds its permutation and nodes. Built indices can be
+ *                  kept in a file and mapped by later runs.
+ *
+ ******************************************************************************/
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nanoflann.hpp"
+
+/* Points per leaf */
+#define KDTREE_LEAF 16
+
+/* Dataset adaptor for nanoflann. The points must outlive the index. */
+struct kdpoints_t {
+
+  const float * xyz;
+  size_t        n;
+
+  inline size_t kdtree_get_point_count() const {
+    return n;
+  }
+
+  inline float kdtree_distance( const float * p, const size_t i,
+      size_t ) const {
+    const float * q = xyz + 3 * i;
+    float dx = p[0] - q[0];
+    float dy = p[1] - q[1];
+    float dz = p[2] - q[2];
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  inline float kdtree_get_pt( const size_t i, int dim ) const {
+    return xyz[ 3 * i + dim ];
+  }
+
+  template <class BBOX>
+  bool kdtree_get_bbox( BBOX & ) const {
+    return false;
+  }
+
+};
+
+/* Squared euclidean distances, 32 bit point indices */
+typedef nanoflann::KDTreeSingleIndexAdaptor<
+  nanoflann::L2_Simple_Adaptor<float, kdpoints_t>, kdpoints_t, 3, uint32_t >
+  kdtree_t;
+
+/* Split dimension of flat leaves */
+#define KDFLAT_LEAF 3
+
+/* Node of a flat tree, 16 bytes. The children of a node are adjacent. */
+typedef struct {
+  union {
+    float    split[2];       /* low and high bound of the split */
+    uint32_t range[2];       /* first and end of the points of a leaf */
+  };
+  uint32_t child;            /* first child, the second follows it */
+  uint32_t feat;             /* split dimension or KDFLAT_LEAF */
+} kdflatnode_t;
+
+/* A built tree copied into one node array in breadth-first order with 32 bit
+ * child positions. The points are copied in leaf order, so a leaf reads its
+ * points sequentially. Searches take nanoflann result sets, visit the
+ * points in the same order, stop where the tree does when addPoint returns
+ * false and return the same results as the tree they were made from,
+ * without allocating. */
+struct kdflat_t {
+
+  kdflatnode_t * nodes;
+  size_t         count;      /* nodes */
+  float *        xyz;        /* points in leaf order */
+  uint32_t *     index;      /* their positions in the source points */
+  float          bbox[6];    /* low and high of every dimension */
+
+  template <class RESULT>
+  void findNeighbors( RESULT & result, const float * q ) const {
+    float dists[3] = { 0, 0, 0 };
+    float mindist = 0;
+    int d;
+    for ( d = 0; d < 3; d++ ) {
+      if ( q[d] < bbox[d] ) {
+        dists[d] = ( q[d] - bbox[d] ) * ( q[d] - bbox[d] );
+        mindist += dists[d];
+      }
+      if ( q[d] > bbox[ d + 3 ] ) {
+        dists[d] = ( q[d] - bbox[ d + 3 ] ) * ( q[d] - bbox[ d + 3 ] );
+        mindist += dists[d];
+      }
+    }
+    search( result, q, 0, mindist, dists );
+  }
+
+  /* Returns false if the result set stopped the search */
+  template <class RESULT>
+  bool search( RESULT & result, const float * q, uint32_t n, float mindist,
+      float * dists ) const {
+    const kdflatnode_t & node = nodes[n];
+    if ( node.feat == KDFLAT_LEAF ) {
+      float worst = result.worstDist();
+      uint32_t i;
+      for ( i = node.range[0]; i < node.range[1]; i++ ) {
+        const float * p = xyz + 3 * i;
+        float dx = q[0] - p[0];
+        float dy = q[1] - p[1];
+        float dz = q[2] - p[2];
+        float dist = dx * dx + dy * dy + dz * dz;
+        if ( dist < worst && !result.addPoint( dist, index[i] ) ) {
+          return false;
+        }
+      }
+      return true;
+    }
+    const uint32_t f = node.feat;
+    const float v = q[f];
+    uint32_t best, other;
+    float cut;
+    if ( ( v - node.split[0] ) + ( v - node.split[1] ) < 0 ) {
+      best  = node.child;
+      other = node.child + 1;
+      cut   = ( v - node.split[1] ) * ( v - node.split[1] );
+    } else {
+      best  = node.child + 1;
+      other = node.child;
+      cut   = ( v - node.split[0] ) * ( v - node.split[0] );
+    }
+    if ( !search( result, q, best, mindist, dists ) ) {
+      return false;
+    }
+    float dst = dists[f];
+    mindist = mindist + cut - dst;
+    dists[f] = cut;
+    if ( mindist <= result.worstDist() && !search( result, q, other, mindist, dists ) ) {
+      return false;
+    }
+    dists[f] = dst;
+    return true;
+  }
+
+};
+
+/* Copy a built tree into a flat tree. Returns 0 on error. */
+int  kdflatBuild( kdflat_t * flat, const kdtree_t * tree );
+
+void kdflatFree( kdflat_t * flat );
+
+/* Neighbours of a batch of queries: those of query i are idx[first[i]] to
+ * idx[first[i + 1] - 1], with squared distances in dist */
+typedef struct {
+  size_t *   first;
+  uint32_t * idx;
+  float *    dist;
+} kdcsr_t;
+
+/* Order of n points along a Morton curve over their bounding box. Queries
+ * in this order visit the same nodes one after another. */
+void kdtreeMortonOrder( const float * xyz, size_t n, uint32_t * order );
+
+/* The k nearest neighbours of n queries, run in Morton order in parallel.
+ * Row i of the n x k arrays idx and dist receives those of query i by
+ * increasing squared distance, padded with UINT32_MAX and FLT_MAX if the
+ * tree holds fewer than k points. */
+void kdtreeKnnBatch( const kdtree_t * tree, const float * q, size_t n, int k,
+    uint32_t * idx, float * dist );
+
+/* The neighbours within squared distance maxdist of n queries, run in
+ * Morton order in parallel, in search order. out is released with
+ * kdcsrFree. Returns 0 on error. */
+int  kdtreeRadiusBatch( const kdtree_t * tree, const float * q, size_t n,
+    float maxdist, kdcsr_t * out );
+
+void kdcsrFree( kdcsr_t * csr );
+
+/* Points of tree a with a point of tree b closer than radius, the points of
+ * b moved into the frame of a by the rigid column-major pose mat, NULL for
+ * none. Both trees are walked together and node pairs are pruned by the
+ * distance of their boxes. The walk stops once limit points are counted, 0
+ * counts all; divided by the points of a, the full count is the overlap
+ * ratio. */
+size_t kdtreeOverlap( const kdtree_t * a, const kdtree_t * b,
+    const double * mat, float radius, size_t limit );
+
+/* Build the n trees, NULL for empty point sets, in parallel. If path is set
+ * and holds trees of the same points, by content hash, they are loaded from
+ * it instead, otherwise the built trees are stored there for later runs.
+ * Returns 1 if the trees were loaded, 0 if they were built. */
+int  kdtreeBuild( kdtree_t * const * trees, int n, const char * path );
+
+#endif /* KDTREE_H */
@@ -0,0 +1,210 @@
+/*******************************************************************************
+ *
+ *       Filename:  las.cpp
+ *
+ *    Description:  Streaming LAS 1.2/1.4 writer.
+ *
+ *                  Points are transformed block wise with the xform kernels,
+ *                  quantized to the scaled int32 coordinates of LAS and
+ *                  packed into the output buffer. The header is written
+ *                  first, so the output does not need to be seekable.
+ *
+ ******************************************************************************/
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "las.h"
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+#define LAS_HEADER_SIZE_12 227
+#define LAS_HEADER_SIZE_14 375
+#define LAS_RECORD_SIZE_2   26
+#define LAS_RECORD_SIZE_3   34
+
+
+/*******************************************************************************
+ *         Name:  lasScaleOffset
+ *  Description:  Offset is the center of the bounds in whole units, scale the
+ *                smallest power of ten (at least LAS_MIN_SCALE) which keeps
+ *                all coordinates within int32.
+ ******************************************************************************/
+static void lasScaleOffset( const double * min, const double * max,
+    double * scale, double * offset ) {
+
+  double half = 0;
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    offset[q] = floor( ( min[q] + max[q] ) / 2 + 0.5 );
+    half = fmax( half, fmax( max[q] - offset[q], offset[q] - min[q] ) );
+  }
+  double s = LAS_MIN_SCALE;
+  while ( half / s > INT_MAX / 2 ) {
+    s *= 10;
+  }
+  for ( q = 0; q < 3; q++ ) {
+    scale[q] = s;
+  }
+
+}
+
+
+void lasInitHeader( lasheader_t * h, int minor, int gps, uint64_t count,
+    const double * min, const double * max ) {
+
+  memset( h, 0, sizeof( lasheader_t ) );
+  memcpy( h->signature, "LASF", 4 );
+  h->version_major = 1;
+  h->version_minor = minor;
+  strncpy( h->system_identifier, "EXPORT", sizeof( h->system_identifier ) );
+  snprintf( h->generating_software, sizeof( h->generating_software ),
+      "ptsviewer %s", VERSION );
+  time_t now = time( NULL );
+  struct tm * tm = gmtime( &now );
+  h->creation_day  = tm->tm_yday + 1;
+  h->creation_year = tm->tm_year + 1900;
+  h->header_size   = minor == 4 ? LAS_HEADER_SIZE_14 : LAS_HEADER_SIZE_12;
+  h->point_data_offset   = h->header_size;
+  h->point_format        = gps ? 3 : 2;
+  h->point_record_length = gps ? LAS_RECORD_SIZE_3 : LAS_RECORD_SIZE_2;
+  lasScaleOffset( min, max, h->scale, h->offset );
+  lasSetCount( h, count, min, max );
+
+}
+
+
+void lasSetCount( lasheader_t * h, uint64_t count, const double * min,
+    const double * max ) {
+
+  /* LAS 1.4 keeps the legacy counts zero if they do not fit, LAS 1.2 files
+   * this large are refused by lasOpen and tilesClose. */
+  h->legacy_point_count         = count <= UINT32_MAX ? count : 0;
+  h->legacy_points_by_return[0] = h->legacy_point_count;
+  h->point_count         = count;
+  h->points_by_return[0] = count;
+  h->min_x = min[0];
+  h->max_x = max[0];
+  h->min_y = min[1];
+  h->max_y = max[1];
+  h->min_z = min[2];
+  h->max_z = max[2];
+
+}
+
+
+laswriter_t * lasOpen( const char * filename, int minor, int gps,
+    uint64_t count, const double * min, const double * max ) {
+
+  if ( minor != 2 && minor != 4 ) {
+    fprintf( stderr, "error: LAS version 1.%d is not supported.\n", minor );
+    return NULL;
+  }
+  if ( minor == 2 && count > UINT32_MAX ) {
+    fprintf( stderr, "error: %llu points do not fit into LAS 1.2, use --las14.\n",
+        (unsigned long long) count );
+    return NULL;
+  }
+  outbuf_t * out = outbufOpen( filename, OUTBUF_SIZE );
+  if ( !out ) {
+    return NULL;
+  }
+
+  laswriter_t * las = (laswriter_t *) calloc( 1, sizeof( laswriter_t ) );
+  las->out   = out;
+  las->block = (float *) malloc( 3 * XFORM_BLOCK * sizeof( float ) );
+  lasInitHeader( &las->header, minor, gps, count, min, max );
+
+  outbufWrite( out, &las->header, las->header.header_size );
+  return las;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  lasPackPoints
+ *  Description:  Quantize n points and pack them as point records.
+ ******************************************************************************/
+void lasPackPoints( const lasheader_t * h, const float * p,
+    const uint8_t * c, size_t n, uint16_t source, double gps_time,
+    char * rec ) {
+
+  const size_t size = h->point_record_length;
+  const int gps = h->point_format == 3;
+  double inv[3];
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    inv[q] = 1.0 / h->scale[q];
+  }
+
+  memset( rec, 0, n * size );
+  size_t j;
+  for ( j = 0; j < n; j++, rec += size ) {
+    int32_t xyz[3];
+    for ( q = 0; q < 3; q++ ) {
+      xyz[q] = (int32_t) lround( ( p[ 3 * j + q ] - h->offset[q] ) * inv[q] );
+    }
+    memcpy( rec, xyz, 12 );
+    rec[14] = 0x09;                      /* return 1 of 1 */
+    memcpy( rec + 18, &source, 2 );
+    char * rgb = rec + 20;
+    if ( gps ) {
+      memcpy( rec + 20, &gps_time, 8 );
+      rgb = rec + 28;
+    }
+    if ( c ) {
+      for ( q = 0; q < 3; q++ ) {
+        uint16_t v = c[ 3 * j + q ] * 257;  /* 8 to 16 bit */
+        memcpy( rgb + 2 * q, &v, 2 );
+      }
+    }
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  lasWritePoints
+ *  Description:  Transform and pack a run of points into the output buffer.
+ ******************************************************************************/
+void lasWritePoints( laswriter_t * las, const affine_t * a,
+    const float * vertices, const uint8_t * colors, size_t n,
+    uint16_t source, double gps_time ) {
+
+  const size_t size = las->header.point_record_length;
+  size_t first;
+  for ( first = 0; first < n; first += XFORM_BLOCK ) {
+    size_t m = n - first < XFORM_BLOCK ? n - first : XFORM_BLOCK;
+    const float * p = vertices + 3 * first;
+    if ( a ) {
+      xformPoints( a, p, las->block, m );
+      p = las->block;
+    }
+    lasPackPoints( &las->header, p, colors ? colors + 3 * first : NULL, m,
+        source, gps_time, outbufReserve( las->out, m * size ) );
+  }
+  las->written += n;
+
+}
+
+
+int lasClose( laswriter_t * las ) {
+
+  int ok = outbufClose( las->out );
+  if ( las->written != las->header.point_count ) {
+    fprintf( stderr, "error: LAS header announces %llu points, %llu were "
+        "written.\n", (unsigned long long) las->header.point_count,
+        (unsigned long long) las->written );
+    ok = 0;
+  }
+  free( las->block );
+  free( las );
+  return ok;
+
+}
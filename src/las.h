@@ -0,0 +1,100 @@
+/*******************************************************************************
+ *
+ *       Filename:  las.h
+ *
+ *    Description:  Streaming LAS 1.2/1.4 writer for point data record
+ *                  format 2 (RGB) or 3 (RGB and GPS time).
+ *
+ ******************************************************************************/
+
+#ifndef LAS_H
+#define LAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "outbuf.h"
+#include "xform.h"
+
+/* Smallest coordinate resolution, 0.1 mm */
+#define LAS_MIN_SCALE 0.0001
+
+/* Public header block. Version 1.2 uses the first 227 bytes, 1.4 all 375. */
+#pragma pack( push, 1 )
+typedef struct {
+  char     signature[4];          /* "LASF" */
+  uint16_t file_source_id;
+  uint16_t global_encoding;
+  uint32_t guid1;
+  uint16_t guid2;
+  uint16_t guid3;
+  uint8_t  guid4[8];
+  uint8_t  version_major;
+  uint8_t  version_minor;
+  char     system_identifier[32];
+  char     generating_software[32];
+  uint16_t creation_day;
+  uint16_t creation_year;
+  uint16_t header_size;
+  uint32_t point_data_offset;
+  uint32_t vlr_count;
+  uint8_t  point_format;
+  uint16_t point_record_length;
+  uint32_t legacy_point_count;
+  uint32_t legacy_points_by_return[5];
+  double   scale[3];
+  double   offset[3];
+  double   max_x, min_x;
+  double   max_y, min_y;
+  double   max_z, min_z;
+  /* LAS 1.3 */
+  uint64_t waveform_offset;
+  /* LAS 1.4 */
+  uint64_t evlr_offset;
+  uint32_t evlr_count;
+  uint64_t point_count;
+  uint64_t points_by_return[15];
+} lasheader_t;
+#pragma pack( pop )
+
+typedef struct {
+  outbuf_t *  out;
+  lasheader_t header;
+  uint64_t    written;
+  float *     block;              /* transformed points */
+} laswriter_t;
+
+/* Fill a header of version 1.minor (2 or 4) for count points within the given
+ * bounds. Scale and offset are chosen from the bounds. If gps is set, point
+ * format 3 with GPS time is used, else format 2. */
+void lasInitHeader( lasheader_t * h, int minor, int gps, uint64_t count,
+    const double * min, const double * max );
+
+/* Update point counts and bounds of a header. */
+void lasSetCount( lasheader_t * h, uint64_t count, const double * min,
+    const double * max );
+
+/* Quantize n points in the coordinates of h and pack them as point records
+ * into rec, which needs room for n * h->point_record_length bytes. */
+void lasPackPoints( const lasheader_t * h, const float * vertices,
+    const uint8_t * colors, size_t n, uint16_t source, double gps_time,
+    char * rec );
+
+/* Create a LAS file of version 1.minor (2 or 4) for count points within the
+ * given bounds. Scale and offset are chosen from the bounds. If gps is set,
+ * point format 3 with GPS time is written, else format 2. Returns NULL on
+ * error, also for more than UINT32_MAX points in LAS 1.2. */
+laswriter_t * lasOpen( const char * filename, int minor, int gps,
+    uint64_t count, const double * min, const double * max );
+
+/* Append n points, transformed by a unless a is NULL. colors may be NULL.
+ * All points get the point source ID and GPS time given. */
+void lasWritePoints( laswriter_t * las, const affine_t * a,
+    const float * vertices, const uint8_t * colors, size_t n,
+    uint16_t source, double gps_time );
+
+/* Close the file. Returns 0 on error or if the number of points written
+ * differs from the count given to lasOpen. */
+int  lasClose( laswriter_t * las );
+
+#endif /* LAS_H */
@@ -40,6 +40,9 @@
 #include <cstdio>  // for fwrite()
 #include <cmath>   // for fabs(),...
 #include <limits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // Avoid conflicting declaration of min/max macros in windows headers
 #if !defined(NOMINMAX) && (defined(_WIN32) || defined(_WIN32_)  || defined(WIN32) || defined(_WIN64))
@@ -92,7 +95,8 @@ namespace nanoflann
 		}
 
 
-		inline void addPoint(DistanceType dist, IndexType index)
+		/** Returns true: a kNN search never stops early. */
+		inline bool addPoint(DistanceType dist, IndexType index)
 		{
 			CountType i;
 			for (i=count; i>0; --i) {
@@ -113,6 +117,7 @@ namespace nanoflann
 				indices[i] = index;
 			}
 			if (count<capacity) count++;
+			return true;
 		}
 
 		inline DistanceType worstDist() const
@@ -147,10 +152,11 @@ namespace nanoflann
 
 		inline bool full() const { return true; }
 
-		inline void addPoint(DistanceType dist, IndexType index)
+		inline bool addPoint(DistanceType dist, IndexType index)
 		{
 			if (dist<radius)
-				m_indices_dists.push_back(std::make_pair<IndexType,DistanceType>(index,dist));
+				m_indices_dists.push_back(std::make_pair(index,dist));
+			return true;
 		}
 
 		inline DistanceType worstDist() const { return radius; }
@@ -175,6 +181,81 @@ namespace nanoflann
 		}
 	};
 
+	/**
+	 * A result-set class counting the points within a radius without storing
+	 * them. The search stops once \a limit points were counted, 0 counts all.
+	 */
+	template <typename DistanceType, typename IndexType = size_t, typename CountType = size_t>
+	class RadiusCountResultSet
+	{
+	public:
+		const DistanceType radius;
+		const CountType limit;
+		CountType count;
+
+		inline RadiusCountResultSet(DistanceType radius_, CountType limit_ = 0) : radius(radius_), limit(limit_), count(0)
+		{
+		}
+
+		inline void init() { count = 0; }
+
+		inline CountType size() const { return count; }
+
+		inline bool full() const { return true; }
+
+		/** Returns false to stop the search. */
+		inline bool addPoint(DistanceType dist, IndexType)
+		{
+			if (dist<radius) {
+				count++;
+				return limit==0 || count<limit;
+			}
+			return true;
+		}
+
+		inline DistanceType worstDist() const { return radius; }
+	};
+
+
+	/**
+	 * A result-set class stopping the search at the first point within a
+	 * radius, which is not necessarily the nearest one.
+	 */
+	template <typename DistanceType, typename IndexType = size_t>
+	class RadiusFirstResultSet
+	{
+	public:
+		const DistanceType radius;
+		IndexType index;
+		DistanceType dist;
+		bool found;
+
+		inline RadiusFirstResultSet(DistanceType radius_) : radius(radius_), index(0), dist(radius_), found(false)
+		{
+		}
+
+		inline void init() { found = false; dist = radius; }
+
+		inline size_t size() const { return found ? 1 : 0; }
+
+		inline bool full() const { return true; }
+
+		/** Returns false to stop the search. */
+		inline bool addPoint(DistanceType dist_, IndexType index_)
+		{
+			if (dist_<radius) {
+				index = index_;
+				dist = dist_;
+				found = true;
+				return false;
+			}
+			return true;
+		}
+
+		inline DistanceType worstDist() const { return radius; }
+	};
+
+
 	/** operator "<" for std::sort() */
 	struct IndexDist_Sorter
 	{
@@ -454,6 +535,12 @@ namespace nanoflann
 	const size_t     WORDSIZE=16;
 	const size_t     BLOCKSIZE=8192;
 
+	/** Parallel build: smallest tree built with threads, smallest subtree
+	    split off as a task, smallest range whose bounds are found by tasks */
+	const size_t     PARALLEL_BUILD_MIN=1<<16;
+	const size_t     PARALLEL_TASK_MIN=1<<14;
+	const size_t     PARALLEL_MINMAX_MIN=1<<20;
+
 	class PooledAllocator
 	{
 		/* We maintain memory alignment to word boundaries by requiring that all
@@ -489,12 +576,21 @@ namespace nanoflann
 		 * Destructor. Frees all the memory allocated in this pool.
 		 */
 		~PooledAllocator()
+		{
+			free_all();
+		}
+
+		/** Frees all allocated memory chunks */
+		void free_all()
 		{
 			while (base != NULL) {
 				void *prev = *((void**) base); /* Get pointer to prev block. */
 				::free(base);
 				base = prev;
 			}
+			remaining = 0;
+			usedMemory = 0;
+			wastedMemory = 0;
 		}
 
 		/**
@@ -703,10 +799,21 @@ namespace nanoflann
 		 */
 		PooledAllocator pool;
 
+		/**
+		 * One pool per thread of a parallel build, as the pools are not
+		 * thread-safe.
+		 */
+		PooledAllocator* thread_pools;
+		int thread_pool_count;
+		bool parallel_build;
+
 	public:
 
 		Distance distance;
 
+		/** Saving and loading of built trees outside of the class (ptsviewer) */
+		template <typename T> friend struct KDTreeAccess;
+
 		/**
 		 * KDTree constructor
 		 *
@@ -715,7 +822,7 @@ namespace nanoflann
 		 *          params = parameters passed to the kdtree algorithm (see http://code.google.com/p/nanoflann/ for help choosing the parameters)
 		 */
 		KDTreeSingleIndexAdaptor(const int dimensionality, const DatasetAdaptor& inputData, const KDTreeSingleIndexAdaptorParams& params = KDTreeSingleIndexAdaptorParams() ) :
-			dataset(inputData), index_params(params), distance(inputData)
+			dataset(inputData), index_params(params), thread_pools(NULL), thread_pool_count(0), parallel_build(false), distance(inputData)
 		{
 			m_size = dataset.kdtree_get_point_count();
 			dim = dimensionality;
@@ -734,15 +841,45 @@ namespace nanoflann
 		 */
 		~KDTreeSingleIndexAdaptor()
 		{
+			delete[] thread_pools;
+		}
+
+		/**
+		 * Frees the nodes of a previous build or load, from the pool and
+		 * from the pools of a parallel build.
+		 */
+		void freeIndex()
+		{
+			pool.free_all();
+			delete[] thread_pools;
+			thread_pools = NULL;
+			thread_pool_count = 0;
+			root_node = NULL;
 		}
 
 		/**
-		 * Builds the index
+		 * Builds the index. Large trees are built by OpenMP tasks, one per
+		 * subtree, unless called from a parallel region. Every subtree
+		 * partitions its own range of vind exactly as the serial build does,
+		 * so the tree is the same for any number of threads.
 		 */
 		void buildIndex()
 		{
+			freeIndex();
 			init_vind();
 			computeBoundingBox(root_bbox);
+#ifdef _OPENMP
+			if (m_size >= PARALLEL_BUILD_MIN && omp_get_max_threads() > 1 && !omp_in_parallel()) {
+				thread_pool_count = omp_get_max_threads();
+				thread_pools = new PooledAllocator[thread_pool_count];
+				parallel_build = true;
+				#pragma omp parallel
+				#pragma omp single
+				root_node = divideTree(0, m_size, root_bbox );   // construct the tree
+				parallel_build = false;
+				return;
+			}
+#endif
 			root_node = divideTree(0, m_size, root_bbox );   // construct the tree
 		}
 
@@ -768,7 +905,10 @@ namespace nanoflann
 		 */
 		size_t usedMemory() const
 		{
-			return pool.usedMemory+pool.wastedMemory+dataset.kdtree_get_point_count()*sizeof(IndexType);  // pool memory and vind array memory
+			size_t mem = pool.usedMemory+pool.wastedMemory+dataset.kdtree_get_point_count()*sizeof(IndexType);  // pool memory and vind array memory
+			for (int t = 0; t < thread_pool_count; ++t)
+				mem += thread_pools[t].usedMemory+thread_pools[t].wastedMemory;  // nodes of a parallel build
+			return mem;
 		}
 
 		/** \name Query methods
@@ -783,17 +923,27 @@ namespace nanoflann
 		 *     vec = the vector for which to search the nearest neighbors
 		 *
 		 * \tparam RESULTSET Should be any ResultSet<DistanceType>
+		 * \return false if the result set stopped the search
 		 * \sa knnSearch, radiusSearch
 		 */
 		template <typename RESULTSET>
-		void findNeighbors(RESULTSET& result, const ElementType* vec, const SearchParams& searchParams) const
+		bool findNeighbors(RESULTSET& result, const ElementType* vec, const SearchParams& searchParams) const
 		{
 			assert(vec);
 			float epsError = 1+searchParams.eps;
 
-			std::vector<DistanceType> dists( (DIM>0 ? DIM : dim) ,0);
+			// The distances live on the stack for a fixed dimension, so a query does not allocate.
+			DistanceType fixed_dists[DIM>0 ? DIM : 1];
+			std::vector<DistanceType> dynamic_dists;
+			DistanceType* dists = fixed_dists;
+			if (DIM>0) {
+				std::fill(fixed_dists, fixed_dists + (DIM>0 ? DIM : 1), DistanceType(0));
+			} else {
+				dynamic_dists.assign(dim, 0);
+				dists = &dynamic_dists[0];
+			}
 			DistanceType distsq = computeInitialDistances(vec, dists);
-			searchLevel(result, vec, root_node, distsq, dists, epsError);  // "count_leaf" parameter removed since was neither used nor returned to the user.
+			return searchLevel(result, vec, root_node, distsq, dists, epsError);  // "count_leaf" parameter removed since was neither used nor returned to the user.
 		}
 
 		/**
@@ -887,16 +1037,18 @@ namespace nanoflann
 			}
 			else
 			{
-				for (int i=0; i<(DIM>0 ? DIM : dim); ++i) {
-					bbox[i].low =
-						bbox[i].high = dataset_get(0,i);
-				}
 				const size_t N = dataset.kdtree_get_point_count();
-				for (size_t k=1; k<N; ++k) {
-					for (int i=0; i<(DIM>0 ? DIM : dim); ++i) {
-						if (dataset_get(k,i)<bbox[i].low) bbox[i].low = dataset_get(k,i);
-						if (dataset_get(k,i)>bbox[i].high) bbox[i].high = dataset_get(k,i);
+				for (int i=0; i<(DIM>0 ? DIM : dim); ++i) {
+					ElementType low = dataset_get(0,i), high = low;
+					// min and max are exact, so any split of the reduction gives the same box
+					#pragma omp parallel for simd reduction(min:low) reduction(max:high) if (N >= PARALLEL_BUILD_MIN)
+					for (size_t k=1; k<N; ++k) {
+						ElementType v = dataset_get(k,i);
+						low = v < low ? v : low;
+						high = v > high ? v : high;
 					}
+					bbox[i].low = low;
+					bbox[i].high = high;
 				}
 			}
 		}
@@ -913,7 +1065,11 @@ namespace nanoflann
 		 */
 		NodePtr divideTree(const IndexType left, const IndexType right, BoundingBox& bbox)
 		{
+#ifdef _OPENMP
+			NodePtr node = parallel_build ? thread_pools[omp_get_thread_num()].template allocate<Node>() : pool.allocate<Node>(); // allocate memory
+#else
 			NodePtr node = pool.allocate<Node>(); // allocate memory
+#endif
 
 			/* If too few exemplars remain, then make this a leaf node. */
 			if ( (right-left) <= m_leaf_max_size) {
@@ -943,11 +1099,17 @@ namespace nanoflann
 
 				BoundingBox left_bbox(bbox);
 				left_bbox[cutfeat].high = cutval;
-				node->child1 = divideTree(left, left+idx, left_bbox);
-
 				BoundingBox right_bbox(bbox);
 				right_bbox[cutfeat].low = cutval;
+				if (parallel_build && idx >= PARALLEL_TASK_MIN) {
+					#pragma omp task shared(node, left_bbox)
+					node->child1 = divideTree(left, left+idx, left_bbox);
+				}
+				else {
+					node->child1 = divideTree(left, left+idx, left_bbox);
+				}
 				node->child2 = divideTree(left+idx, right, right_bbox);
+				#pragma omp taskwait
 
 				node->sub.divlow = left_bbox[cutfeat].high;
 				node->sub.divhigh = right_bbox[cutfeat].low;
@@ -963,6 +1125,23 @@ namespace nanoflann
 
 		void computeMinMax(IndexType* ind, IndexType count, int element, ElementType& min_elem, ElementType& max_elem)
 		{
+			if (parallel_build && count >= PARALLEL_MINMAX_MIN) {
+				// ranges near the root, split into tasks while the other threads would idle
+				const IndexType chunk = PARALLEL_MINMAX_MIN/4;
+				const IndexType chunks = (count+chunk-1)/chunk;
+				std::vector<ElementType> lows(chunks), highs(chunks);
+				for (IndexType c=0; c<chunks; ++c) {
+					#pragma omp task shared(lows, highs)
+					{
+						IndexType end = std::min(count, (c+1)*chunk);
+						computeMinMax(ind+c*chunk, end-c*chunk, element, lows[c], highs[c]);
+					}
+				}
+				#pragma omp taskwait
+				min_elem = *std::min_element(lows.begin(), lows.end());
+				max_elem = *std::max_element(highs.begin(), highs.end());
+				return;
+			}
 			min_elem = dataset_get(ind[0],element);
 			max_elem = dataset_get(ind[0],element);
 			for (IndexType i=1; i<count; ++i) {
@@ -1033,8 +1212,8 @@ namespace nanoflann
 				ElementType span = bbox[i].high-bbox[i].low;
 				if (span>(1-EPS)*max_span) {
 					ElementType min_elem, max_elem;
-					computeMinMax(ind, count, cutfeat, min_elem, max_elem);
-					ElementType spread = max_elem-min_elem;;
+					computeMinMax(ind, count, i, min_elem, max_elem);
+					ElementType spread = max_elem-min_elem;
 					if (spread>max_spread) {
 						cutfeat = i;
 						max_spread = spread;
@@ -1097,7 +1276,7 @@ namespace nanoflann
 			lim2 = left;
 		}
 
-		DistanceType computeInitialDistances(const ElementType* vec, std::vector<DistanceType>& dists) const
+		DistanceType computeInitialDistances(const ElementType* vec, DistanceType* dists) const
 		{
 			assert(vec);
 			DistanceType distsq = 0.0;
@@ -1119,10 +1298,11 @@ namespace nanoflann
 		/**
 		 * Performs an exact search in the tree starting from a node.
 		 * \tparam RESULTSET Should be any ResultSet<DistanceType>
+		 * \return false if the result set stopped the search
 		 */
 		template <class RESULTSET>
-		void searchLevel(RESULTSET& result_set, const ElementType* vec, const NodePtr node, DistanceType mindistsq,
-						 std::vector<DistanceType>& dists, const float epsError) const
+		bool searchLevel(RESULTSET& result_set, const ElementType* vec, const NodePtr node, DistanceType mindistsq,
+						 DistanceType* dists, const float epsError) const
 		{
 			/* If this is a leaf node, then do check and return. */
 			if ((node->child1 == NULL)&&(node->child2 == NULL)) {
@@ -1132,10 +1312,12 @@ namespace nanoflann
 					const IndexType index = vind[i];// reorder... : i;
 					DistanceType dist = distance(vec, index, (DIM>0 ? DIM : dim));
 					if (dist<worst_dist) {
-						result_set.addPoint(dist,vind[i]);
+						if (!result_set.addPoint(dist,vind[i])) {
+							return false;
+						}
 					}
 				}
-				return;
+				return true;
 			}
 
 			/* Which child branch should be taken first? */
@@ -1159,15 +1341,20 @@ namespace nanoflann
 			}
 
 			/* Call recursively to search next level down. */
-			searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError);
+			if (!searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError)) {
+				return false;
+			}
 
 			DistanceType dst = dists[idx];
 			mindistsq = mindistsq + cut_dist - dst;
 			dists[idx] = cut_dist;
 			if (mindistsq*epsError<=result_set.worstDist()) {
-				searchLevel(result_set, vec, otherChild, mindistsq, dists, epsError);
+				if (!searchLevel(result_set, vec, otherChild, mindistsq, dists, epsError)) {
+					return false;
+				}
 			}
 			dists[idx] = dst;
+			return true;
 		}
 
 
@@ -1183,6 +1370,7 @@ namespace nanoflann
 
 		void loadIndex(FILE* stream)
 		{
+			freeIndex();
 			load_value(stream, m_size);
 			load_value(stream, dim);
 			load_value(stream, root_bbox);
@@ -0,0 +1,459 @@
+/*******************************************************************************
+ *
+ *       Filename:  occupancy.cpp
+ *
+ *    Description:  Voxel occupancy and free-space carving.
+ *
+ *                  Voxels are counted in sharded open-addressing tables
+ *                  like those of the voxel reduction: every thread fills
+ *                  its own shard tables, afterwards the shards are merged
+ *                  in parallel. The samples of a ray are computed eight at
+ *                  a time with AVX2 where the CPU supports it. Scalar and
+ *                  SIMD kernels use the same operations without FMA, so
+ *                  they carve the same voxels.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "occupancy.h"
+#include "outbuf.h"
+#include "xform.h"
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define OCC_X86
+#include <immintrin.h>
+#endif
+
+#define OCC_SHARD_BITS 6
+#define OCC_SHARDS     ( 1 << OCC_SHARD_BITS )
+#define OCC_EMPTY      UINT64_MAX
+#define OCC_AXIS_BITS  21
+#define OCC_AXIS_MAX   ( ( 1 << ( OCC_AXIS_BITS - 1 ) ) - 1 )
+
+/* Samples per ray computed at once */
+#define OCC_RAY_MAX    256
+
+typedef struct {
+  uint64_t key;
+  uint32_t hits;
+  uint32_t misses;
+} occslot_t;
+
+typedef struct {
+  occslot_t * slots;
+  size_t      mask;   /* capacity - 1, capacity is a power of two */
+  size_t      used;
+} occtable_t;
+
+typedef void ( * raykernel_t )( const float *, const float *, float, float,
+    int, float, uint64_t * );
+
+
+static inline uint64_t occHash( uint64_t key ) {
+
+  /* splitmix64 finalizer */
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  occKey
+ *  Description:  Pack voxel coordinates, already rounded and clamped to
+ *                OCC_AXIS_MAX, into a key.
+ ******************************************************************************/
+static inline uint64_t occKey( int32_t x, int32_t y, int32_t z ) {
+
+  return ( (uint64_t) ( x + OCC_AXIS_MAX ) << ( 2 * OCC_AXIS_BITS ) )
+    | ( (uint64_t) ( y + OCC_AXIS_MAX ) << OCC_AXIS_BITS )
+    | (uint64_t) ( z + OCC_AXIS_MAX );
+
+}
+
+
+static inline int32_t occCoord( float v, float inv ) {
+
+  float c = floorf( v * inv + 0.5f );
+  c = fminf( fmaxf( c, (float) -OCC_AXIS_MAX ), (float) OCC_AXIS_MAX );
+  return (int32_t) c;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  rayScalar
+ *  Description:  Keys of the n samples p + dir * ( pad + i * step ).
+ ******************************************************************************/
+static void rayScalar( const float * p, const float * dir, float pad,
+    float step, int n, float inv, uint64_t * keys ) {
+
+  int i;
+  for ( i = 0; i < n; i++ ) {
+    float d = pad + (float) i * step;
+    keys[i] = occKey( occCoord( p[0] + dir[0] * d, inv ),
+        occCoord( p[1] + dir[1] * d, inv ), occCoord( p[2] + dir[2] * d, inv ) );
+  }
+
+}
+
+
+#ifdef OCC_X86
+
+__attribute__(( target( "avx2" ) ))
+static inline __m256i rayCoordAVX2( float p, float dir, __m256 d, __m256 inv ) {
+
+  const __m256 half = _mm256_set1_ps( 0.5f );
+  const __m256 lim  = _mm256_set1_ps( (float) OCC_AXIS_MAX );
+  __m256 v = _mm256_add_ps( _mm256_set1_ps( p ),
+      _mm256_mul_ps( _mm256_set1_ps( dir ), d ) );
+  __m256 c = _mm256_floor_ps( _mm256_add_ps( _mm256_mul_ps( v, inv ), half ) );
+  c = _mm256_min_ps( _mm256_max_ps( c, _mm256_sub_ps( _mm256_setzero_ps(), lim ) ),
+      lim );
+  return _mm256_add_epi32( _mm256_cvttps_epi32( c ),
+      _mm256_set1_epi32( OCC_AXIS_MAX ) );
+
+}
+
+
+__attribute__(( target( "avx2" ) ))
+static void rayAVX2( const float * p, const float * dir, float pad,
+    float step, int n, float inv, uint64_t * keys ) {
+
+  const __m256 vinv  = _mm256_set1_ps( inv );
+  const __m256 vpad  = _mm256_set1_ps( pad );
+  const __m256 vstep = _mm256_set1_ps( step );
+  __m256 idx = _mm256_setr_ps( 0, 1, 2, 3, 4, 5, 6, 7 );
+  int i;
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    __m256 d = _mm256_add_ps( vpad, _mm256_mul_ps( idx, vstep ) );
+    uint32_t x[8], y[8], z[8];
+    _mm256_storeu_si256( (__m256i *) x, rayCoordAVX2( p[0], dir[0], d, vinv ) );
+    _mm256_storeu_si256( (__m256i *) y, rayCoordAVX2( p[1], dir[1], d, vinv ) );
+    _mm256_storeu_si256( (__m256i *) z, rayCoordAVX2( p[2], dir[2], d, vinv ) );
+    int k;
+    for ( k = 0; k < 8; k++ ) {
+      keys[ i + k ] = ( (uint64_t) x[k] << ( 2 * OCC_AXIS_BITS ) )
+        | ( (uint64_t) y[k] << OCC_AXIS_BITS ) | z[k];
+    }
+    idx = _mm256_add_ps( idx, _mm256_set1_ps( 8 ) );
+  }
+  for ( ; i < n; i++ ) {
+    float d = pad + (float) i * step;
+    keys[i] = occKey( occCoord( p[0] + dir[0] * d, inv ),
+        occCoord( p[1] + dir[1] * d, inv ), occCoord( p[2] + dir[2] * d, inv ) );
+  }
+
+}
+
+#endif
+
+
+static raykernel_t occRayKernel() {
+
+#ifdef OCC_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    return rayAVX2;
+  }
+#endif
+  return rayScalar;
+
+}
+
+
+static void occTableInit( occtable_t * t, size_t capacity ) {
+
+  t->slots = (occslot_t *) malloc( capacity * sizeof( occslot_t ) );
+  t->mask  = capacity - 1;
+  t->used  = 0;
+  size_t i;
+  for ( i = 0; i < capacity; i++ ) {
+    t->slots[i].key = OCC_EMPTY;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  occFind
+ *  Description:  Linear probing. Returns the slot holding key or the empty
+ *                slot it belongs into, the caller has to fill it.
+ ******************************************************************************/
+static occslot_t * occFind( occtable_t * t, uint64_t key, uint64_t hash ) {
+
+  size_t i = hash & t->mask;
+  while ( t->slots[i].key != key && t->slots[i].key != OCC_EMPTY ) {
+    i = ( i + 1 ) & t->mask;
+  }
+  return t->slots + i;
+
+}
+
+
+static void occAdd( occtable_t * t, uint64_t key, uint64_t hash,
+    uint32_t hits, uint32_t misses ) {
+
+  if ( 2 * ( t->used + 1 ) > t->mask + 1 ) {
+    /* Double the capacity and reinsert all voxels */
+    occtable_t old = *t;
+    occTableInit( t, ( old.mask + 1 ) * 2 );
+    size_t i;
+    for ( i = 0; i <= old.mask; i++ ) {
+      if ( old.slots[i].key != OCC_EMPTY ) {
+        *occFind( t, old.slots[i].key, occHash( old.slots[i].key ) ) = old.slots[i];
+      }
+    }
+    t->used = old.used;
+    free( old.slots );
+  }
+  occslot_t * s = occFind( t, key, hash );
+  if ( s->key == OCC_EMPTY ) {
+    s->key    = key;
+    s->hits   = 0;
+    s->misses = 0;
+    t->used++;
+  }
+  s->hits   += hits;
+  s->misses += misses;
+
+}
+
+
+static inline void occCount( occtable_t * own, uint64_t key, uint32_t hits,
+    uint32_t misses ) {
+
+  uint64_t hash = occHash( key );
+  occAdd( own + ( hash >> ( 64 - OCC_SHARD_BITS ) ), key, hash, hits, misses );
+
+}
+
+
+static bool occLess( const occvoxel_t & a, const occvoxel_t & b ) {
+
+  if ( a.x != b.x ) {
+    return a.x < b.x;
+  }
+  return a.y != b.y ? a.y < b.y : a.z < b.z;
+
+}
+
+
+int occupancyBuild( const voxelinput_t * in, int n, const occparams_t * params,
+    occgrid_t * out ) {
+
+  if ( params->size <= 0 || params->step <= 0 || params->range < 0 ) {
+    fprintf( stderr, "error: Invalid occupancy parameters.\n" );
+    return 0;
+  }
+  const float inv = 1.0f / params->size;
+  int samples = (int) floorf( params->range / params->step + 1e-4f ) + 1;
+  if ( samples > OCC_RAY_MAX ) {
+    fprintf( stderr, "error: More than %d samples per ray.\n", OCC_RAY_MAX );
+    return 0;
+  }
+  raykernel_t ray = occRayKernel();
+
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  std::vector<occtable_t> tables( nthreads * OCC_SHARDS );
+
+  /* Every thread counts its inputs into its own shard tables. */
+  #pragma omp parallel num_threads( nthreads )
+  {
+    int t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    occtable_t * own = &tables[ t * OCC_SHARDS ];
+    int s;
+    for ( s = 0; s < OCC_SHARDS; s++ ) {
+      occTableInit( own + s, 1024 );
+    }
+#ifdef _OPENMP
+    /* OpenMP may start fewer threads, merge only the tables of this team */
+    #pragma omp single
+    nthreads = omp_get_num_threads();
+#endif
+    float * block = (float *) malloc( 3 * XFORM_BLOCK * sizeof( float ) );
+    uint64_t keys[ OCC_RAY_MAX ];
+
+    #pragma omp for schedule( dynamic, 1 )
+    for ( int i = 0; i < n; i++ ) {
+      if ( !in[i].count ) {
+        continue;
+      }
+      affine_t T;
+      xformAffine( in[i].mat, &T );
+      const float c[3] = { (float) in[i].mat[12], (float) in[i].mat[13],
+        (float) in[i].mat[14] };
+      size_t first;
+      for ( first = 0; first < in[i].count; first += XFORM_BLOCK ) {
+        size_t m = std::min( (size_t) XFORM_BLOCK, in[i].count - first );
+        xformPoints( &T, in[i].vertices + 3 * first, block, m );
+        size_t j;
+        for ( j = 0; j < m; j++ ) {
+          const float * p = block + 3 * j;
+          occCount( own, occKey( occCoord( p[0], inv ), occCoord( p[1], inv ),
+                occCoord( p[2], inv ) ), 1, 0 );
+
+          /* Samples up to the camera, a ray counts once per voxel */
+          float dir[3] = { c[0] - p[0], c[1] - p[1], c[2] - p[2] };
+          float len = sqrtf( dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2] );
+          int k = samples;
+          while ( k > 0 && params->pad + (float) ( k - 1 ) * params->step >= len ) {
+            k--;
+          }
+          if ( !k ) {
+            continue;
+          }
+          int q;
+          for ( q = 0; q < 3; q++ ) {
+            dir[q] /= len;
+          }
+          ray( p, dir, params->pad, params->step, k, inv, keys );
+          for ( q = 0; q < k; q++ ) {
+            if ( !q || keys[q] != keys[ q - 1 ] ) {
+              occCount( own, keys[q], 0, 1 );
+            }
+          }
+        }
+      }
+    }
+    free( block );
+  }
+
+  /* Merge the tables of all threads shard by shard. */
+  #pragma omp parallel for schedule( dynamic, 1 ) num_threads( nthreads )
+  for ( int s = 0; s < OCC_SHARDS; s++ ) {
+    occtable_t * merged = &tables[s];
+    int t;
+    for ( t = 1; t < nthreads; t++ ) {
+      occtable_t * part = &tables[ t * OCC_SHARDS + s ];
+      size_t k;
+      for ( k = 0; k <= part->mask; k++ ) {
+        const occslot_t * v = part->slots + k;
+        if ( v->key != OCC_EMPTY ) {
+          occAdd( merged, v->key, occHash( v->key ), v->hits, v->misses );
+        }
+      }
+      free( part->slots );
+    }
+  }
+
+  /* Keep the occupied voxels */
+  size_t occupied = 0, total = 0;
+  int s;
+  for ( s = 0; s < OCC_SHARDS; s++ ) {
+    size_t k;
+    for ( k = 0; k <= tables[s].mask; k++ ) {
+      occupied += tables[s].slots[k].key != OCC_EMPTY && tables[s].slots[k].hits;
+    }
+    total += tables[s].used;
+  }
+  out->voxels = (occvoxel_t *) malloc( ( occupied ? occupied : 1 ) * sizeof( occvoxel_t ) );
+  if ( !out->voxels ) {
+    fprintf( stderr, "error: Could not allocate memory for voxels.\n" );
+    return 0;
+  }
+  const uint64_t axis = ( 1 << OCC_AXIS_BITS ) - 1;
+  size_t w = 0;
+  for ( s = 0; s < OCC_SHARDS; s++ ) {
+    size_t k;
+    for ( k = 0; k <= tables[s].mask; k++ ) {
+      const occslot_t * v = tables[s].slots + k;
+      if ( v->key == OCC_EMPTY || !v->hits ) {
+        continue;
+      }
+      occvoxel_t * o = out->voxels + w++;
+      o->x = (int32_t) ( v->key >> ( 2 * OCC_AXIS_BITS ) ) - OCC_AXIS_MAX;
+      o->y = (int32_t) ( ( v->key >> OCC_AXIS_BITS ) & axis ) - OCC_AXIS_MAX;
+      o->z = (int32_t) ( v->key & axis ) - OCC_AXIS_MAX;
+      o->hits   = v->hits;
+      o->misses = v->misses;
+    }
+    free( tables[s].slots );
+  }
+  std::sort( out->voxels, out->voxels + occupied, occLess );
+  out->count  = occupied;
+  out->carved = total - occupied;
+  out->size   = params->size;
+  return 1;
+
+}
+
+
+float occupancyProbability( const occvoxel_t * v ) {
+
+  return (float) ( (double) v->hits / ( (double) v->hits + v->misses + 1e-6 ) );
+
+}
+
+
+int occupancyWriteText( const char * filename, const occgrid_t * grid ) {
+
+  outbuf_t * out = outbufOpen( filename, OUTBUF_SIZE );
+  if ( !out ) {
+    return 0;
+  }
+  size_t i;
+  for ( i = 0; i < grid->count; i++ ) {
+    const occvoxel_t * v = grid->voxels + i;
+    outbufPrintf( out, "%f %f %f %f\n", grid->size * v->x, grid->size * v->y,
+        grid->size * v->z, occupancyProbability( v ) );
+  }
+  return outbufClose( out );
+
+}
+
+
+int occupancyWriteGrid( const char * filename, const occgrid_t * grid ) {
+
+  outbuf_t * out = outbufOpen( filename, OUTBUF_SIZE );
+  if ( !out ) {
+    return 0;
+  }
+  uint32_t record = 16;
+  uint64_t count  = grid->count;
+  outbufWrite( out, "OCCGRID1", 8 );
+  outbufWrite( out, &grid->size, 4 );
+  outbufWrite( out, &record, 4 );
+  outbufWrite( out, &count, 8 );
+  size_t i;
+  for ( i = 0; i < grid->count; i++ ) {
+    const occvoxel_t * v = grid->voxels + i;
+    float p = occupancyProbability( v );
+    char * r = outbufReserve( out, record );
+    memcpy( r,      &v->x, 4 );
+    memcpy( r + 4,  &v->y, 4 );
+    memcpy( r + 8,  &v->z, 4 );
+    memcpy( r + 12, &p,    4 );
+  }
+  return outbufClose( out );
+
+}
+
+
+void occupancyFree( occgrid_t * grid ) {
+
+  free( grid->voxels );
+  memset( grid, 0, sizeof( occgrid_t ) );
+
+}
@@ -0,0 +1,58 @@
+/*******************************************************************************
+ *
+ *       Filename:  occupancy.h
+ *
+ *    Description:  Voxel occupancy of posed clouds. Every point hits its
+ *                  voxel, the ray from the point towards the camera centre
+ *                  carves free space through the voxels in front of it. The
+ *                  occupancy probability of a voxel is the fraction of hits
+ *                  among all points and rays reaching it.
+ *
+ ******************************************************************************/
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "voxel.h"
+
+typedef struct {
+  float size;                /* voxel edge length */
+  float pad;                 /* free space starts this far in front of a point */
+  float step;                /* distance of the samples along a ray */
+  float range;               /* length of the carved part of a ray */
+} occparams_t;
+
+typedef struct {
+  int32_t  x, y, z;          /* voxel centre at ( x, y, z ) * size */
+  uint32_t hits;             /* points in the voxel */
+  uint32_t misses;           /* ray samples in the voxel */
+} occvoxel_t;
+
+typedef struct {
+  occvoxel_t * voxels;       /* occupied voxels ordered by x, y and z */
+  size_t       count;
+  size_t       carved;       /* voxels only seen as free space */
+  float        size;
+} occgrid_t;
+
+/* Accumulate the points of n inputs, the camera centre of an input is the
+ * translation of its pose. Returns 0 on error. */
+int   occupancyBuild( const voxelinput_t * in, int n, const occparams_t * params,
+    occgrid_t * out );
+
+float occupancyProbability( const occvoxel_t * v );
+
+/* Write the occupied voxels as lines "x y z probability" or as a binary grid:
+ * the magic "OCCGRID1", the voxel size as float, the record size as uint32
+ * and the voxel count as uint64, followed by int32 x, y, z and float
+ * probability per voxel, all little-endian. "-" is standard output. Return
+ * 0 on error. */
+int   occupancyWriteText( const char * filename, const occgrid_t * grid );
+int   occupancyWriteGrid( const char * filename, const occgrid_t * grid );
+
+void  occupancyFree( occgrid_t * grid );
+
+#endif /* OCCUPANCY_H */
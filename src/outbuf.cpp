@@ -0,0 +1,215 @@
+/*******************************************************************************
+ *
+ *       Filename:  outbuf.cpp
+ *
+ *    Description:  Large write buffer for the exporters.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "outbuf.h"
+
+/* Descriptor written for "-" */
+static int g_outbuf_stdout = STDOUT_FILENO;
+
+
+int outbufRedirectStdout() {
+
+  fflush( stdout );
+  int fd = dup( STDOUT_FILENO );
+  if ( fd < 0 || dup2( STDERR_FILENO, STDOUT_FILENO ) < 0 ) {
+    fprintf( stderr, "error: Could not redirect standard output: %s\n",
+        strerror( errno ) );
+    return 0;
+  }
+  g_outbuf_stdout = fd;
+  return 1;
+
+}
+
+
+int outbufSeekable( const char * filename ) {
+
+  struct stat st;
+  if ( !strcmp( filename, "-" ) ) {
+    return 0;
+  }
+  return stat( filename, &st ) || S_ISREG( st.st_mode );
+
+}
+
+
+int outbufOpenStream( const char * filename ) {
+
+  if ( !strcmp( filename, "-" ) ) {
+    return g_outbuf_stdout;
+  }
+  /* Opening a pipe waits for its reader */
+  int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 ) {
+    fprintf( stderr, "error: Could not open »%s«: %s\n", filename,
+        strerror( errno ) );
+  }
+  return fd;
+
+}
+
+
+outbuf_t * outbufOpen( const char * filename, size_t size ) {
+
+  int fd = outbufOpenStream( filename );
+  if ( fd < 0 ) {
+    return NULL;
+  }
+  outbuf_t * out = (outbuf_t *) malloc( sizeof( outbuf_t ) );
+  out->fd    = fd;
+  out->buf   = (char *) malloc( size );
+  out->size  = size;
+  out->used  = 0;
+  out->error = 0;
+  return out;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  outbufFlush
+ *  Description:  Write the buffer, continuing after short writes.
+ ******************************************************************************/
+void outbufFlush( outbuf_t * out ) {
+
+  if ( !out->error ) {
+    out->error = !outbufWriteAll( out->fd, out->buf, out->used );
+  }
+  out->used = 0;
+
+}
+
+
+char * outbufReserve( outbuf_t * out, size_t n ) {
+
+  if ( out->used + n > out->size ) {
+    outbufFlush( out );
+  }
+  char * p = out->buf + out->used;
+  out->used += n;
+  return p;
+
+}
+
+
+void outbufWrite( outbuf_t * out, const void * data, size_t n ) {
+
+  while ( n > 0 ) {
+    size_t chunk = n < out->size ? n : out->size;
+    memcpy( outbufReserve( out, chunk ), data, chunk );
+    data = (const char *) data + chunk;
+    n -= chunk;
+  }
+
+}
+
+
+void outbufPrintf( outbuf_t * out, const char * format, ... ) {
+
+  char line[1024];
+  va_list args;
+  va_start( args, format );
+  int n = vsnprintf( line, sizeof( line ), format, args );
+  va_end( args );
+  if ( n > 0 ) {
+    outbufWrite( out, line, (size_t) n < sizeof( line ) ? n : sizeof( line ) - 1 );
+  }
+
+}
+
+
+int outbufClose( outbuf_t * out ) {
+
+  outbufFlush( out );
+  if ( close( out->fd ) ) {
+    out->error = 1;
+  }
+  int ok = !out->error;
+  free( out->buf );
+  free( out );
+  return ok;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  outbufCreate
+ *  Description:  Open a file for positioned writes and reserve its size.
+ ******************************************************************************/
+int outbufCreate( const char * filename, off_t size ) {
+
+  int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 ) {
+    fprintf( stderr, "error: Could not open »%s«: %s\n", filename,
+        strerror( errno ) );
+    return -1;
+  }
+  int reserved = 0;
+#ifdef __linux__
+  reserved = !fallocate( fd, 0, 0, size );
+#endif
+  /* Without fallocate the file is sparse until it is written. */
+  if ( !reserved && ftruncate( fd, size ) ) {
+    fprintf( stderr, "error: Could not resize »%s«: %s\n", filename,
+        strerror( errno ) );
+    close( fd );
+    return -1;
+  }
+  return fd;
+
+}
+
+
+int outbufPwrite( int fd, const void * data, size_t n, off_t offset ) {
+
+  const char * p = (const char *) data;
+  while ( n > 0 ) {
+    ssize_t w = pwrite( fd, p, n, offset );
+    if ( w < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      fprintf( stderr, "error: Write failed: %s\n", strerror( errno ) );
+      return 0;
+    }
+    p      += w;
+    n      -= w;
+    offset += w;
+  }
+  return 1;
+
+}
+
+
+int outbufWriteAll( int fd, const void * data, size_t n ) {
+
+  const char * p = (const char *) data;
+  while ( n > 0 ) {
+    ssize_t w = write( fd, p, n );
+    if ( w < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      fprintf( stderr, "error: Write failed: %s\n", strerror( errno ) );
+      return 0;
+    }
+    p += w;
+    n -= w;
+  }
+  return 1;
+
+}
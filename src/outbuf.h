@@ -0,0 +1,69 @@
+/*******************************************************************************
+ *
+ *       Filename:  outbuf.h
+ *
+ *    Description:  Large write buffer for the exporters. Data is collected in
+ *                  memory and written with a few multi-megabyte write calls.
+ *
+ ******************************************************************************/
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTBUF_SIZE ( 8 << 20 )
+
+typedef struct {
+  int    fd;
+  char * buf;
+  size_t size;
+  size_t used;
+  int    error;
+} outbuf_t;
+
+/* Create or truncate filename, "-" is standard output. Returns NULL on
+ * error. */
+outbuf_t * outbufOpen( const char * filename, size_t size );
+
+/* Keep the standard output for "-" and send everything else printed to it to
+ * standard error instead, so messages do not end up in a streamed export.
+ * Returns 0 on error. */
+int  outbufRedirectStdout();
+
+/* Whether filename can be written with outbufCreate and outbufPwrite: not
+ * "-" and not an existing pipe or device. */
+int  outbufSeekable( const char * filename );
+
+/* Return room for n bytes at the end of the buffer, flushing first if
+ * necessary. n must not exceed the buffer size. */
+char * outbufReserve( outbuf_t * out, size_t n );
+
+/* Append data or formatted text. */
+void outbufWrite( outbuf_t * out, const void * data, size_t n );
+void outbufPrintf( outbuf_t * out, const char * format, ... );
+
+/* Write the buffered data to the file. */
+void outbufFlush( outbuf_t * out );
+
+/* Flush, close and free. Returns 0 if any write failed. */
+int  outbufClose( outbuf_t * out );
+
+/* Create or truncate filename with its final size, allocating the blocks up
+ * front where the file system supports it, for writers filling it at known
+ * offsets. Returns the file descriptor or -1 on error. */
+int  outbufCreate( const char * filename, off_t size );
+
+/* Write all n bytes at offset. Returns 0 on error. Safe to call from
+ * several threads on the same descriptor. */
+int  outbufPwrite( int fd, const void * data, size_t n, off_t offset );
+
+/* Open filename for sequential writes, "-" is standard output. Returns the
+ * file descriptor or -1 on error. */
+int  outbufOpenStream( const char * filename );
+
+/* Write all n bytes at the current position. Returns 0 on error. */
+int  outbufWriteAll( int fd, const void * data, size_t n );
+
+#endif /* OUTBUF_H */
@@ -0,0 +1,99 @@
+/*******************************************************************************
+ *
+ *       Filename:  outlier.cpp
+ *
+ *    Description:  Statistical outlier removal.
+ *
+ *                  One kd-tree is built over all points, the kNN queries
+ *                  run as batches in Morton order. Mean and standard
+ *                  deviation are summed over fixed chunks of points in
+ *                  order, so the result does not depend on the number of
+ *                  threads.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "kdtree.h"
+#include "outlier.h"
+
+/* Points per chunk of the mean and deviation sums */
+#define OUTLIER_CHUNK 65536
+
+/* Points per batch of queries, a multiple of OUTLIER_CHUNK */
+#define OUTLIER_BLOCK ( 16 * OUTLIER_CHUNK )
+
+
+size_t outlierFlags( const float * xyz, size_t n, int k, float nsigma,
+    uint8_t * keep, const char * index ) {
+
+  if ( n <= (size_t) k ) {
+    for ( size_t i = 0; i < n; i++ ) {
+      keep[i] = 1;
+    }
+    return 0;
+  }
+
+  kdpoints_t points = { xyz, n };
+  kdtree_t tree( 3, points, nanoflann::KDTreeSingleIndexAdaptorParams( KDTREE_LEAF ) );
+  kdtree_t * trees[1] = { &tree };
+  kdtreeBuild( trees, 1, index );
+
+  /* Mean distance to the k nearest neighbours, the first result is the
+   * query point itself. The queries run in batches of blocks of points. */
+  float * mean = (float *) malloc( n * sizeof( float ) );
+  const long chunks = ( n + OUTLIER_CHUNK - 1 ) / OUTLIER_CHUNK;
+  std::vector<double> sum( chunks ), sumsq( chunks );
+  const size_t block = n < OUTLIER_BLOCK ? n : OUTLIER_BLOCK;
+  uint32_t * idx  = (uint32_t *) malloc( block * ( k + 1 ) * sizeof( uint32_t ) );
+  float *    dist = (float *) malloc( block * ( k + 1 ) * sizeof( float ) );
+  size_t first;
+  for ( first = 0; first < n; first += OUTLIER_BLOCK ) {
+    size_t m = n - first < OUTLIER_BLOCK ? n - first : OUTLIER_BLOCK;
+    kdtreeKnnBatch( &tree, xyz + 3 * first, m, k + 1, idx, dist );
+    #pragma omp parallel for schedule( static )
+    for ( long c = first / OUTLIER_CHUNK; c < (long) ( ( first + m + OUTLIER_CHUNK - 1 ) / OUTLIER_CHUNK ); c++ ) {
+      size_t end = ( c + 1 ) * OUTLIER_CHUNK < (long) n ? ( c + 1 ) * OUTLIER_CHUNK : n;
+      double s = 0, sq = 0;
+      for ( size_t i = c * OUTLIER_CHUNK; i < end; i++ ) {
+        const float * row = dist + ( k + 1 ) * ( i - first );
+        float d = 0;
+        for ( int j = 1; j <= k; j++ ) {
+          d += sqrtf( row[j] );
+        }
+        mean[i] = d / k;
+        s  += mean[i];
+        sq += (double) mean[i] * mean[i];
+      }
+      sum[c]   = s;
+      sumsq[c] = sq;
+    }
+  }
+  free( dist );
+  free( idx );
+
+  double s = 0, sq = 0;
+  for ( long c = 0; c < chunks; c++ ) {
+    s  += sum[c];
+    sq += sumsq[c];
+  }
+  double mu    = s / n;
+  double sigma = sqrt( fmax( sq / n - mu * mu, 0 ) );
+  double limit = mu + nsigma * sigma;
+
+  size_t outliers = 0;
+  #pragma omp parallel for schedule( static ) reduction( +:outliers )
+  for ( size_t i = 0; i < n; i++ ) {
+    keep[i] = mean[i] <= limit;
+    outliers += !keep[i];
+  }
+  free( mean );
+  printf( "Outliers: %zu of %zu points, mean distance %g, limit %g\n",
+      outliers, n, mu, limit );
+  return outliers;
+
+}
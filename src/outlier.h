@@ -0,0 +1,25 @@
+/*******************************************************************************
+ *
+ *       Filename:  outlier.h
+ *
+ *    Description:  Statistical outlier removal. A point is an outlier if the
+ *                  mean distance to its k nearest neighbours exceeds the
+ *                  mean of these distances over all points by more than
+ *                  nsigma standard deviations.
+ *
+ ******************************************************************************/
+
+#ifndef OUTLIER_H
+#define OUTLIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Flag the outliers among n interleaved xyz points: keep[i] is set to 0 for
+ * outliers and to 1 for all other points. The points are indexed in place,
+ * the index is kept in the file index if set (see kdtreeBuild). Returns the
+ * number of outliers. */
+size_t outlierFlags( const float * xyz, size_t n, int k, float nsigma,
+    uint8_t * keep, const char * index );
+
+#endif /* OUTLIER_H */
@@ -0,0 +1,289 @@
+/*******************************************************************************
+ *
+ *       Filename:  overlap.cpp
+ *
+ *    Description:  Scan overlap graph.
+ *
+ *                  One kd-tree is built over the points of all scans, a
+ *                  second array tags every point with its scan. The queries
+ *                  of all scans run in Morton order, in parallel chunks.
+ *                  A query counts once for every scan with a point within
+ *                  the radius, its own scan included. Every thread sums
+ *                  the queries of a scan per hit scan in an array and adds
+ *                  the sums to its own open-addressing table keyed by the
+ *                  scan pair when the query scan changes. The tables are
+ *                  concatenated and the counts of a pair found by several
+ *                  threads are summed.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "overlap.h"
+
+#define OVERLAP_EMPTY UINT64_MAX
+
+/* Queries per chunk */
+#define OVERLAP_BATCH 256
+
+typedef struct {
+  uint64_t * keys;    /* i << 32 | j */
+  uint64_t * counts;
+  size_t     mask;    /* capacity - 1, capacity is a power of two */
+  size_t     used;
+} overlaptable_t;
+
+
+static inline uint64_t overlapHash( uint64_t key ) {
+
+  /* splitmix64 finalizer */
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+
+}
+
+
+static void overlapTableInit( overlaptable_t * t, size_t capacity ) {
+
+  t->keys   = (uint64_t *) malloc( capacity * sizeof( uint64_t ) );
+  t->counts = (uint64_t *) malloc( capacity * sizeof( uint64_t ) );
+  t->mask   = capacity - 1;
+  t->used   = 0;
+  size_t i;
+  for ( i = 0; i < capacity; i++ ) {
+    t->keys[i] = OVERLAP_EMPTY;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  overlapSlot
+ *  Description:  Linear probing. Returns the slot holding key or the empty
+ *                slot it belongs into.
+ ******************************************************************************/
+static inline size_t overlapSlot( const overlaptable_t * t, uint64_t key ) {
+
+  size_t i = overlapHash( key ) & t->mask;
+  while ( t->keys[i] != key && t->keys[i] != OVERLAP_EMPTY ) {
+    i = ( i + 1 ) & t->mask;
+  }
+  return i;
+
+}
+
+
+static void overlapAdd( overlaptable_t * t, uint64_t key, uint64_t count ) {
+
+  if ( 2 * ( t->used + 1 ) > t->mask + 1 ) {
+    /* Double the capacity and reinsert all pairs */
+    overlaptable_t old = *t;
+    overlapTableInit( t, ( old.mask + 1 ) * 2 );
+    size_t i;
+    for ( i = 0; i <= old.mask; i++ ) {
+      if ( old.keys[i] != OVERLAP_EMPTY ) {
+        size_t s = overlapSlot( t, old.keys[i] );
+        t->keys[s]   = old.keys[i];
+        t->counts[s] = old.counts[i];
+      }
+    }
+    t->used = old.used;
+    free( old.keys );
+    free( old.counts );
+  }
+  size_t s = overlapSlot( t, key );
+  if ( t->keys[s] == OVERLAP_EMPTY ) {
+    t->keys[s]   = key;
+    t->counts[s] = 0;
+    t->used++;
+  }
+  t->counts[s] += count;
+
+}
+
+
+/* nanoflann result set counting the queries of one scan per hit scan */
+struct overlaphits_t {
+
+  float            radius;   /* squared */
+  const uint32_t * scan;     /* scan of every point */
+  uint32_t         self;     /* scan of the queries */
+  overlaptable_t * table;
+  size_t           query;    /* current query + 1 */
+  size_t *         seen;     /* per scan, the last query + 1 that hit it */
+  uint64_t *       counts;   /* per scan, queries of self that hit it */
+  std::vector<uint32_t> hit; /* scans with a count */
+
+  inline bool full() const {
+    return true;
+  }
+
+  inline float worstDist() const {
+    return radius;
+  }
+
+  inline bool addPoint( float, uint32_t index ) {
+    uint32_t s = scan[index];
+    if ( seen[s] != query ) {
+      seen[s] = query;
+      if ( !counts[s]++ ) {
+        hit.push_back( s );
+      }
+    }
+    return true;
+  }
+
+  inline void flush() {
+    size_t k;
+    for ( k = 0; k < hit.size(); k++ ) {
+      overlapAdd( table, (uint64_t) self << 32 | hit[k], counts[ hit[k] ] );
+      counts[ hit[k] ] = 0;
+    }
+    hit.clear();
+  }
+
+};
+
+
+static bool overlapLess( const overlap_t & a, const overlap_t & b ) {
+
+  return a.i < b.i || ( a.i == b.i && a.j < b.j );
+
+}
+
+
+size_t overlapPairs( const float * xyz, const size_t * first, int nscans,
+    float radius, int skip, overlap_t ** pairs, const char * index ) {
+
+  size_t n = first[nscans];
+  if ( skip < 1 ) {
+    skip = 1;
+  }
+  uint32_t * scan = (uint32_t *) malloc( n * sizeof( uint32_t ) );
+  #pragma omp parallel for schedule( dynamic, 64 )
+  for ( int s = 0; s < nscans; s++ ) {
+    for ( size_t p = first[s]; p < first[ s + 1 ]; p++ ) {
+      scan[p] = s;
+    }
+  }
+
+  kdpoints_t points = { xyz, n };
+  kdtree_t tree( 3, points, nanoflann::KDTreeSingleIndexAdaptorParams( KDTREE_LEAF ) );
+  kdtree_t * trees[1] = { &tree };
+  kdtreeBuild( trees, 1, index );
+
+  /* Queries in Morton order */
+  size_t nq = 0;
+  for ( int s = 0; s < nscans; s++ ) {
+    nq += ( first[ s + 1 ] - first[s] + skip - 1 ) / skip;
+  }
+  size_t * query = (size_t *) malloc( nq * sizeof( size_t ) );
+  float *  qxyz  = (float *) malloc( 3 * nq * sizeof( float ) );
+  uint32_t * order = (uint32_t *) malloc( nq * sizeof( uint32_t ) );
+  size_t k = 0;
+  for ( int s = 0; s < nscans; s++ ) {
+    for ( size_t p = first[s]; p < first[ s + 1 ]; p += skip, k++ ) {
+      query[k] = p;
+      memcpy( qxyz + 3 * k, xyz + 3 * p, 3 * sizeof( float ) );
+    }
+  }
+  kdtreeMortonOrder( qxyz, nq, order );
+  free( qxyz );
+  const long chunks = ( nq + OVERLAP_BATCH - 1 ) / OVERLAP_BATCH;
+
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  std::vector<overlaptable_t> tables( nthreads );
+
+  #pragma omp parallel num_threads( nthreads )
+  {
+    int t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    overlapTableInit( &tables[t], 1024 );
+#ifdef _OPENMP
+    /* Threads that were not started have no table */
+    #pragma omp single
+    nthreads = omp_get_num_threads();
+#endif
+    overlaphits_t hits;
+    hits.radius = radius * radius;
+    hits.scan   = scan;
+    hits.table  = &tables[t];
+    hits.self   = 0;
+    hits.query  = 0;
+    hits.seen   = (size_t *) calloc( nscans, sizeof( size_t ) );
+    hits.counts = (uint64_t *) calloc( nscans, sizeof( uint64_t ) );
+
+    #pragma omp for schedule( dynamic, 1 )
+    for ( long c = 0; c < chunks; c++ ) {
+      size_t end = ( c + 1 ) * OVERLAP_BATCH < (long) nq ? ( c + 1 ) * OVERLAP_BATCH : nq;
+      for ( size_t q = c * OVERLAP_BATCH; q < end; q++ ) {
+        size_t p = query[ order[q] ];
+        if ( scan[p] != hits.self ) {
+          hits.flush();
+          hits.self = scan[p];
+        }
+        hits.query = q + 1;
+        tree.findNeighbors( hits, xyz + 3 * p, nanoflann::SearchParams() );
+      }
+    }
+    hits.flush();
+    free( hits.seen );
+    free( hits.counts );
+  }
+  free( order );
+  free( query );
+  free( scan );
+
+  size_t count = 0;
+  for ( int t = 0; t < nthreads; t++ ) {
+    count += tables[t].used;
+  }
+  overlap_t * out = (overlap_t *) malloc( ( count ? count : 1 ) * sizeof( overlap_t ) );
+  k = 0;
+  for ( int t = 0; t < nthreads; t++ ) {
+    size_t i;
+    for ( i = 0; i <= tables[t].mask; i++ ) {
+      if ( tables[t].keys[i] != OVERLAP_EMPTY ) {
+        out[k].i     = tables[t].keys[i] >> 32;
+        out[k].j     = (uint32_t) tables[t].keys[i];
+        out[k].count = tables[t].counts[i];
+        k++;
+      }
+    }
+    free( tables[t].keys );
+    free( tables[t].counts );
+  }
+  std::sort( out, out + count, overlapLess );
+
+  /* A pair can be counted by several threads */
+  size_t w = 0;
+  for ( k = 0; k < count; k++ ) {
+    if ( w && out[ w - 1 ].i == out[k].i && out[ w - 1 ].j == out[k].j ) {
+      out[ w - 1 ].count += out[k].count;
+    } else {
+      out[ w++ ] = out[k];
+    }
+  }
+  *pairs = out;
+  return w;
+
+}
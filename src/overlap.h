@@ -0,0 +1,34 @@
+/*******************************************************************************
+ *
+ *       Filename:  overlap.h
+ *
+ *    Description:  Scan overlap graph. Points of a subsample of every scan
+ *                  are matched against the points of all scans within a
+ *                  radius, the queries with hits are counted per pair of
+ *                  scans.
+ *
+ ******************************************************************************/
+
+#ifndef OVERLAP_H
+#define OVERLAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Queries of scan i with a point of scan j within the radius */
+typedef struct {
+  uint32_t i, j;
+  uint64_t count;
+} overlap_t;
+
+/* Count the overlap of nscans scans stored one after another in xyz, in
+ * world coordinates: scan s holds the points first[s] to first[s + 1] - 1.
+ * Every skip-th point of a scan is a query, which hits a scan, its own
+ * included, if one of its points is closer than radius. A query counts at
+ * most once per scan. The pairs with hits are stored in *pairs,
+ * ordered by i and j, to be released with free. The index of the points is
+ * kept in the file index if set (see kdtreeBuild). Returns their number. */
+size_t overlapPairs( const float * xyz, const size_t * first, int nscans,
+    float radius, int skip, overlap_t ** pairs, const char * index );
+
+#endif /* OVERLAP_H */
@@ -0,0 +1,290 @@
+/*******************************************************************************
+ *
+ *       Filename:  perf.cpp
+ *
+ *    Description:  Frame instrumentation.
+ *
+ *                  GPU time is measured with GL_TIME_ELAPSED queries. Their
+ *                  results arrive a few frames late, thus every frame gets a
+ *                  slot in a ring of samples which is completed (and logged)
+ *                  once its query result is available. The pipeline is never
+ *                  stalled unless all queries are still in flight.
+ *
+ ******************************************************************************/
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glut.h>
+#include <GL/gl.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "perf.h"
+
+#define PERF_RING     64   /* frames the averages are computed over */
+#define PERF_QUERIES   4   /* GPU queries in flight */
+#define PERF_INTERVAL 0.25 /* seconds between overlay updates */
+
+typedef struct {
+  long   frame;
+  double time;       /* start of frame in seconds */
+  double cpu_ms;
+  double gpu_ms;     /* < 0 while pending or unsupported */
+  long   points;
+  int    clouds_drawn;
+  int    clouds_skipped;
+  size_t upload;
+} perfsample_t;
+
+static int          g_perf_enabled  = 0;
+static int          g_perf_timer    = 0;
+static FILE *       g_perf_log      = NULL;
+static long         g_perf_frame    = 0;
+static double       g_perf_start    = 0;
+static double       g_perf_update   = 0;
+static perfsample_t g_perf_ring[PERF_RING];
+static GLuint       g_perf_query[PERF_QUERIES];
+static long         g_perf_qframe[PERF_QUERIES];
+
+
+/*******************************************************************************
+ *         Name:  perfNow
+ *  Description:  Monotonic time in seconds.
+ ******************************************************************************/
+static double perfNow() {
+
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  perfLogSample
+ *  Description:  Write one complete sample as CSV row.
+ ******************************************************************************/
+static void perfLogSample( const perfsample_t * s ) {
+
+  if ( !g_perf_log ) {
+    return;
+  }
+  double dt = 0;
+  if ( s->frame > 0 ) {
+    dt = s->time - g_perf_ring[ ( s->frame - 1 ) % PERF_RING ].time;
+  }
+  fprintf( g_perf_log, "%ld,%.6f,", s->frame, s->time - g_perf_start );
+  if ( s->gpu_ms >= 0 ) {
+    fprintf( g_perf_log, "%.4f", s->gpu_ms );
+  }
+  fprintf( g_perf_log, ",%.4f,%ld,%d,%d,%.3f\n", s->cpu_ms, s->points,
+           s->clouds_drawn, s->clouds_skipped,
+           dt > 0 ? s->upload / dt / 1e6 : 0.0 );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  perfCollect
+ *  Description:  Fetch available query results. If wait is set, block until
+ *                the query of the given slot is done.
+ ******************************************************************************/
+static void perfCollect( int waitslot ) {
+
+  int q;
+  for ( q = 0; q < PERF_QUERIES; q++ ) {
+    if ( g_perf_qframe[q] < 0 ) {
+      continue;
+    }
+    GLint available = 0;
+    if ( q != waitslot ) {
+      glGetQueryObjectiv( g_perf_query[q], GL_QUERY_RESULT_AVAILABLE, &available );
+      if ( !available ) {
+        continue;
+      }
+    }
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v( g_perf_query[q], GL_QUERY_RESULT, &ns );
+    perfsample_t * s = g_perf_ring + g_perf_qframe[q] % PERF_RING;
+    if ( s->frame == g_perf_qframe[q] ) {
+      s->gpu_ms = ns * 1e-6;
+      perfLogSample( s );
+    }
+    g_perf_qframe[q] = -1;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  perfInit
+ *  Description:  Set up timer queries and the CSV log.
+ ******************************************************************************/
+void perfInit( const char * logfile ) {
+
+  memset( g_perf_ring, 0, sizeof( g_perf_ring ) );
+  g_perf_timer = glutExtensionSupported( "GL_ARB_timer_query" );
+  if ( g_perf_timer ) {
+    glGenQueries( PERF_QUERIES, g_perf_query );
+  } else {
+    fprintf( stderr, "warning: No timer queries, GPU time not available.\n" );
+  }
+  int q;
+  for ( q = 0; q < PERF_QUERIES; q++ ) {
+    g_perf_qframe[q] = -1;
+  }
+  g_perf_start = perfNow();
+
+  if ( logfile ) {
+    g_perf_log = fopen( logfile, "w" );
+    if ( !g_perf_log ) {
+      fprintf( stderr, "error: Could not open »%s«.\n", logfile );
+    } else {
+      fprintf( g_perf_log, "frame,time_s,gpu_ms,cpu_ms,points,"
+               "clouds_drawn,clouds_skipped,upload_mb_s\n" );
+      g_perf_enabled = 1;
+    }
+  }
+
+}
+
+
+void perfEnable( int enable ) {
+
+  g_perf_enabled = enable || g_perf_log;
+
+}
+
+
+int perfEnabled() {
+
+  return g_perf_enabled;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  perfBeginFrame
+ *  Description:  Start CPU timer and GPU query of a new frame.
+ ******************************************************************************/
+void perfBeginFrame() {
+
+  if ( !g_perf_enabled ) {
+    return;
+  }
+  perfsample_t * s = g_perf_ring + g_perf_frame % PERF_RING;
+  memset( s, 0, sizeof( perfsample_t ) );
+  s->frame  = g_perf_frame;
+  s->time   = perfNow();
+  s->gpu_ms = -1;
+
+  if ( g_perf_timer ) {
+    int q = g_perf_frame % PERF_QUERIES;
+    if ( g_perf_qframe[q] >= 0 ) {
+      perfCollect( q );
+    }
+    g_perf_qframe[q] = g_perf_frame;
+    glBeginQuery( GL_TIME_ELAPSED, g_perf_query[q] );
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  perfEndFrame
+ *  Description:  Stop timers of the current frame and collect finished
+ *                queries of earlier frames.
+ ******************************************************************************/
+void perfEndFrame() {
+
+  if ( !g_perf_enabled ) {
+    return;
+  }
+  perfsample_t * s = g_perf_ring + g_perf_frame % PERF_RING;
+  s->cpu_ms = ( perfNow() - s->time ) * 1e3;
+
+  if ( g_perf_timer ) {
+    glEndQuery( GL_TIME_ELAPSED );
+    perfCollect( -1 );
+  } else {
+    perfLogSample( s );
+  }
+  g_perf_frame++;
+
+}
+
+
+void perfCountPoints( long points ) {
+
+  g_perf_ring[ g_perf_frame % PERF_RING ].points += points;
+
+}
+
+
+void perfCountClouds( int drawn, int skipped ) {
+
+  g_perf_ring[ g_perf_frame % PERF_RING ].clouds_drawn  += drawn;
+  g_perf_ring[ g_perf_frame % PERF_RING ].clouds_skipped += skipped;
+
+}
+
+
+void perfCountUpload( size_t bytes ) {
+
+  g_perf_ring[ g_perf_frame % PERF_RING ].upload += bytes;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  perfGetStats
+ *  Description:  Average the finished frames in the ring. The result only
+ *                changes every PERF_INTERVAL seconds to keep it readable.
+ ******************************************************************************/
+int perfGetStats( perfstats_t * stats ) {
+
+  double now = perfNow();
+  if ( now - g_perf_update < PERF_INTERVAL || !g_perf_frame ) {
+    return 0;
+  }
+  g_perf_update = now;
+
+  long n = g_perf_frame < PERF_RING ? g_perf_frame : PERF_RING;
+  long first = g_perf_frame - n;
+  double cpu = 0, gpu = 0;
+  long gpun = 0;
+  size_t upload = 0;
+  long f;
+  for ( f = first; f < g_perf_frame; f++ ) {
+    const perfsample_t * s = g_perf_ring + f % PERF_RING;
+    cpu    += s->cpu_ms;
+    upload += s->upload;
+    if ( s->gpu_ms >= 0 ) {
+      gpu += s->gpu_ms;
+      gpun++;
+    }
+  }
+  const perfsample_t * last = g_perf_ring + ( g_perf_frame - 1 ) % PERF_RING;
+  double span = last->time - g_perf_ring[ first % PERF_RING ].time;
+
+  stats->cpu_ms        = cpu / n;
+  stats->gpu_ms        = gpun ? gpu / gpun : -1;
+  stats->fps           = span > 0 ? ( n - 1 ) / span : 0;
+  stats->points        = last->points;
+  stats->clouds_drawn  = last->clouds_drawn;
+  stats->clouds_skipped = last->clouds_skipped;
+  stats->upload_mbs    = span > 0 ? upload / span / 1e6 : 0;
+  return 1;
+
+}
+
+
+void perfCleanup() {
+
+  if ( g_perf_log ) {
+    fclose( g_perf_log );
+    g_perf_log = NULL;
+  }
+
+}
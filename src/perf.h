@@ -0,0 +1,49 @@
+/*******************************************************************************
+ *
+ *       Filename:  perf.h
+ *
+ *    Description:  Frame instrumentation: GPU timer queries, CPU timers and
+ *                  counters of drawn points, clouds and uploaded bytes.
+ *
+ ******************************************************************************/
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stddef.h>
+
+/* Averages over the last frames, used by the overlay. */
+typedef struct {
+  double gpu_ms;        /* < 0 if timer queries are not supported */
+  double cpu_ms;
+  double fps;
+  long   points;        /* values of the last frame */
+  int    clouds_drawn;
+  int    clouds_skipped;
+  double upload_mbs;
+} perfstats_t;
+
+/* Start collecting. If logfile is not NULL one CSV row per frame is written
+ * to it. Needs a current GL context. */
+void perfInit( const char * logfile );
+
+/* Turn collection on or off, it is always on while a log is written. */
+void perfEnable( int enable );
+int  perfEnabled();
+
+/* Frame boundaries, wrapped around everything submitted in drawScene. */
+void perfBeginFrame();
+void perfEndFrame();
+
+/* Counters for the current frame. */
+void perfCountPoints( long points );
+void perfCountClouds( int drawn, int skipped );
+void perfCountUpload( size_t bytes );
+
+/* Rolling averages. Returns 1 if they changed since the last call. */
+int  perfGetStats( perfstats_t * stats );
+
+/* Close the log file. */
+void perfCleanup();
+
+#endif /* PERF_H */
@@ -0,0 +1,384 @@
+/*******************************************************************************
+ *
+ *       Filename:  posegraph.cpp
+ *
+ *    Description:  Pose-graph optimisation on SE(3).
+ *
+ *                  The error of an edge is e = log( Z^-1 Ti^-1 Tj ), poses
+ *                  are updated as T exp( d ) with d = ( v, w ). Levenberg-
+ *                  Marquardt steps are solved with a sparse Cholesky (LDLT)
+ *                  factorisation of the block Hessian; its pattern is fixed,
+ *                  so the ordering and symbolic factorisation are computed
+ *                  once and every edge adds its blocks at offsets found up
+ *                  front. The Jacobians of an edge are only computed again
+ *                  once one of its nodes has moved by more than the
+ *                  relinearisation threshold since they were last computed.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+
+#include "posegraph.h"
+
+/* Edges per chunk of the cost sums */
+#define PG_CHUNK 1024
+
+typedef Eigen::Matrix<double, 6, 6> mat6_t;
+typedef Eigen::Matrix<double, 6, 1> vec6_t;
+typedef Eigen::SparseMatrix<double> spmat_t;
+
+/* Linearisation of an edge */
+typedef struct {
+  mat6_t Ji, Jj;
+  vec6_t e;
+  int    vi, vj;             /* first variable of the nodes, -1 if fixed */
+  int    hii, hjj, hij, hji; /* offsets of the Hessian blocks, -1 if none */
+} pglin_t;
+
+
+static Eigen::Matrix3d pgHat( const Eigen::Vector3d & w ) {
+
+  Eigen::Matrix3d W;
+  W <<     0, -w(2),  w(1),
+        w(2),     0, -w(0),
+       -w(1),  w(0),     0;
+  return W;
+
+}
+
+
+static Eigen::Matrix4d pgExp( const vec6_t & d ) {
+
+  Eigen::Vector3d w = d.tail<3>();
+  Eigen::Matrix3d W = pgHat( w );
+  double theta = w.norm();
+  Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+  Eigen::Matrix3d V = Eigen::Matrix3d::Identity();
+  if ( theta < 1e-10 ) {
+    R += W;
+    V += 0.5 * W;
+  } else {
+    R = Eigen::AngleAxisd( theta, w / theta ).toRotationMatrix();
+    V += ( 1 - cos( theta ) ) / ( theta * theta ) * W
+      + ( theta - sin( theta ) ) / ( theta * theta * theta ) * W * W;
+  }
+  Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+  T.block<3, 3>( 0, 0 ) = R;
+  T.block<3, 1>( 0, 3 ) = V * d.head<3>();
+  return T;
+
+}
+
+
+static vec6_t pgLog( const Eigen::Matrix4d & T ) {
+
+  Eigen::Matrix3d R = T.block<3, 3>( 0, 0 );
+  Eigen::AngleAxisd aa( R );
+  Eigen::Vector3d w = aa.angle() * aa.axis();
+  double theta = aa.angle();
+  Eigen::Matrix3d W = pgHat( w );
+  double c = 1.0 / 12;
+  if ( theta > 1e-5 ) {
+    c = ( 1 - theta * sin( theta ) / ( 2 * ( 1 - cos( theta ) ) ) ) / ( theta * theta );
+  }
+  Eigen::Matrix3d Vinv = Eigen::Matrix3d::Identity() - 0.5 * W + c * W * W;
+  vec6_t d;
+  d << Vinv * T.block<3, 1>( 0, 3 ), w;
+  return d;
+
+}
+
+
+/* Adjoint of T for d = ( v, w ) */
+static mat6_t pgAdjoint( const Eigen::Matrix4d & T ) {
+
+  Eigen::Matrix3d R = T.block<3, 3>( 0, 0 );
+  mat6_t A = mat6_t::Zero();
+  A.block<3, 3>( 0, 0 ) = R;
+  A.block<3, 3>( 0, 3 ) = pgHat( T.block<3, 1>( 0, 3 ) ) * R;
+  A.block<3, 3>( 3, 3 ) = R;
+  return A;
+
+}
+
+
+static Eigen::Matrix4d pgInverse( const Eigen::Matrix4d & T ) {
+
+  Eigen::Matrix4d I = Eigen::Matrix4d::Identity();
+  I.block<3, 3>( 0, 0 ) = T.block<3, 3>( 0, 0 ).transpose();
+  I.block<3, 1>( 0, 3 ) = -I.block<3, 3>( 0, 0 ) * T.block<3, 1>( 0, 3 );
+  return I;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  pgError
+ *  Description:  Error of an edge and, if J is set, its Jacobians.
+ ******************************************************************************/
+static vec6_t pgError( const Eigen::Matrix4d & Zinv, const Eigen::Matrix4d & Ti,
+    const Eigen::Matrix4d & Tj, pglin_t * J ) {
+
+  Eigen::Matrix4d Tij = pgInverse( Ti ) * Tj;
+  vec6_t e = pgLog( Zinv * Tij );
+  if ( J ) {
+    /* Inverse right Jacobian of the log to first order */
+    mat6_t Jr = mat6_t::Identity();
+    Jr.block<3, 3>( 0, 0 ) += 0.5 * pgHat( e.tail<3>() );
+    Jr.block<3, 3>( 0, 3 ) += 0.5 * pgHat( e.head<3>() );
+    Jr.block<3, 3>( 3, 3 ) += 0.5 * pgHat( e.tail<3>() );
+    J->Jj = Jr;
+    J->Ji = -Jr * pgAdjoint( pgInverse( Tij ) );
+  }
+  return e;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  pgOffset
+ *  Description:  Offset of the value of entry (r, c) of a compressed
+ *                column-major matrix.
+ ******************************************************************************/
+static int pgOffset( const spmat_t & H, int r, int c ) {
+
+  const int * begin = H.innerIndexPtr() + H.outerIndexPtr()[c];
+  const int * end   = H.innerIndexPtr() + H.outerIndexPtr()[ c + 1 ];
+  return std::lower_bound( begin, end, r ) - H.innerIndexPtr();
+
+}
+
+
+/*******************************************************************************
+ *         Name:  pgAddBlock
+ *  Description:  Add a 6x6 block at the offset of its top left entry, the
+ *                rows of a block are consecutive in every column.
+ ******************************************************************************/
+static inline void pgAddBlock( spmat_t & H, const spmat_t & pattern, int r,
+    int c, int offset, const mat6_t & B ) {
+
+  double * v = H.valuePtr();
+  int k;
+  for ( k = 0; k < 6; k++ ) {
+    int o = k ? pgOffset( pattern, r, c + k ) : offset;
+    Eigen::Map<vec6_t>( v + o ) += B.col( k );
+  }
+
+}
+
+
+int pgOptimize( double ** poses, int n, const pgedge_t * edges, size_t m,
+    const pgparams_t * params ) {
+
+  typedef std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > posevec_t;
+
+  /* Variables of all posed nodes but the first */
+  std::vector<int> var( n, -1 );
+  int nv = 0, fixed = -1;
+  for ( int i = 0; i < n; i++ ) {
+    if ( !poses[i] ) {
+      continue;
+    }
+    if ( fixed < 0 ) {
+      fixed = i;
+    } else {
+      var[i] = 6 * nv++;
+    }
+  }
+  if ( !nv ) {
+    return 1;
+  }
+  posevec_t T( n, Eigen::Matrix4d::Identity() );
+  for ( int i = 0; i < n; i++ ) {
+    if ( poses[i] ) {
+      T[i] = Eigen::Map<Eigen::Matrix4d>( poses[i] );
+    }
+  }
+  posevec_t Zinv( m );
+  std::vector<pglin_t, Eigen::aligned_allocator<pglin_t> > lin( m );
+  for ( size_t k = 0; k < m; k++ ) {
+    const pgedge_t * g = edges + k;
+    if ( g->i < 0 || g->i >= n || g->j < 0 || g->j >= n || !poses[ g->i ]
+        || !poses[ g->j ] || g->i == g->j ) {
+      fprintf( stderr, "error: Invalid pose graph edge %d %d.\n", g->i, g->j );
+      return 0;
+    }
+    Zinv[k] = pgInverse( Eigen::Map<const Eigen::Matrix4d>( g->z ) );
+    lin[k].vi = var[ g->i ];
+    lin[k].vj = var[ g->j ];
+  }
+
+  /* Block pattern of the Hessian */
+  const int N = 6 * nv;
+  std::vector<Eigen::Triplet<double> > pattern;
+  for ( int i = 0; i < n; i++ ) {
+    if ( var[i] >= 0 ) {
+      for ( int r = 0; r < 6; r++ ) {
+        for ( int c = 0; c < 6; c++ ) {
+          pattern.push_back( Eigen::Triplet<double>( var[i] + r, var[i] + c, 0 ) );
+        }
+      }
+    }
+  }
+  for ( size_t k = 0; k < m; k++ ) {
+    if ( lin[k].vi >= 0 && lin[k].vj >= 0 ) {
+      for ( int r = 0; r < 6; r++ ) {
+        for ( int c = 0; c < 6; c++ ) {
+          pattern.push_back( Eigen::Triplet<double>( lin[k].vi + r, lin[k].vj + c, 0 ) );
+          pattern.push_back( Eigen::Triplet<double>( lin[k].vj + r, lin[k].vi + c, 0 ) );
+        }
+      }
+    }
+  }
+  spmat_t H( N, N );
+  H.setFromTriplets( pattern.begin(), pattern.end() );
+  std::vector<Eigen::Triplet<double> >().swap( pattern );
+  H.makeCompressed();
+  const spmat_t P = H;
+  for ( size_t k = 0; k < m; k++ ) {
+    pglin_t * l = &lin[k];
+    l->hii = l->vi >= 0 ? pgOffset( P, l->vi, l->vi ) : -1;
+    l->hjj = l->vj >= 0 ? pgOffset( P, l->vj, l->vj ) : -1;
+    l->hij = l->vi >= 0 && l->vj >= 0 ? pgOffset( P, l->vi, l->vj ) : -1;
+    l->hji = l->vi >= 0 && l->vj >= 0 ? pgOffset( P, l->vj, l->vi ) : -1;
+  }
+  std::vector<int> diag( N );
+  for ( int r = 0; r < N; r++ ) {
+    diag[r] = pgOffset( P, r, r );
+  }
+  Eigen::SimplicialLDLT<spmat_t> solver;
+  solver.analyzePattern( H );
+
+  /* Information of the edges */
+  vec6_t info;
+  info.head<3>().setConstant( 1 / ( params->sigma_t * params->sigma_t ) );
+  info.tail<3>().setConstant( 1 / ( params->sigma_r * params->sigma_r ) );
+  const long chunks = ( m + PG_CHUNK - 1 ) / PG_CHUNK;
+  std::vector<double> partial( chunks );
+
+  /* Cost of poses X, storing the errors in e */
+  std::vector<vec6_t, Eigen::aligned_allocator<vec6_t> > e( m ), etry( m );
+  auto cost = [&]( const posevec_t & X,
+      std::vector<vec6_t, Eigen::aligned_allocator<vec6_t> > & err ) {
+    #pragma omp parallel for schedule( static )
+    for ( long c = 0; c < chunks; c++ ) {
+      double s = 0;
+      size_t end = std::min( (size_t) ( c + 1 ) * PG_CHUNK, m );
+      for ( size_t k = c * PG_CHUNK; k < end; k++ ) {
+        err[k] = pgError( Zinv[k], X[ edges[k].i ], X[ edges[k].j ], NULL );
+        s += edges[k].weight * err[k].dot( info.cwiseProduct( err[k] ) );
+      }
+      partial[c] = s;
+    }
+    double s = 0;
+    for ( long c = 0; c < chunks; c++ ) {
+      s += partial[c];
+    }
+    return s;
+  };
+
+  std::vector<double> moved( n, INFINITY );
+  double f = cost( T, e ), f0 = f, lambda = 1e-4;
+  int it, relinearized = 0, converged = 0;
+  for ( it = 0; it < params->iterations && !converged; it++ ) {
+
+    /* Relinearise the edges of nodes which moved */
+    #pragma omp parallel for schedule( static ) reduction( +:relinearized )
+    for ( size_t k = 0; k < m; k++ ) {
+      if ( moved[ edges[k].i ] > params->relinearize
+          || moved[ edges[k].j ] > params->relinearize ) {
+        pgError( Zinv[k], T[ edges[k].i ], T[ edges[k].j ], &lin[k] );
+        relinearized++;
+      }
+    }
+    for ( int i = 0; i < n; i++ ) {
+      if ( moved[i] > params->relinearize ) {
+        moved[i] = 0;
+      }
+    }
+
+    std::fill( H.valuePtr(), H.valuePtr() + H.nonZeros(), 0.0 );
+    Eigen::VectorXd b = Eigen::VectorXd::Zero( N );
+    for ( size_t k = 0; k < m; k++ ) {
+      const pglin_t * l = &lin[k];
+      mat6_t OJi = ( edges[k].weight * info ).asDiagonal() * l->Ji;
+      mat6_t OJj = ( edges[k].weight * info ).asDiagonal() * l->Jj;
+      if ( l->vi >= 0 ) {
+        pgAddBlock( H, P, l->vi, l->vi, l->hii, l->Ji.transpose() * OJi );
+        b.segment<6>( l->vi ) += OJi.transpose() * e[k];
+      }
+      if ( l->vj >= 0 ) {
+        pgAddBlock( H, P, l->vj, l->vj, l->hjj, l->Jj.transpose() * OJj );
+        b.segment<6>( l->vj ) += OJj.transpose() * e[k];
+      }
+      if ( l->hij >= 0 ) {
+        pgAddBlock( H, P, l->vi, l->vj, l->hij, l->Ji.transpose() * OJj );
+        pgAddBlock( H, P, l->vj, l->vi, l->hji, l->Jj.transpose() * OJi );
+      }
+    }
+    std::vector<double> hdiag( N );
+    for ( int r = 0; r < N; r++ ) {
+      hdiag[r] = H.valuePtr()[ diag[r] ];
+    }
+
+    /* Damp until the cost decreases */
+    int accepted = 0;
+    Eigen::VectorXd d;
+    posevec_t X = T;
+    while ( !accepted && lambda < 1e10 ) {
+      for ( int r = 0; r < N; r++ ) {
+        H.valuePtr()[ diag[r] ] = hdiag[r] * ( 1 + lambda ) + 1e-12;
+      }
+      solver.factorize( H );
+      if ( solver.info() != Eigen::Success ) {
+        lambda *= 10;
+        continue;
+      }
+      d = -solver.solve( b );
+      for ( int i = 0; i < n; i++ ) {
+        if ( var[i] >= 0 ) {
+          X[i] = T[i] * pgExp( d.segment<6>( var[i] ) );
+        }
+      }
+      double g = cost( X, etry );
+      if ( g < f ) {
+        accepted = 1;
+        lambda = std::max( lambda / 3, 1e-9 );
+        for ( int i = 0; i < n; i++ ) {
+          if ( var[i] >= 0 ) {
+            moved[i] += d.segment<6>( var[i] ).norm();
+          }
+        }
+        T.swap( X );
+        e.swap( etry );
+        converged = f - g < 1e-10 * f0;
+        f = g;
+      } else {
+        lambda *= 4;
+      }
+    }
+    if ( !accepted || d.lpNorm<Eigen::Infinity>() < 1e-10 ) {
+      break;
+    }
+  }
+
+  for ( int i = 0; i < n; i++ ) {
+    if ( var[i] >= 0 ) {
+      Eigen::Map<Eigen::Matrix4d> pose( poses[i] );
+      pose = T[i];
+    }
+  }
+  printf( "Pose graph: %d poses, %zu edges, cost %g -> %g, %d edge linearisations\n",
+      nv + 1, m, f0, f, relinearized );
+  return 1;
+
+}
@@ -0,0 +1,35 @@
+/*******************************************************************************
+ *
+ *       Filename:  posegraph.h
+ *
+ *    Description:  Pose-graph optimisation. Poses are nodes, relative pose
+ *                  measurements between them are edges, the poses are
+ *                  moved to agree best with all measurements.
+ *
+ ******************************************************************************/
+
+#ifndef POSEGRAPH_H
+#define POSEGRAPH_H
+
+#include <stddef.h>
+
+typedef struct {
+  int    i, j;               /* nodes */
+  double z[16];              /* pose of j in the frame of i, column-major */
+  double weight;             /* scales the information of the edge */
+} pgedge_t;
+
+typedef struct {
+  double sigma_t;            /* standard deviation of edge translations */
+  double sigma_r;            /* and rotations, in radians */
+  int    iterations;
+  double relinearize;        /* motion of a node before its edges are
+                                linearised again */
+} pgparams_t;
+
+/* Optimise the n column-major 4x4 poses, NULL for nodes without a pose,
+ * in place. The first pose is held fixed. Returns 0 on error. */
+int  pgOptimize( double ** poses, int n, const pgedge_t * edges, size_t m,
+    const pgparams_t * params );
+
+#endif /* POSEGRAPH_H */
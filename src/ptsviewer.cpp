@@ -17,6 +17,19 @@
  ******************************************************************************/
 
 #include "ptsviewer.h"
+#include "hudtext.h"
+#include "perf.h"
+#include "xform.h"
+#include "outbuf.h"
+#include "las.h"
+#include "tiles.h"
+#include "outlier.h"
+#include "overlap.h"
+#include "occupancy.h"
+#include "icp.h"
+#include "kdtree.h"
+#include "kdlog.h"
+#include <unistd.h>
 #include <Eigen/Dense>
 #include <string>
 #include <map>
@@ -24,56 +37,39 @@
 
 //#include <tuple>
 #include <vector>
+#include <sstream>
+#include <algorithm>
 #include <iterator>
-//#include <kdtree++/kdtree.hpp>
-//#include <nanoflann.hpp>
 #include <cstdio>
 
 using std::vector;
 
 
-// #define min(A,B) ((A)<(B) ? (A) : (B)) 
-// #define max(A,B) ((A)>(B) ? (A) : (B)) 
-// struct kdtreeNode
-// {
-//   typedef double value_type;
-  
-//   double xyz[3];
-//   size_t index;
-  
-//   value_type operator[](size_t n) const
-//   {
-//     return xyz[n];
-//   }
-  
-//   double distance( const kdtreeNode &node)
-//   {
-//     double x = xyz[0] - node.xyz[0];
-//     double y = xyz[1] - node.xyz[1];
-//     double z = xyz[2] - node.xyz[2];
-    
-//     // this is not correct   return sqrt( x*x+y*y+z*z);
-    
-//     // this is what kdtree checks with find_within_range()
-//     // the "manhattan distance" from the search point.
-//     // effectively, distance is the maximum distance in any one dimension.
-//     return max(fabs(x),max(fabs(y),fabs(z)));
-    
-//   }
-// };
-
-// typedef KDTree::KDTree<3,kdtreeNode> treeType;
-
-// get the indices of the nearest neighbors
-//void get_nn_indices(const treeType& tree, double limit, int target, int skip, std::map<std::pair<int,int>,int>& hits);
-
 void read_points_file(char* points_file, float*& allpoints, uint8_t*& allcolors, int*& allids, int& num_points);
 
 void read_points_file2(char* points_file, float*& allpoints, uint8_t*& allcolors, int*& allids, int& num_points);
 
 void update_movie_index(int value);
 
-void write_point_chunk(FILE* f, double* point1, double* point2, int NCUT, uint8_t* color);
+void drawOverlay();
+void drawWorldBuffer( const GLuint * vbo, GLint first, GLsizei count );
+void buildVoxelBuffer();
+void drawVoxels();
+int reduceClouds( const std::vector<int> & inds, voxelcloud_t * out );
+
+void getViewState(viewstate_t* view);
+void setViewState(const viewstate_t* view);
+void recordView();
+void benchStep();
+
+void buildWorldBuffer();
+void fillWorldBuffer(int last);
+void drawWindow();
+void getWindowRange(int* first, int* last);
+void shiftWindow(int delta);
+void resizeWindow(int delta);
+
+void write_point_chunk(outbuf_t* f, double* point1, double* point2, int NCUT, uint8_t* color);
 
 typedef struct {
     double r,g,b;
@@ -83,7 +79,18 @@ COLOUR GetColour(double v,double vmin,double vmax);
 
 int dump_ply(const char* filename, const char* points_file, const char* reconstruction_file);
 int dump_icp(const char* filename);
+int dump_occupancy(const char* filename);
+int bench_kdtree(const char* filename);
+int refine_poses(const char* filename, int numimages, double score);
+int optimize_poses(const char* filename, int numimages, double score);
+int write_reconstruction(const char* filename, int numimages, double score);
 int dump_ply_camera(const char* filename, const char* points_file, const char* reconstruction_file);
+int dump_las(const char* filename);
+int dump_tiles(const char* filename);
+void filter_clouds();
+void remove_outliers();
+void free_outliers();
+const char* index_file(const char* tool, std::string& path);
 
 /*******************************************************************************
  *         Name:  mouseMoved
@@ -110,6 +117,7 @@ void mouseMoved( int x, int y ) {
   }
   g_mx = x;
   g_my = y;
+  recordView();
   
 }
 
@@ -138,6 +146,7 @@ void mousePress( int button, int state, int x, int y ) {
       glutPostRedisplay();
       break;
     }
+    recordView();
   }
   
 }
@@ -149,14 +158,26 @@ void mousePress( int button, int state, int x, int y ) {
  ******************************************************************************/
 void drawScene() {
 
+  /* The glyph atlas is rendered into the back buffer, thus before clearing. */
+  hudInit();
+  perfBeginFrame();
+
   glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
   
   glEnableClientState( GL_VERTEX_ARRAY );
   /* Set point size */
   glPointSize( g_pointsize );
+
+  /* A time-window or the voxel display replace the per-cloud enabled flags */
+  int percloud = g_window_mode == WINDOW_MODE_OFF && !g_voxel_display;
+  if ( g_voxel_display ) {
+    drawVoxels();
+  } else if ( g_window_mode != WINDOW_MODE_OFF ) {
+    drawWindow();
+  }
     
   int i;
-  for ( i = 0; i < (int)g_cloudcount; i++ ) {
+  for ( i = 0; percloud && i < (int)g_cloudcount; i++ ) {
     if ( g_clouds[i].enabled ) {
       glLoadIdentity();
       
@@ -236,23 +257,487 @@ void drawScene() {
       
       /* Draw point cloud */
       glDrawArrays( GL_POINTS, 0, g_clouds[i].pointcount );
+      perfCountPoints( g_clouds[i].pointcount );
+      perfCountClouds( 1, 0 );
       
       /* Disable colorArray. */
       if ( g_clouds[i].colors ) {
         glDisableClientState( GL_COLOR_ARRAY );
       }
+    } else {
+      perfCountClouds( 0, 1 );
     }
   }
   
   /* Reset ClientState */
   glDisableClientState( GL_VERTEX_ARRAY );  
 
+  perfEndFrame();
+  if ( g_perf_overlay ) {
+    drawOverlay();
+  }
+
   glFlush();
   glutSwapBuffers();
   
 }
 
 
+/*******************************************************************************
+ *         Name:  drawOverlay
+ *  Description:  Show frame statistics in the top left corner of the window.
+ ******************************************************************************/
+void drawOverlay() {
+
+  perfstats_t st;
+  if ( perfGetStats( &st ) ) {
+    /* Text color is the opposite of the background color. */
+    float rgb[3];
+    glGetFloatv( GL_COLOR_CLEAR_VALUE, rgb );
+    float c = *rgb < 0.5 ? 1.0f : 0.0f;
+
+    char buf[128];
+    int y = 4;
+    hudClear();
+    if ( st.gpu_ms >= 0 ) {
+      sprintf( buf, "GPU     %9.2f ms", st.gpu_ms );
+    } else {
+      sprintf( buf, "GPU           n/a" );
+    }
+    hudPrint( 8, y, c, c, c, buf ); y += HUD_GLYPH_H;
+    sprintf( buf, "CPU     %9.2f ms  (%.1f fps)", st.cpu_ms, st.fps );
+    hudPrint( 8, y, c, c, c, buf ); y += HUD_GLYPH_H;
+    sprintf( buf, "points  %12ld", st.points );
+    hudPrint( 8, y, c, c, c, buf ); y += HUD_GLYPH_H;
+    sprintf( buf, "clouds  %12d drawn, %d skipped", st.clouds_drawn,
+             st.clouds_skipped );
+    hudPrint( 8, y, c, c, c, buf ); y += HUD_GLYPH_H;
+    sprintf( buf, "upload  %9.2f MB/s", st.upload_mbs );
+    hudPrint( 8, y, c, c, c, buf );
+    hudUpload();
+  }
+  hudDraw( g_winwidth, g_winheight );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  buildWorldBuffer
+ *  Description:  Allocate one vertex and one color buffer large enough for
+ *                all posed clouds in world coordinates, in scan order.
+ ******************************************************************************/
+void buildWorldBuffer() {
+
+  g_world_offsets = (GLint *) malloc( ( g_cloudcount + 1 ) * sizeof( GLint ) );
+  if ( !g_world_offsets ) {
+    fprintf( stderr, "Could not allocate memory for world buffer!\n" );
+    exit( EXIT_FAILURE );
+  }
+
+  /* Clouds without pose get an empty range. */
+  int i;
+  GLint total = 0;
+  for ( i = 0; i < (int)g_cloudcount; i++ ) {
+    g_world_offsets[i] = total;
+    if ( g_clouds[i].mat ) {
+      total += g_clouds[i].pointcount;
+    }
+  }
+  g_world_offsets[g_cloudcount] = total;
+  g_world_filled = 0;
+
+  glGenBuffers( 2, g_world_vbo );
+  glBindBuffer( GL_ARRAY_BUFFER, g_world_vbo[0] );
+  glBufferData( GL_ARRAY_BUFFER, (GLsizeiptr) total * 3 * sizeof( float ),
+                NULL, GL_STATIC_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, g_world_vbo[1] );
+  glBufferData( GL_ARRAY_BUFFER, (GLsizeiptr) total * 3 * sizeof( uint8_t ),
+                NULL, GL_STATIC_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  printf( "Allocated world buffer for %d points\n", total );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  fillWorldBuffer
+ *  Description:  Transform and append all clouds up to (including) last which
+ *                are not yet in the world buffer. Already uploaded clouds are
+ *                never touched again, thus the cost only depends on the
+ *                number of newly revealed clouds.
+ ******************************************************************************/
+void fillWorldBuffer( int last ) {
+
+  if ( last < g_world_filled ) {
+    return;
+  }
+
+  uint32_t maxcount = 0;
+  int i;
+  for ( i = g_world_filled; i <= last; i++ ) {
+    if ( g_clouds[i].mat && g_clouds[i].pointcount > maxcount ) {
+      maxcount = g_clouds[i].pointcount;
+    }
+  }
+
+  float * world = (float *) malloc( maxcount * 3 * sizeof( float ) );
+  for ( i = g_world_filled; i <= last; i++ ) {
+    if ( !g_clouds[i].mat ) {
+      continue;
+    }
+    int n = g_clouds[i].pointcount;
+    Eigen::Matrix4d T( g_clouds[i].mat );
+    Eigen::Matrix3f R = T.block<3,3>( 0, 0 ).cast<float>();
+    Eigen::Vector3f t = T.block<3,1>( 0, 3 ).cast<float>();
+    Eigen::Map<Eigen::Matrix3Xf> src( g_clouds[i].vertices, 3, n );
+    Eigen::Map<Eigen::Matrix3Xf> dst( world, 3, n );
+    dst = ( R * src ).colwise() + t;
+
+    glBindBuffer( GL_ARRAY_BUFFER, g_world_vbo[0] );
+    glBufferSubData( GL_ARRAY_BUFFER,
+                     (GLintptr) g_world_offsets[i] * 3 * sizeof( float ),
+                     (GLsizeiptr) n * 3 * sizeof( float ), world );
+    glBindBuffer( GL_ARRAY_BUFFER, g_world_vbo[1] );
+    glBufferSubData( GL_ARRAY_BUFFER,
+                     (GLintptr) g_world_offsets[i] * 3 * sizeof( uint8_t ),
+                     (GLsizeiptr) n * 3 * sizeof( uint8_t ), g_clouds[i].colors );
+    perfCountUpload( n * 3 * ( sizeof( float ) + sizeof( uint8_t ) ) );
+  }
+  free( world );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  g_world_filled = last + 1;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  getWindowRange
+ *  Description:  Get first and last scan of the current time-window.
+ ******************************************************************************/
+void getWindowRange( int * first, int * last ) {
+
+  if ( g_window_mode == WINDOW_MODE_TRAILING ) {
+    *last  = current_ply_index;
+    *first = current_ply_index - g_window_trail + 1;
+  } else if ( g_window_mode == WINDOW_MODE_ACCUM ) {
+    *last  = current_ply_index;
+    *first = 0;
+  } else {
+    *first = g_window_start;
+    *last  = g_window_end;
+  }
+  if ( *first < 0 ) {
+    *first = 0;
+  }
+  if ( *last > (int)g_cloudcount - 1 ) {
+    *last = g_cloudcount - 1;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  drawWindow
+ *  Description:  Draw all scans of the time-window relative to the current
+ *                scan. They are contiguous in the world buffer, thus this is
+ *                one draw call independent of the window size.
+ ******************************************************************************/
+void drawWindow() {
+
+  if ( !g_world_offsets ) {
+    buildWorldBuffer();
+  }
+
+  int first, last;
+  getWindowRange( &first, &last );
+  if ( first > last ) {
+    return;
+  }
+  fillWorldBuffer( last );
+
+  drawWorldBuffer( g_world_vbo, g_world_offsets[first],
+                   g_world_offsets[last+1] - g_world_offsets[first] );
+  perfCountClouds( last - first + 1, g_cloudcount - ( last - first + 1 ) );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  drawWorldBuffer
+ *  Description:  Draw count points of a world-space vertex/color buffer pair
+ *                relative to the current scan.
+ ******************************************************************************/
+void drawWorldBuffer( const GLuint * vbo, GLint first, GLsizei count ) {
+
+  glLoadIdentity();
+  glScalef( g_zoom, g_zoom, -1 );
+  glTranslatef( g_translate.x, g_translate.y, g_translate.z );
+  glRotatef( (int) g_rot.x, 1, 0, 0 );
+  glRotatef( (int) g_rot.y, 0, 1, 0 );
+  glRotatef( (int) g_rot.z, 0, 0, 1 );
+  glMultMatrixd( g_clouds[current_ply_index].invmat );
+
+  glEnableClientState( GL_COLOR_ARRAY );
+  glBindBuffer( GL_ARRAY_BUFFER, vbo[0] );
+  glVertexPointer( 3, GL_FLOAT, 0, 0 );
+  glBindBuffer( GL_ARRAY_BUFFER, vbo[1] );
+  glColorPointer( 3, GL_UNSIGNED_BYTE, 0, 0 );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  glDrawArrays( GL_POINTS, first, count );
+  perfCountPoints( count );
+
+  glDisableClientState( GL_COLOR_ARRAY );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  reduceClouds
+ *  Description:  Voxel-grid reduce the given clouds, input k of the result
+ *                is cloud inds[k]. Clouds without pose are skipped.
+ ******************************************************************************/
+int reduceClouds( const std::vector<int> & inds, voxelcloud_t * out ) {
+
+  std::vector<voxelinput_t> in( inds.size() );
+  size_t total = 0;
+  for ( size_t k = 0; k < inds.size(); k++ ) {
+    const cloud_t * c = &g_clouds[ inds[k] ];
+    in[k].vertices = c->vertices;
+    in[k].colors   = c->colors;
+    in[k].count    = c->mat ? c->pointcount : 0;
+    in[k].mat      = c->mat;
+    total += in[k].count;
+  }
+  if ( !voxelReduce( &in[0], in.size(), g_voxel_leaf, g_voxel_mode, out ) ) {
+    return 0;
+  }
+  printf( "Voxel grid %g: %zu of %zu points (%.1fx)\n", g_voxel_leaf,
+          out->count, total, out->count ? (double) total / out->count : 0.0 );
+  return 1;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  buildVoxelBuffer
+ *  Description:  Reduce all posed clouds and upload them. The voxels are
+ *                ordered by the scan they were first seen in, so time-windows
+ *                select contiguous ranges as in the world buffer.
+ ******************************************************************************/
+void buildVoxelBuffer() {
+
+  std::vector<int> inds( g_cloudcount );
+  for ( int i = 0; i < (int)g_cloudcount; i++ ) {
+    inds[i] = i;
+  }
+  voxelcloud_t vox;
+  if ( !reduceClouds( inds, &vox ) ) {
+    exit( EXIT_FAILURE );
+  }
+
+  g_voxel_offsets = (GLint *) malloc( ( g_cloudcount + 1 ) * sizeof( GLint ) );
+  for ( int i = 0; i <= (int)g_cloudcount; i++ ) {
+    g_voxel_offsets[i] = vox.offsets[i];
+  }
+
+  glGenBuffers( 2, g_voxel_vbo );
+  glBindBuffer( GL_ARRAY_BUFFER, g_voxel_vbo[0] );
+  glBufferData( GL_ARRAY_BUFFER, (GLsizeiptr) vox.count * 3 * sizeof( float ),
+                vox.vertices, GL_STATIC_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, g_voxel_vbo[1] );
+  glBufferData( GL_ARRAY_BUFFER, (GLsizeiptr) vox.count * 3 * sizeof( uint8_t ),
+                vox.colors, GL_STATIC_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  perfCountUpload( vox.count * 3 * ( sizeof( float ) + sizeof( uint8_t ) ) );
+
+  voxelFree( &vox );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  drawVoxels
+ *  Description:  Draw the reduced clouds, all of them or the time-window.
+ ******************************************************************************/
+void drawVoxels() {
+
+  if ( !g_voxel_offsets ) {
+    buildVoxelBuffer();
+  }
+
+  int first = 0;
+  int last  = g_cloudcount - 1;
+  if ( g_window_mode != WINDOW_MODE_OFF ) {
+    getWindowRange( &first, &last );
+  }
+  if ( first > last ) {
+    return;
+  }
+
+  drawWorldBuffer( g_voxel_vbo, g_voxel_offsets[first],
+                   g_voxel_offsets[last+1] - g_voxel_offsets[first] );
+  perfCountClouds( last - first + 1, g_cloudcount - ( last - first + 1 ) );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  shiftWindow
+ *  Description:  Scrub the time-window by delta scans. In trailing and
+ *                accumulation mode this moves the current scan, skipping
+ *                scans without pose.
+ ******************************************************************************/
+void shiftWindow( int delta ) {
+
+  if ( g_window_mode == WINDOW_MODE_TRAILING
+      || g_window_mode == WINDOW_MODE_ACCUM ) {
+    int step = delta < 0 ? -1 : 1;
+    int i = current_ply_index;
+    while ( delta ) {
+      i += step;
+      if ( i < 0 || i >= (int)g_cloudcount ) {
+        break;
+      }
+      if ( g_clouds[i].invmat ) {
+        current_ply_index = i;
+        delta -= step;
+      }
+    }
+  } else if ( g_window_mode == WINDOW_MODE_RANGE ) {
+    int len = g_window_end - g_window_start;
+    g_window_start += delta;
+    if ( g_window_start > (int)g_cloudcount - 1 - len ) {
+      g_window_start = g_cloudcount - 1 - len;
+    }
+    if ( g_window_start < 0 ) {
+      g_window_start = 0;
+    }
+    g_window_end = g_window_start + len;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  resizeWindow
+ *  Description:  Grow or shrink the time-window by delta scans.
+ ******************************************************************************/
+void resizeWindow( int delta ) {
+
+  if ( g_window_mode == WINDOW_MODE_TRAILING ) {
+    g_window_trail += delta;
+    if ( g_window_trail < 1 ) {
+      g_window_trail = 1;
+    }
+  } else if ( g_window_mode == WINDOW_MODE_RANGE ) {
+    g_window_end += delta;
+    if ( g_window_end > (int)g_cloudcount - 1 ) {
+      g_window_end = g_cloudcount - 1;
+    }
+    if ( g_window_end < g_window_start ) {
+      g_window_end = g_window_start;
+    }
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  getViewState
+ *  Description:  Collect everything which determines what a frame shows.
+ ******************************************************************************/
+void getViewState( viewstate_t * view ) {
+
+  memset( view, 0, sizeof( viewstate_t ) );
+  view->tx           = g_translate.x;
+  view->ty           = g_translate.y;
+  view->tz           = g_translate.z;
+  view->rx           = g_rot.x;
+  view->ry           = g_rot.y;
+  view->rz           = g_rot.z;
+  view->zoom         = g_zoom;
+  view->index        = current_ply_index;
+  view->window_mode  = g_window_mode;
+  view->window_start = g_window_start;
+  view->window_end   = g_window_end;
+  view->window_trail = g_window_trail;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  setViewState
+ *  Description:  Restore a recorded view.
+ ******************************************************************************/
+void setViewState( const viewstate_t * view ) {
+
+  g_translate.x  = view->tx;
+  g_translate.y  = view->ty;
+  g_translate.z  = view->tz;
+  g_rot.x        = view->rx;
+  g_rot.y        = view->ry;
+  g_rot.z        = view->rz;
+  g_zoom         = view->zoom;
+  g_window_mode  = view->window_mode;
+  g_window_start = view->window_start;
+  g_window_end   = view->window_end;
+  g_window_trail = view->window_trail;
+  /* Never switch to a scan without pose. */
+  if ( view->index >= 0 && view->index < (int)g_cloudcount
+       && g_clouds[ view->index ].invmat ) {
+    current_ply_index = view->index;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  recordView
+ *  Description:  Append the current view to the camera path, if recording.
+ ******************************************************************************/
+void recordView() {
+
+  viewstate_t view;
+  getViewState( &view );
+  benchRecord( &view );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  benchStep
+ *  Description:  Idle function of the benchmark mode. Replays the camera path
+ *                once to warm up (buffer uploads, driver caches) and once
+ *                timed, as fast as possible, then reports and quits.
+ ******************************************************************************/
+void benchStep() {
+
+  static int frame = 0;
+  int pass = frame / g_bench_count;
+  int step = frame % g_bench_count;
+
+  if ( pass == 2 ) {
+    printf( "bench: %s on %s\n", glGetString( GL_VERSION ),
+            glGetString( GL_RENDERER ) );
+    benchReport( stdout, g_bench_times, g_bench_count );
+    exit( EXIT_SUCCESS );
+  }
+
+  setViewState( g_bench_views + step );
+  double t = benchNow();
+  drawScene();
+  glFinish();
+  if ( pass == 1 ) {
+    g_bench_times[step] = benchNow() - t;
+  }
+  frame++;
+
+}
+
+
 /*******************************************************************************
  *         Name:  selectionKey
  *  Description:  
@@ -413,6 +898,9 @@ void keyPressed( unsigned char key, int x, int y ) {
   case 'y': g_invertroty *= -1;  break;
   case 'f': g_rot.y      += 180; break;
   case 'C': g_showcoord = !g_showcoord; break;
+  case 'I': g_perf_overlay = !g_perf_overlay;
+    perfEnable( g_perf_overlay );
+    break;
   case 'c': glGetFloatv( GL_COLOR_CLEAR_VALUE, rgb );
     /* Invert background color */
     if ( *rgb < 0.9 ) {
@@ -430,6 +918,30 @@ void keyPressed( unsigned char key, int x, int y ) {
     for ( i = 0; i < g_cloudcount; i++ ) {
       g_clouds[i].enabled = !g_clouds[i].enabled;
     }
+    break;
+    /* Time-window */
+  case 'v': g_window_mode = ( g_window_mode + 1 ) % 4; break;
+  case ',': shiftWindow(    -1 ); break;
+  case '.': shiftWindow(     1 ); break;
+  case '<': shiftWindow(  -100 ); break;
+  case '>': shiftWindow(   100 ); break;
+  case '[': resizeWindow(   -1 ); break;
+  case ']': resizeWindow(    1 ); break;
+  case '{': resizeWindow( -100 ); break;
+  case '}': resizeWindow(  100 ); break;
+    /* Voxel-grid reduced display */
+  case 'g':
+    g_voxel_display = !g_voxel_display;
+    printf( "Voxel display %s\n", g_voxel_display ? "on" : "off" );
+    break;
+  }
+  if ( g_window_mode != WINDOW_MODE_OFF && key && strchr( "v,.<>[]{}", key ) ) {
+    int first, last;
+    getWindowRange( &first, &last );
+    printf( "Time-window %s: scans %d to %d\n", 
+            g_window_mode == WINDOW_MODE_TRAILING ? "trailing" :
+            g_window_mode == WINDOW_MODE_ACCUM    ? "accumulate" : "range",
+            first, last );
   }
   /* Control point clouds */
   if ( key >= '0' && key <= '9' ) {
@@ -438,6 +950,7 @@ void keyPressed( unsigned char key, int x, int y ) {
     }
     
   }
+  recordView();
   glutPostRedisplay();  
 }
 
@@ -449,6 +962,8 @@ void keyPressed( unsigned char key, int x, int y ) {
 void resizeScene( int w, int h ) {
   fprintf(stdout,"Resize scene called w=%d d=%d\n",w,h);
   glViewport( 0, 0, w, h );
+  g_winwidth  = w;
+  g_winheight = h;
   glMatrixMode( GL_PROJECTION );
   glLoadIdentity();
         
@@ -548,6 +1063,7 @@ void cleanup() {
   }
   if ( g_clouds ) {
   }
+  perfCleanup();
   
 }
 
@@ -589,13 +1105,154 @@ uint8_t determineFileFormat( char * filename ) {
  ******************************************************************************/
 int main( int argc, char ** argv ) {
 
+  /* Strip options, the remaining arguments are positional. */
+  char* perflog_file = 0;
+  char* record_file = 0;
+  char* bench_file = 0;
+  char* camera_file = 0;
+  int argn = 1;
+  for (int a = 1; a < argc; ++a) {
+    if (!strcmp(argv[a], "--perflog") && a+1 < argc) {
+      perflog_file = argv[++a];
+    } else if (!strcmp(argv[a], "--record") && a+1 < argc) {
+      record_file = argv[++a];
+    } else if (!strcmp(argv[a], "--bench") && a+1 < argc) {
+      bench_file = argv[++a];
+    } else if (!strcmp(argv[a], "--camera") && a+1 < argc) {
+      camera_file = argv[++a];
+    } else if (!strcmp(argv[a], "--voxel") && a+1 < argc) {
+      g_voxel_leaf = atof(argv[++a]);
+      g_voxel_export = 1;
+      if (g_voxel_leaf <= 0) {
+        fprintf(stderr, "Invalid voxel size %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--voxel-first")) {
+      g_voxel_mode = VOXEL_FIRST;
+    } else if (!strcmp(argv[a], "--tiles") && a+1 < argc) {
+      g_tile_size = atof(argv[++a]);
+      if (g_tile_size <= 0) {
+        fprintf(stderr, "Invalid tile size %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--box") && a+1 < argc) {
+      if (!filterParseBox(&g_filter, argv[++a])) {
+        fprintf(stderr, "Invalid box %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--obox") && a+1 < argc) {
+      if (!filterParseOrientedBox(&g_filter, argv[++a])) {
+        fprintf(stderr, "Invalid oriented box %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--scans") && a+1 < argc) {
+      if (!filterParseScans(&g_filter, argv[++a])) {
+        fprintf(stderr, "Invalid scan range %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--stride") && a+1 < argc) {
+      g_filter.stride = atoi(argv[++a]);
+      if (g_filter.stride < 1) {
+        fprintf(stderr, "Invalid stride %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--sample") && a+1 < argc) {
+      if (!filterParseSample(&g_filter, argv[++a])) {
+        fprintf(stderr, "Invalid sample %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--outliers") && a+1 < argc) {
+      g_outlier_k = atoi(argv[++a]);
+      const char* comma = strchr(argv[a], ',');
+      if (comma)
+        g_outlier_sigma = atof(comma + 1);
+      if (g_outlier_k < 1 || g_outlier_sigma < 0) {
+        fprintf(stderr, "Invalid outlier filter %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--icp-radius") && a+1 < argc) {
+      g_icp_radius = atof(argv[++a]);
+      const char* comma = strchr(argv[a], ',');
+      if (comma)
+        g_icp_skip = atoi(comma + 1);
+      if (g_icp_radius <= 0 || g_icp_skip < 1) {
+        fprintf(stderr, "Invalid overlap radius %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--occupancy") && a+1 < argc) {
+      float v[3] = { g_occupancy.size, g_occupancy.step, g_occupancy.range };
+      int n = sscanf(argv[++a], "%f,%f,%f", v, v+1, v+2);
+      g_occupancy.size  = v[0];
+      g_occupancy.step  = v[1];
+      g_occupancy.range = v[2];
+      if (n < 1 || v[0] <= 0 || v[1] <= 0 || v[2] < 0) {
+        fprintf(stderr, "Invalid occupancy grid %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--refine") && a+1 < argc) {
+      int n = sscanf(argv[++a], "%d,%d,%f,%d", &g_icp.window, &g_icp.iterations,
+                     &g_icp.distance, &g_icp.stride);
+      if (n < 1 || g_icp.window < 1 || g_icp.iterations < 1 ||
+          g_icp.distance <= 0 || g_icp.stride < 1) {
+        fprintf(stderr, "Invalid refinement %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--loops") && a+1 < argc) {
+      char* comma = strrchr(argv[++a], ',');
+      if (comma) {
+        *comma = 0;
+        g_loops_min = atoi(comma + 1);
+      }
+      g_loops_file = *argv[a] ? argv[a] : NULL;
+      if ((!g_loops_file && !comma) || g_loops_min < 1) {
+        fprintf(stderr, "Invalid loop closures %s\n", argv[a]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[a], "--las14")) {
+      g_las_minor = 4;
+    } else if (!strcmp(argv[a], "--kdcache")) {
+      g_kdcache = "";
+    } else if (!strcmp(argv[a], "--las-gps")) {
+      g_las_gps = 1;
+    } else {
+      argv[argn++] = argv[a];
+    }
+  }
+  argc = argn;
+
   /* Check if we have enough parameters */
   if ( argc < 3 ) {
-    printf( "Usage: %s points.bin out.reconstruction MOVIEFLAG_or_PLY COLORSFLAG\n", argv[0] );
+    printf( "Usage: %s [options] points.bin out.reconstruction MOVIEFLAG_or_PLY COLORSFLAG\n", argv[0] );
     printf( "  points.bin: binary file which contains untransformed points\n");
     printf( "  out.reconstruction: The reconstruction which contains a list of transformations\n");
-    printf( "  MOVIEFLAG_or_PLY: Either \"1\" to enable movie playing or \"2\" for ICP_constraint_generator, or the location of a ply file to dump\n");
-    printf( "  COLORSFLAG: if \"1\" then use camera time colors instead of RGB colors\n");
+    printf( "  MOVIEFLAG_or_PLY: Either \"1\" to enable movie playing or \"2\" for ICP_constraint_generator, or the location of a ply file to dump (\"-\" for stdout)\n");
+    printf( "  COLORSFLAG: if \"1\" then use camera time colors instead of RGB colors,\n");
+    printf( "    \"icp\" to write the scan overlap graph, \"occupancy\" to write the voxel occupancy,\n");
+    printf( "    \"refine\" to write the reconstruction refined by ICP,\n");
+    printf( "    \"posegraph\" to write the reconstruction optimised over odometry and loop closures,\n");
+    printf( "    \"kdbench\" to time queries against the pointer and the flat kd-tree layout\n");
+    printf( "Options:\n");
+    printf( "  --perflog file.csv: write frame statistics (GPU/CPU time, points, clouds, upload) per frame\n");
+    printf( "  --record path.txt: record every view change into a camera path file\n");
+    printf( "  --bench path.txt: replay a camera path as fast as possible and report frame time percentiles\n");
+    printf( "  --voxel size: export one point per voxel of the given size (also the size of the g display)\n");
+    printf( "  --voxel-first: keep the first point of a voxel instead of the average\n");
+    printf( "  --las14: write LAS 1.4 instead of 1.2 if the output file ends with .las\n");
+    printf( "  --las-gps: store the scan index as GPS time (LAS point format 3)\n");
+    printf( "  --camera file.ply: write the camera centers to this file instead of PLY.camera.ply (\"-\" for stdout)\n");
+    printf( "  --tiles size: export XY tiles of the given size plus a JSON index instead of one file\n");
+    printf( "  --box xmin,ymin,zmin,xmax,ymax,zmax: export only points within the box\n");
+    printf( "  --obox cx,cy,cz,sx,sy,sz,yaw[,pitch,roll]: export only points within the oriented box (degrees)\n");
+    printf( "  --scans first:last: export only the scans first to last\n");
+    printf( "  --stride n: export every n-th point of a scan\n");
+    printf( "  --sample fraction[,seed]: export a random fraction of the points\n");
+    printf( "  --outliers k[,nsigma]: drop points far from their k nearest neighbours\n");
+    printf( "  --icp-radius r[,skip]: ball radius and query stride of the icp overlap graph\n");
+    printf( "  --occupancy size[,step,range]: voxel size and ray sampling of the occupancy mode\n");
+    printf( "  --refine window[,iterations,distance,stride]: neighbours and matching of the refine mode\n");
+    printf( "  --loops file[,mincount]: overlap graph of the icp mode with loop closure candidates,\n");
+    printf( "    found from the scans without a file\n");
+    printf( "  --kdcache: keep the kd-trees of the icp, refine, posegraph and outlier tools next to points.bin\n");
     exit( EXIT_SUCCESS );
   }
 
@@ -608,6 +1265,15 @@ int main( int argc, char ** argv ) {
   } 
   else if (argc==4 || argc==5) {
     ply_file = argv[3];
+    int ply_stdout = !strcmp(ply_file, "-");
+    int camera_stdout = camera_file && !strcmp(camera_file, "-");
+    if (ply_stdout && camera_stdout) {
+      fprintf(stderr, "Only one export can be written to stdout\n");
+      exit(EXIT_FAILURE);
+    }
+    // keep messages out of the exported data
+    if ((ply_stdout || camera_stdout) && !outbufRedirectStdout())
+      exit(EXIT_FAILURE);
     fprintf(stdout,"Movie diabled, writing cloud to %s\n",ply_file);
   }
 
@@ -616,10 +1282,20 @@ int main( int argc, char ** argv ) {
     std::cout<<"Enabled time color mode\n";
   } else if (argc==5 && strcmp(argv[4],"icp")==0) {
     icp_mode = 1;
+  } else if (argc==5 && strcmp(argv[4],"occupancy")==0) {
+    icp_mode = 2;
+  } else if (argc==5 && strcmp(argv[4],"refine")==0) {
+    icp_mode = 3;
+  } else if (argc==5 && strcmp(argv[4],"posegraph")==0) {
+    icp_mode = 4;
+  } else if (argc==5 && strcmp(argv[4],"kdbench")==0) {
+    icp_mode = 5;
   }
 
   char* points_file = argv[1];
   char* reconstruction_file = argv[2];
+  if (g_kdcache)
+    g_kdcache = points_file;
 
   float* allpoints;
   uint8_t* allcolors;
@@ -676,6 +1352,22 @@ int main( int argc, char ** argv ) {
     g_clouds[i].vertices = allpoints+(3*startid[i]);
   }
 
+  /* Bounds in cloud coordinates, an export filter skips clouds by them */
+  #pragma omp parallel for schedule(dynamic,16)
+  for (i = 0; i < g_cloudcount; ++i) {
+    double bmin[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+    double bmax[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+    const float* v = g_clouds[i].vertices;
+    for (uint32_t j = 0; j < g_clouds[i].pointcount; ++j, v += 3)
+      for (int q = 0; q < 3; ++q) {
+        bmin[q] = std::min(bmin[q], (double)v[q]);
+        bmax[q] = std::max(bmax[q], (double)v[q]);
+      }
+    boundingbox_t* bb = &g_clouds[i].boundingbox;
+    bb->min.x = bmin[0]; bb->min.y = bmin[1]; bb->min.z = bmin[2];
+    bb->max.x = bmax[0]; bb->max.y = bmax[1]; bb->max.z = bmax[2];
+  }
+
   
   // now open the transformations file
   FILE* f = fopen(reconstruction_file, "r");  
@@ -740,13 +1432,42 @@ int main( int argc, char ** argv ) {
     return EXIT_SUCCESS;
     
   }
+  if (ply_file != 0 && icp_mode==2) {
+    dump_occupancy(ply_file);
+    return EXIT_SUCCESS;
+  }
+  if (ply_file != 0 && icp_mode==3) {
+    refine_poses(ply_file, numimages2, score1);
+    return EXIT_SUCCESS;
+  }
+  if (ply_file != 0 && icp_mode==4) {
+    optimize_poses(ply_file, numimages2, score1);
+    return EXIT_SUCCESS;
+  }
+  if (ply_file != 0 && icp_mode==5) {
+    bench_kdtree(ply_file);
+    return EXIT_SUCCESS;
+  }
   if (ply_file != 0) {
     //here we dump the ply file
     //char* plyfile = "/Users/tomasz/Desktop/tmp.ply";
-    std::string camfile(ply_file);
-    camfile += std::string(".camera.ply");
-    dump_ply(ply_file, points_file, reconstruction_file );
-    dump_ply_camera(camfile.c_str(), points_file, reconstruction_file);
+    std::string camfile(camera_file ? camera_file : ply_file);
+    if (!camera_file)
+      camfile += std::string(".camera.ply");
+    size_t len = strlen(ply_file);
+    if (filterSet(&g_filter))
+      filter_clouds();
+    if (g_outlier_k > 0 && !g_voxel_export)
+      remove_outliers();
+    if (g_tile_size > 0)
+      dump_tiles(ply_file);
+    else if (len > 4 && !strcasecmp(ply_file + len - 4, ".las"))
+      dump_las(ply_file);
+    else
+      dump_ply(ply_file, points_file, reconstruction_file );
+    free_outliers();
+    if (camera_file || strcmp(ply_file, "-"))
+      dump_ply_camera(camfile.c_str(), points_file, reconstruction_file);
     exit(1);
   }
   
@@ -756,6 +1477,23 @@ int main( int argc, char ** argv ) {
   /* Initialize GLUT */
   glutInit( &argc, argv );
   init();
+  perfInit( perflog_file );
+
+  if (record_file != 0 && !benchStartRecording(record_file)) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (bench_file != 0) {
+    g_bench_count = benchLoadPath(bench_file, &g_bench_views);
+    if (g_bench_count <= 0) {
+      fprintf(stderr, "No view states in %s\n", bench_file);
+      exit(EXIT_FAILURE);
+    }
+    g_bench_times = (double*)malloc(g_bench_count*sizeof(double));
+    fprintf(stdout,"Replaying %d view states from %s\n", g_bench_count, bench_file);
+    glutIdleFunc(benchStep);
+    movieflag = 0;
+  }
 
   if (movieflag == 1) {
     int value = -1;
@@ -792,9 +1530,16 @@ void printHelp() {
           " *,/         Increase/Decrease movement speed\n"
           " 0...9       Toggle visibility of point clouds 0 to 9\n"
           " t           Toggle visibility of all point clouds\n"
+          " v           Cycle time-window mode (off, range, trailing, accumulate)\n"
+          " ,/.         Scrub time-window by 1 scan\n"
+          " <,>         Scrub time-window by 100 scans\n"
+          " [,]         Shrink/Grow time-window by 1 scan\n"
+          " {,}         Shrink/Grow time-window by 100 scans\n"
+          " g           Toggle voxel display\n"
           " u           Unselect all clouds\n"
           " c           Invert background color\n"
           " C           Toggle coordinate axis\n"
+          " I           Toggle performance overlay\n"
           " <return>    Enter selection mode\n"
           " m           Enter move mode\n"
           " <esc>       Quit\n"
@@ -849,234 +1594,1161 @@ void update_movie_index(int value) {
   }
   
   fprintf(stdout,"Update movie has ply index = %d\n", current_ply_index);
+  recordView();
   drawScene();
   glutTimerFunc(1,update_movie_index,value);
 }
 
-int dump_ply(const char* filename, const char* points_file, const char* reconstruction_file) {
-  
-  if (filename == 0)
-    return -1;
-  std::cout<<"Dumping ply file to " << std::string(filename)<<std::endl;
-  FILE* f = fopen(filename,"w");
-  if (!f) {
-    fprintf(stderr, "Cannot read %s\n",filename);
-    return -1;
-  } 
-  
-  int count = 0;
-  for (int i = 0; i < g_cloudcount; ++i)
-    if (g_clouds[i].enabled)
-      count+=g_clouds[i].pointcount;
-
-  std::vector<int> valid_inds;
+/*******************************************************************************
+ *         Name:  pack_ply_vertices
+ *  Description:  Transform n points of cloud i starting at first and pack
+ *                them as binary PLY vertices (12 bytes position, 3 bytes
+ *                color) into p. If c2 is set it replaces the point colors.
+ ******************************************************************************/
+static void pack_ply_vertices(int i, const affine_t* T, int first, int n,
+                              const uint8_t* c2, float* block, char* p) {
+
+  xformPoints(T, g_clouds[i].vertices + 3*first, block, n);
+  const uint8_t* col = g_clouds[i].colors + 3*first;
+  for (int j = 0; j < n; ++j, p += PLY_VERTEX_SIZE) {
+    memcpy(p, block + 3*j, 12);
+    memcpy(p + 12, c2 ? c2 : col + 3*j, 3);
+  }
+}
 
-  for (int i = 0; i < g_cloudcount; ++i)
-    if (g_clouds[i].enabled) {
-      valid_inds.push_back(i);
-    }
+/*******************************************************************************
+ *         Name:  filter_cloud
+ *  Description:  Export filter transforms of cloud i, 0 if the cloud lies
+ *                outside the box. Points of reduced clouds (world set) are
+ *                in world coordinates already.
+ ******************************************************************************/
+static int filter_cloud(int i, int world, filtercloud_t* fc) {
+
+  if (world)
+    return filterCloud(&g_filter, NULL, NULL, NULL, i, fc);
+  const boundingbox_t* bb = &g_clouds[i].boundingbox;
+  double min[3] = { bb->min.x, bb->min.y, bb->min.z };
+  double max[3] = { bb->max.x, bb->max.y, bb->max.z };
+  int hit = filterCloud(&g_filter, g_clouds[i].mat, min, max, i, fc);
+  if (g_outlier_keep)
+    fc->keep = g_outlier_keep[i];
+  return hit;
+}
 
-  
-  fprintf (f, "ply\n");
-  fprintf (f, "format binary_little_endian 1.0\n");
-  fprintf (f, "comment Made by Tomasz Malisiewicz (tomasz@csail.mit.edu)\n");
-  fprintf (f, "comment Made with ptsviewer %s %s\n", points_file, reconstruction_file);
-  fprintf (f, "comment This is the reconstrution file\n");
-  fprintf (f, "element vertex %d\n", count);
-  fprintf (f, "property float x\n");
-  fprintf (f, "property float y\n");
-  fprintf (f, "property float z\n");
-  fprintf (f, "property uchar red\n");
-  fprintf (f, "property uchar green\n");
-  fprintf (f, "property uchar blue\n");
-  fprintf (f, "end_header\n");
+/*******************************************************************************
+ *         Name:  filter_clouds
+ *  Description:  Disable the clouds the export filter rules out as a whole,
+ *                by their scan or by their bounds.
+ ******************************************************************************/
+void filter_clouds() {
+
+  int before = 0, after = 0;
+  for (int i = 0; i < g_cloudcount; ++i) {
+    if (!g_clouds[i].enabled)
+      continue;
+    before++;
+    filtercloud_t fc;
+    if (filterScan(&g_filter, i) && filter_cloud(i, 0, &fc))
+      after++;
+    else
+      g_clouds[i].enabled = 0;
+  }
+  fprintf(stdout, "Export filter keeps %d of %d scans\n", after, before);
+}
+
+/*******************************************************************************
+ *         Name:  remove_outliers
+ *  Description:  Flag the outliers among the points of all enabled clouds
+ *                in world coordinates and mask them out of the export.
+ ******************************************************************************/
+void remove_outliers() {
+
+  std::vector<size_t> offsets(g_cloudcount + 1, 0);
+  for (int i = 0; i < g_cloudcount; ++i)
+    offsets[i+1] = offsets[i] + (g_clouds[i].enabled ? g_clouds[i].pointcount : 0);
+  size_t n = offsets[g_cloudcount];
+  float* world = (float*)malloc(3*n*sizeof(float));
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < g_cloudcount; ++i) {
+    if (!g_clouds[i].enabled)
+      continue;
+    affine_t T;
+    xformAffine(g_clouds[i].mat, &T);
+    xformPoints(&T, g_clouds[i].vertices, world + 3*offsets[i], g_clouds[i].pointcount);
+  }
+
+  uint8_t* flags = (uint8_t*)malloc(n);
+  std::string index;
+  outlierFlags(world, n, g_outlier_k, g_outlier_sigma, flags,
+               index_file("outliers", index));
+  free(world);
+  g_outlier_keep = (uint8_t**)calloc(g_cloudcount, sizeof(uint8_t*));
+  for (int i = 0; i < g_cloudcount; ++i)
+    g_outlier_keep[i] = flags + offsets[i];
+  g_filter.masked = 1;
+}
+
+/*******************************************************************************
+ *         Name:  free_outliers
+ *  Description:  Release the outlier masks, which share one allocation
+ *                starting with the mask of the first cloud.
+ ******************************************************************************/
+void free_outliers() {
+
+  if (!g_outlier_keep)
+    return;
+  free(g_outlier_keep[0]);
+  free(g_outlier_keep);
+  g_outlier_keep = NULL;
+  g_filter.masked = 0;
+}
+
+/*******************************************************************************
+ *         Name:  index_file
+ *  Description:  File keeping the kd-trees of a tool next to the points file,
+ *                NULL unless --kdcache is given. path holds the name.
+ ******************************************************************************/
+const char* index_file(const char* tool, std::string& path) {
+
+  if (!g_kdcache)
+    return NULL;
+  path = std::string(g_kdcache) + "." + tool + ".kdtree";
+  return path.c_str();
+}
+
+/*******************************************************************************
+ *         Name:  count_filtered
+ *  Description:  Number of the points begin to end - 1 of cloud i passing
+ *                the export filter. block and index are scratch space for
+ *                XFORM_BLOCK points.
+ ******************************************************************************/
+static size_t count_filtered(int i, size_t begin, size_t end, float* block, uint32_t* index) {
+
+  filtercloud_t fc;
+  if (!filter_cloud(i, 0, &fc))
+    return 0;
+  if (!fc.clipped && !fc.keep && g_filter.stride <= 1 && !g_filter.sample)
+    return end - begin;
+  size_t count = 0;
+  for (size_t first = begin; first < end; first += XFORM_BLOCK)
+    count += filterPoints(&g_filter, &fc, g_clouds[i].vertices + 3*first,
+                          std::min((size_t)XFORM_BLOCK, end - first), first, block, index);
+  return count;
+}
+
+/*******************************************************************************
+ *         Name:  filter_voxels
+ *  Description:  Apply the export filter to reduced clouds, in place.
+ ******************************************************************************/
+static void filter_voxels(const std::vector<int>& inds, voxelcloud_t* vox) {
+
+  uint8_t* flags = NULL;
+  if (g_outlier_k > 0) {
+    flags = (uint8_t*)malloc(vox->count);
+    std::string index;
+    outlierFlags(vox->vertices, vox->count, g_outlier_k, g_outlier_sigma, flags,
+                 index_file("outliers", index));
+  }
+  if (!flags && !filterPerPoint(&g_filter))
+    return;
+  float* block = (float*)malloc(3*XFORM_BLOCK*sizeof(float));
+  uint32_t* index = (uint32_t*)malloc(XFORM_BLOCK*sizeof(uint32_t));
+  size_t w = 0;
+  for (size_t k = 0; k < inds.size(); ++k) {
+    filtercloud_t fc;
+    filter_cloud(inds[k], 1, &fc);
+    size_t start = vox->offsets[k], end = vox->offsets[k+1];
+    if (flags)
+      fc.keep = flags + start;
+    vox->offsets[k] = w;
+    for (size_t first = start; first < end; first += XFORM_BLOCK) {
+      size_t n = std::min((size_t)XFORM_BLOCK, end - first);
+      size_t kept = filterPoints(&g_filter, &fc, vox->vertices + 3*first, n,
+                                 first - start, block, index);
+      memcpy(vox->vertices + 3*w, block, 3*kept*sizeof(float));
+      for (size_t j = 0; j < kept; ++j)
+        memmove(vox->colors + 3*(w + j), vox->colors + 3*(first + index[j]), 3);
+      w += kept;
+    }
+  }
+  vox->offsets[inds.size()] = w;
+  printf("Export filter keeps %zu of %zu voxels\n", w, vox->count);
+  vox->count = w;
+  free(index);
+  free(block);
+  free(flags);
+}
+
+/*******************************************************************************
+ *         Name:  pack_ply_filtered
+ *  Description:  Like pack_ply_vertices for the points passing the export
+ *                filter. Returns the number of packed vertices.
+ ******************************************************************************/
+static size_t pack_ply_filtered(int i, const filtercloud_t* fc, int first, int n,
+                                const uint8_t* c2, float* block, uint32_t* index, char* p) {
+
+  size_t k = filterPoints(&g_filter, fc, g_clouds[i].vertices + 3*first, n, first,
+                          block, index);
+  const uint8_t* col = g_clouds[i].colors + 3*first;
+  for (size_t j = 0; j < k; ++j, p += PLY_VERTEX_SIZE) {
+    memcpy(p, block + 3*j, 12);
+    memcpy(p + 12, c2 ? c2 : col + 3*index[j], 3);
+  }
+  return k;
+}
+
+/*******************************************************************************
+ *         Name:  ply_header
+ *  Description:  Header of the exported reconstruction PLY files.
+ ******************************************************************************/
+static std::string ply_header(const char* points_file, const char* reconstruction_file, long count) {
+
+  std::ostringstream header;
+  header << "ply\n";
+  header << "format binary_little_endian 1.0\n";
+  header << "comment Made by Tomasz Malisiewicz (tomasz@csail.mit.edu)\n";
+  header << "comment Made with ptsviewer " << points_file << " " << reconstruction_file << "\n";
+  header << "comment This is the reconstrution file\n";
+  header << "element vertex " << count << "\n";
+  header << "property float x\n";
+  header << "property float y\n";
+  header << "property float z\n";
+  header << "property uchar red\n";
+  header << "property uchar green\n";
+  header << "property uchar blue\n";
+  header << "end_header\n";
+  return header.str();
+}
+
+/*******************************************************************************
+ *         Name:  dump_ply_voxels
+ *  Description:  Export the enabled clouds reduced to one point per voxel.
+ ******************************************************************************/
+static int dump_ply_voxels(const char* filename, const char* points_file, const char* reconstruction_file,
+                           const std::vector<int>& valid_inds) {
+
+  voxelcloud_t vox;
+  if (!reduceClouds(valid_inds, &vox))
+    return -1;
+  filter_voxels(valid_inds, &vox);
+
+  outbuf_t* out = outbufOpen(filename, OUTBUF_SIZE);
+  if (!out) {
+    voxelFree(&vox);
+    return -1;
+  }
+  std::string head = ply_header(points_file, reconstruction_file, vox.count);
+  outbufWrite(out, head.data(), head.size());
 
   for (int iii = 0; iii < valid_inds.size(); ++iii) {
-    int i = valid_inds[iii];
-    
-    //for (int i = 0; i < g_cloudcount; ++i) {
-    //if (!g_clouds[i].enabled)
-    //  continue;
-    
+    // voxels are colored by the scan they were first seen in
     COLOUR c = GetColour((double)iii,(double)0,(double)(valid_inds.size()-1));
-    uint8_t c2[] = {(c.r*255),(c.g*255),(c.b*255)};
-    //std::cout<<"color float is " << c.r <<" " << c.g <<" " <<c.b<<std::endl;
-    //std::cout<<"color is " << int(c2[0]) <<" " << int(c2[1]) << " " << int(c2[2])<<std::endl;
+    uint8_t c2[] = {(uint8_t)(c.r*255),(uint8_t)(c.g*255),(uint8_t)(c.b*255)};
+    for (size_t k = vox.offsets[iii]; k < vox.offsets[iii+1]; ++k) {
+      char* p = outbufReserve(out, PLY_VERTEX_SIZE);
+      memcpy(p, vox.vertices + 3*k, 12);
+      memcpy(p + 12, color_time_mode == 1 ? c2 : vox.colors + 3*k, 3);
+    }
+  }
+  voxelFree(&vox);
 
-    Eigen::Matrix4f T;
-    for (int q = 0; q < 16; ++q)
-      T(q) = (g_clouds[i].mat[q]);
-    for (int j = 0; j < g_clouds[i].pointcount; ++j) {
-      Eigen::Vector4f x;
-      x(3) = 1;
-      for (int q = 0; q < 3; ++q)
-        x(q) = g_clouds[i].vertices[3*j+q];
-      x = T*x;    
-      fwrite((void*)(&x),sizeof(float),3,f);
-
-      if (color_time_mode == 1) {
-        // write color based on index of scan
-        fwrite((void*)(&c2),sizeof(uint8_t),3,f);
+  if (!outbufClose(out)) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
+  return 1;
+}
+
+/*******************************************************************************
+ *         Name:  dump_ply
+ *  Description:  Export all enabled clouds in world coordinates. Every vertex
+ *                has a fixed size, so the offset of each cloud in the file is
+ *                known up front. Clouds are cut into pieces of at most
+ *                PLY_RUN_POINTS points, runs of consecutive pieces of no
+ *                more points in total are transformed by worker threads
+ *                into one buffer each and written with pwrite at their
+ *                offsets, or in order to pipes.
+ ******************************************************************************/
+int dump_ply(const char* filename, const char* points_file, const char* reconstruction_file) {
+  
+  if (filename == 0)
+    return -1;
+  std::cout<<"Dumping ply file to " << std::string(filename)<<std::endl;
+  
+  std::vector<int> valid_inds;
+
+  for (int i = 0; i < g_cloudcount; ++i)
+    if (g_clouds[i].enabled) {
+      valid_inds.push_back(i);
+    }
+
+  if (g_voxel_export)
+    return dump_ply_voxels(filename, points_file, reconstruction_file, valid_inds);
+
+  // pieces of the clouds, their points counted in a first pass if they
+  // are filtered
+  int nvalid = valid_inds.size();
+  std::vector<int> piece_cloud;
+  std::vector<size_t> piece_first;
+  for (int k = 0; k < nvalid; ++k)
+    for (size_t first = 0; first < (size_t)g_clouds[valid_inds[k]].pointcount;
+         first += PLY_RUN_POINTS) {
+      piece_cloud.push_back(k);
+      piece_first.push_back(first);
+    }
+  int npieces = piece_cloud.size();
+  piece_first.push_back(0);
+  int filtered = filterPerPoint(&g_filter);
+  std::vector<size_t> counts(npieces);
+  #pragma omp parallel if (filtered)
+  {
+    float* block = filtered ? (float*)malloc(3*XFORM_BLOCK*sizeof(float)) : NULL;
+    uint32_t* index = filtered ? (uint32_t*)malloc(XFORM_BLOCK*sizeof(uint32_t)) : NULL;
+    #pragma omp for schedule(dynamic,16)
+    for (int p = 0; p < npieces; ++p) {
+      int i = valid_inds[piece_cloud[p]];
+      size_t end = std::min(piece_first[p] + PLY_RUN_POINTS, (size_t)g_clouds[i].pointcount);
+      counts[p] = filtered ? count_filtered(i, piece_first[p], end, block, index)
+                           : end - piece_first[p];
+    }
+    free(index);
+    free(block);
+  }
+  long count = 0;
+  for (int p = 0; p < npieces; ++p)
+    count += counts[p];
+
+  std::string head = ply_header(points_file, reconstruction_file, count);
+
+  // file offset of every piece, the last entry is the file size
+  std::vector<off_t> offsets(npieces + 1);
+  offsets[0] = head.size();
+  for (int p = 0; p < npieces; ++p)
+    offsets[p+1] = offsets[p] + (off_t)PLY_VERTEX_SIZE * counts[p];
+
+  // runs of pieces of at most PLY_RUN_POINTS points before filtering, so a
+  // packed run always fits the buffer
+  std::vector<int> runs;
+  size_t run_points = 0;
+  for (int p = 0; p < npieces; ++p) {
+    int i = valid_inds[piece_cloud[p]];
+    size_t n = std::min((size_t)PLY_RUN_POINTS, g_clouds[i].pointcount - piece_first[p]);
+    if (runs.empty() || run_points + n > PLY_RUN_POINTS) {
+      runs.push_back(p);
+      run_points = 0;
+    }
+    run_points += n;
+  }
+  runs.push_back(npieces);
+
+  // pipes and stdout get the runs in order
+  int seekable = outbufSeekable(filename);
+  int fd = seekable ? outbufCreate(filename, offsets[npieces]) : outbufOpenStream(filename);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot read %s\n",filename);
+    return -1;
+  } 
+  int failed = seekable ? !outbufPwrite(fd, head.data(), head.size(), 0)
+                        : !outbufWriteAll(fd, head.data(), head.size());
+
+  #pragma omp parallel
+  {
+    float* block = (float*)malloc(3*XFORM_BLOCK*sizeof(float));
+    uint32_t* index = filtered ? (uint32_t*)malloc(XFORM_BLOCK*sizeof(uint32_t)) : NULL;
+    char* buf = (char*)malloc(PLY_VERTEX_SIZE*PLY_RUN_POINTS);
+    int ready = block && (index || !filtered) && buf;
+
+    #pragma omp for ordered schedule(dynamic,1) reduction(|:failed)
+    for (int r = 0; r < (int)runs.size() - 1; ++r) {
+      if (!ready) {
+        failed = 1;
+        continue;
+      }
+      size_t used = 0;
+      for (int p = runs[r]; p < runs[r+1]; ++p) {
+        int iii = piece_cloud[p];
+        int i = valid_inds[iii];
+        if (!counts[p])
+          continue;
+
+        // color based on index of scan instead of the real scene RGB
+        COLOUR c = GetColour((double)iii,(double)0,(double)(valid_inds.size()-1));
+        uint8_t c2[] = {(c.r*255),(c.g*255),(c.b*255)};
+
+        affine_t T;
+        xformAffine(g_clouds[i].mat, &T);
+        filtercloud_t fc;
+        if (filtered)
+          filter_cloud(i, 0, &fc);
+        int end = std::min(piece_first[p] + PLY_RUN_POINTS, (size_t)g_clouds[i].pointcount);
+        for (int first = piece_first[p]; first < end; first += XFORM_BLOCK) {
+          int n = std::min(XFORM_BLOCK, end - first);
+          if (filtered) {
+            used += PLY_VERTEX_SIZE*pack_ply_filtered(i, &fc, first, n,
+                color_time_mode == 1 ? c2 : NULL, block, index, buf + used);
+            continue;
+          }
+          pack_ply_vertices(i, &T, first, n, color_time_mode == 1 ? c2 : NULL,
+                            block, buf + used);
+          used += PLY_VERTEX_SIZE*n;
+        }
       }
-      else {
-        // write real scene RGB point
-        fwrite((void*)(&g_clouds[i].colors[3*j]),sizeof(uint8_t),3,f);
+      if (seekable) {
+        failed |= !outbufPwrite(fd, buf, used, offsets[runs[r]]);
+      } else {
+        #pragma omp ordered
+        failed |= !outbufWriteAll(fd, buf, used);
       }
+    }
+    free(buf);
+    free(index);
+    free(block);
+  }
+
+  if (close(fd) || failed) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
+  return 1;
+}
+
+/*******************************************************************************
+ *         Name:  time_colors
+ *  Description:  Colors of n points of the iii-th of nvalid exported scans
+ *                in time color mode, kept in buf.
+ ******************************************************************************/
+static const uint8_t* time_colors(int iii, int nvalid, size_t n, std::vector<uint8_t>& buf) {
+
+  COLOUR c = GetColour((double)iii,(double)0,(double)(nvalid-1));
+  buf.resize(3*n + 3);
+  for (size_t j = 0; j < n; ++j) {
+    buf[3*j]   = c.r*255;
+    buf[3*j+1] = c.g*255;
+    buf[3*j+2] = c.b*255;
+  }
+  return &buf[0];
+}
+
+/*******************************************************************************
+ *         Name:  dump_tiles
+ *  Description:  Export all enabled clouds in world coordinates, split into
+ *                square XY tiles of g_tile_size. The format of the tiles
+ *                follows the extension of filename, which is the prefix of
+ *                the tile files and of the JSON index.
+ ******************************************************************************/
+int dump_tiles(const char* filename) {
+
+  if (filename == 0)
+    return -1;
+  std::string prefix(filename);
+  int format = TILES_PLY;
+  size_t dot = prefix.rfind('.');
+  if (dot != std::string::npos && dot > prefix.rfind('/')) {
+    if (!strcasecmp(prefix.c_str() + dot, ".las"))
+      format = TILES_LAS;
+    prefix.erase(dot);
+  }
+  std::cout<<"Dumping tiles of size "<<g_tile_size<<" to "<<prefix<<"_*"<<std::endl;
 
+  std::vector<int> valid_inds;
+  for (int i = 0; i < g_cloudcount; ++i)
+    if (g_clouds[i].enabled)
+      valid_inds.push_back(i);
+  int nvalid = valid_inds.size();
+
+  voxelcloud_t vox;
+  if (g_voxel_export && !reduceClouds(valid_inds, &vox))
+    return -1;
+  if (g_voxel_export)
+    filter_voxels(valid_inds, &vox);
 
+  tileset_t* tiles = tilesOpen(prefix.c_str(), g_tile_size, format, g_las_minor, g_las_gps);
+  if (!tiles) {
+    if (g_voxel_export)
+      voxelFree(&vox);
+    return -1;
+  }
+
+  int filtered = filterPerPoint(&g_filter) && !g_voxel_export;
+  float* block = (float*)malloc(3*XFORM_BLOCK*sizeof(float));
+  uint32_t* index = filtered ? (uint32_t*)malloc(XFORM_BLOCK*sizeof(uint32_t)) : NULL;
+  std::vector<uint8_t> timecolors, keptcolors(3*XFORM_BLOCK);
+  for (int iii = 0; iii < nvalid; ++iii) {
+    int i = valid_inds[iii];
+    const float* vertices = g_clouds[i].vertices;
+    const uint8_t* colors = g_clouds[i].colors;
+    size_t n = g_clouds[i].pointcount;
+    if (g_voxel_export) {
+      vertices = vox.vertices + 3*vox.offsets[iii];
+      colors   = vox.colors + 3*vox.offsets[iii];
+      n        = vox.offsets[iii+1] - vox.offsets[iii];
+    }
+    if (color_time_mode == 1)
+      colors = time_colors(iii, nvalid, n, timecolors);
+
+    affine_t T;
+    xformAffine(g_clouds[i].mat, &T);
+    filtercloud_t fc;
+    if (filtered)
+      filter_cloud(i, 0, &fc);
+    for (size_t first = 0; first < n; first += XFORM_BLOCK) {
+      size_t m = std::min((size_t)XFORM_BLOCK, n - first);
+      const float* p = vertices + 3*first;
+      const uint8_t* c = colors ? colors + 3*first : NULL;
+      if (filtered) {
+        m = filterPoints(&g_filter, &fc, p, m, first, block, index);
+        for (size_t j = 0; c && j < m; ++j)
+          memcpy(&keptcolors[3*j], c + 3*index[j], 3);
+        p = block;
+        c = c ? &keptcolors[0] : NULL;
+      } else if (!g_voxel_export) {
+        xformPoints(&T, p, block, m);
+        p = block;
+      }
+      tilesAdd(tiles, p, c, m, i, i);
     }
   }
-  fclose(f);
+  free(index);
+  free(block);
+  if (g_voxel_export)
+    voxelFree(&vox);
+
+  if (!tilesClose(tiles)) {
+    fprintf(stderr, "Error writing tiles %s\n", prefix.c_str());
+    return -1;
+  }
+  return 1;
+}
+
+/*******************************************************************************
+ *         Name:  dump_las
+ *  Description:  Export all enabled clouds in world coordinates as LAS. The
+ *                bounds for scale and offset need a first pass over the
+ *                transformed points. Point source ID (and GPS time) of a
+ *                point is the index of its scan.
+ ******************************************************************************/
+int dump_las(const char* filename) {
+
+  if (filename == 0)
+    return -1;
+  std::cout<<"Dumping las file to " << std::string(filename)<<std::endl;
+
+  std::vector<int> valid_inds;
+  for (int i = 0; i < g_cloudcount; ++i)
+    if (g_clouds[i].enabled)
+      valid_inds.push_back(i);
+  int nvalid = valid_inds.size();
+
+  voxelcloud_t vox;
+  if (g_voxel_export && !reduceClouds(valid_inds, &vox))
+    return -1;
+  if (g_voxel_export)
+    filter_voxels(valid_inds, &vox);
+
+  int filtered = filterPerPoint(&g_filter) && !g_voxel_export;
+  uint64_t count = 0;
+  float bmin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float bmax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  if (g_voxel_export) {
+    affine_t identity = {{ 1,0,0, 0,1,0, 0,0,1, 0,0,0 }};
+    float* block = (float*)malloc(3*XFORM_BLOCK*sizeof(float));
+    xformBounds(&identity, vox.vertices, vox.count, block, bmin, bmax);
+    free(block);
+    count = vox.count;
+  } else {
+    #pragma omp parallel
+    {
+      float tmin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+      float tmax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+      float* block = (float*)malloc(3*XFORM_BLOCK*sizeof(float));
+      uint32_t* index = filtered ? (uint32_t*)malloc(XFORM_BLOCK*sizeof(uint32_t)) : NULL;
+      #pragma omp for schedule(dynamic,16) reduction(+:count)
+      for (int iii = 0; iii < nvalid; ++iii) {
+        const cloud_t* c = &g_clouds[valid_inds[iii]];
+        if (!filtered) {
+          affine_t T;
+          xformAffine(c->mat, &T);
+          xformBounds(&T, c->vertices, c->pointcount, block, tmin, tmax);
+          count += c->pointcount;
+          continue;
+        }
+        filtercloud_t fc;
+        filter_cloud(valid_inds[iii], 0, &fc);
+        for (size_t first = 0; first < c->pointcount; first += XFORM_BLOCK) {
+          size_t m = filterPoints(&g_filter, &fc, c->vertices + 3*first,
+              std::min((size_t)XFORM_BLOCK, c->pointcount - first), first, block, index);
+          for (size_t j = 0; j < m; ++j)
+            for (int q = 0; q < 3; ++q) {
+              tmin[q] = std::min(tmin[q], block[3*j+q]);
+              tmax[q] = std::max(tmax[q], block[3*j+q]);
+            }
+          count += m;
+        }
+      }
+      free(index);
+      free(block);
+      #pragma omp critical
+      for (int q = 0; q < 3; ++q) {
+        bmin[q] = std::min(bmin[q], tmin[q]);
+        bmax[q] = std::max(bmax[q], tmax[q]);
+      }
+    }
+  }
+  double dmin[3], dmax[3];
+  for (int q = 0; q < 3; ++q) {
+    dmin[q] = count ? bmin[q] : 0;
+    dmax[q] = count ? bmax[q] : 0;
+  }
+
+  laswriter_t* las = lasOpen(filename, g_las_minor, g_las_gps, count, dmin, dmax);
+  if (!las) {
+    if (g_voxel_export)
+      voxelFree(&vox);
+    return -1;
+  }
+
+  float* block = filtered ? (float*)malloc(3*XFORM_BLOCK*sizeof(float)) : NULL;
+  uint32_t* index = filtered ? (uint32_t*)malloc(XFORM_BLOCK*sizeof(uint32_t)) : NULL;
+  std::vector<uint8_t> timecolors, keptcolors(3*XFORM_BLOCK);
+  for (int iii = 0; iii < nvalid; ++iii) {
+    int i = valid_inds[iii];
+    const float* vertices = g_clouds[i].vertices;
+    const uint8_t* colors = g_clouds[i].colors;
+    size_t n = g_clouds[i].pointcount;
+    affine_t T;
+    xformAffine(g_clouds[i].mat, &T);
+    if (g_voxel_export) {
+      vertices = vox.vertices + 3*vox.offsets[iii];
+      colors   = vox.colors + 3*vox.offsets[iii];
+      n        = vox.offsets[iii+1] - vox.offsets[iii];
+    }
+    if (color_time_mode == 1)
+      colors = time_colors(iii, nvalid, n, timecolors);
+    if (!filtered) {
+      lasWritePoints(las, g_voxel_export ? NULL : &T, vertices, colors, n, i, i);
+      continue;
+    }
+    filtercloud_t fc;
+    filter_cloud(i, 0, &fc);
+    for (size_t first = 0; first < n; first += XFORM_BLOCK) {
+      size_t m = filterPoints(&g_filter, &fc, vertices + 3*first,
+          std::min((size_t)XFORM_BLOCK, n - first), first, block, index);
+      for (size_t j = 0; colors && j < m; ++j)
+        memcpy(&keptcolors[3*j], colors + 3*(first + index[j]), 3);
+      lasWritePoints(las, NULL, block, colors ? &keptcolors[0] : NULL, m, i, i);
+    }
+  }
+  free(index);
+  free(block);
+  if (g_voxel_export)
+    voxelFree(&vox);
+
+  if (!lasClose(las)) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
   return 1;
 }
 
+/*******************************************************************************
+ *         Name:  dump_icp
+ *  Description:  Write the scan overlap graph as lines "i j count": count
+ *                sampled points of scan i have a point of scan j within
+ *                g_icp_radius.
+ ******************************************************************************/
 int dump_icp(const char* filename) {
 
-  // //typedef KDTreeEigenMatrixAdaptor< Eigen::Matrix<num_t,Dynamic,Dynamic> >  my_kd_tree_t;
+  if (filename == 0)
+    return -1;
+  std::cout<<"Dumping icp file to " << std::string(filename)<<std::endl;
+  outbuf_t* f = outbufOpen(filename, OUTBUF_SIZE);
+  if (!f)
+    return -1;
 
-  // treeType tree;
+  std::vector<size_t> first(g_cloudcount + 1, 0);
+  for (int i = 0; i < g_cloudcount; ++i)
+    first[i+1] = first[i] + (g_clouds[i].enabled ? g_clouds[i].pointcount : 0);
+  float* world = (float*)malloc(3*first[g_cloudcount]*sizeof(float));
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < g_cloudcount; ++i) {
+    if (!g_clouds[i].enabled)
+      continue;
+    affine_t T;
+    xformAffine(g_clouds[i].mat, &T);
+    xformPoints(&T, g_clouds[i].vertices, world + 3*first[i], g_clouds[i].pointcount);
+  }
 
-  // const int kdtree_build_skip = 1;
-  // const int kdtree_build_offset = 0;
+  std::cout<<"Ball radius "<<g_icp_radius<<", every "<<g_icp_skip
+           <<"th point of "<<first[g_cloudcount]<<" points"<<std::endl;
+  overlap_t* pairs;
+  std::string index;
+  size_t n = overlapPairs(world, &first[0], g_cloudcount, g_icp_radius, g_icp_skip, &pairs,
+                          index_file("overlap", index));
+  free(world);
+  for (size_t k = 0; k < n; ++k)
+    outbufPrintf(f, "%u %u %llu\n", pairs[k].i, pairs[k].j,
+                 (unsigned long long)pairs[k].count);
+  free(pairs);
+  std::cout<<"Found "<<n<<" overlapping scan pairs"<<std::endl;
+  if (!outbufClose(f)) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
+  return 1;
+}
 
-  // if (filename == 0)
-  //   return -1;
-  // std::cout<<"Dumping icp file to " << std::string(filename)<<std::endl;
-  // std::cout<<"Building kdtree"<<std::endl;
-  // FILE* f = fopen(filename,"w");
-  // if (!f) {
-  //   fprintf(stderr, "Cannot read %s\n",filename);
-  //   return -1;
-  // } 
-  
-  // int count = 0;
-  // for (int i = 0; i < g_cloudcount; ++i)
-  //   if (g_clouds[i].enabled)
-  //     count+=g_clouds[i].pointcount;
-
-  // std::vector<int> valid_inds;
-
-  // for (int i = 0; i < g_cloudcount; ++i)
-  //   if (g_clouds[i].enabled) {
-  //     valid_inds.push_back(i);
-  //   }
-
-
-  // const double CUBE_SIZE = .01;
-  // std::map<std::tuple<int,int,int>,int> occupied_counts;
-  // std::map<std::tuple<int,int,int>,int> sum_counts;
-  // std::map<std::tuple<int,int,int>,std::map<int,bool> > occupied_ids;
-
-  // for (int iii = 0; iii < valid_inds.size(); ++iii) {
-  //   int i = valid_inds[iii];
-  //   std::cout<<","<<std::flush;
-  //   Eigen::Matrix4f T;
-  //   for (int q = 0; q < 16; ++q)
-  //     T(q) = (g_clouds[i].mat[q]);
-
-
-  //   Eigen::Matrix<float,4,Eigen::Dynamic> allx(4,g_clouds[i].pointcount);
-  //   for (int j = kdtree_build_offset; j < g_clouds[i].pointcount; j++) {
-  //     for (int q = 0; q < 3; ++q)
-  //       allx(q,j) = g_clouds[i].vertices[3*j+q];
-  //     allx(3,j) = 1;
-  //   }
-  //   allx = T*allx;
-
-  //   for (int j = kdtree_build_offset; j < g_clouds[i].pointcount; j+=kdtree_build_skip) {
-  //     //Eigen::Vector4f x;
-  //     //x(3) = 1;
-  //     //for (int q = 0; q < 3; ++q)
-  //     //  x(q) = g_clouds[i].vertices[3*j+q];
-  //     //x = T*x;    
-  //     int a = round(allx(0,j)/CUBE_SIZE);
-  //     int b = round(allx(1,j)/CUBE_SIZE);
-  //     int c = round(allx(2,j)/CUBE_SIZE);
-  //     occupied_counts[std::tuple<int,int,int>(a,b,c)]++;
-  //     sum_counts[std::tuple<int,int,int>(a,b,c)]++;
-  //     occupied_ids[std::tuple<int,int,int>(a,b,c)][i] = true;
-
-  //     // generate points from current measurement to camera center as free space
-  //     Eigen::Vector3f center;
-  //     Eigen::Vector3f x;
-  //     for (int q = 0; q < 3; ++q) {
-  //       center(q) = T(q, 3);
-  //       x(q) = allx(q, j);
-  //     }
-
-  //     Eigen::Vector3f n = center - x;
-  //     n.normalize();
-  //     const double PAD = .03;
-  //     x = x - PAD*n;
-
-  //     for (double alpha = 0; alpha<=1; alpha+=.1) {
-  //       Eigen::Vector3f x2 = x-n*alpha;
-  //       sum_counts[std::tuple<int,int,int>(round(x2(0)/CUBE_SIZE),round(x2(1)/CUBE_SIZE),round(x2(2)/CUBE_SIZE))]++;
-  //     }
-     
-  //     kdtreeNode node;
-  //     node.xyz[0] = allx(0,j);//x(0);
-  //     node.xyz[1] = allx(1,j);//x(1);
-  //     node.xyz[2] = allx(2,j);//x(2);
-  //     node.index = i;
-  //     //tree.insert(node);
-  //   }
-  // }
-  
-  // std::map<std::tuple<int,int,int>,double> occupied_prob;
+/*******************************************************************************
+ *         Name:  bench_queries
+ *  Description:  Best time of three runs of a query for every point of q
+ *                against a tree, in milliseconds: k nearest neighbours for
+ *                k > 0, all points within radius for 0, their count for -1
+ *                and the first of them for -2. checksum receives the sum of
+ *                the found indices and their count, or the sum of the
+ *                counts.
+ ******************************************************************************/
+template <class TREE>
+static double bench_queries(const TREE& tree, const float* q, size_t n, int k,
+                            float radius, uint64_t* checksum) {
+  const long chunks = (n + 4095) / 4096;
+  std::vector<uint64_t> sums(chunks);
+  double best = 0;
+  for (int run = 0; run < 3; ++run) {
+    double start = benchNow();
+    #pragma omp parallel
+    {
+      std::vector<uint32_t> idx(k > 0 ? k : 1);
+      std::vector<float> dist(k > 0 ? k : 1);
+      std::vector<std::pair<uint32_t,float> > hits;
+      #pragma omp for schedule(dynamic, 1)
+      for (long c = 0; c < chunks; ++c) {
+        uint64_t s = 0;
+        size_t end = std::min(n, (size_t)(c + 1) * 4096);
+        for (size_t i = c * 4096; i < end; ++i) {
+          if (k > 0) {
+            nanoflann::KNNResultSet<float, uint32_t> result(k);
+            result.init(&idx[0], &dist[0]);
+            tree.findNeighbors(result, q + 3*i, nanoflann::SearchParams());
+            for (size_t j = 0; j < result.size(); ++j)
+              s += idx[j] + 1;
+          } else if (k == 0) {
+            nanoflann::RadiusResultSet<float, uint32_t> result(radius, hits);
+            tree.findNeighbors(result, q + 3*i, nanoflann::SearchParams());
+            for (size_t j = 0; j < hits.size(); ++j)
+              s += hits[j].first + 1;
+          } else if (k == -1) {
+            nanoflann::RadiusCountResultSet<float, uint32_t> result(radius);
+            tree.findNeighbors(result, q + 3*i, nanoflann::SearchParams());
+            s += result.size();
+          } else {
+            nanoflann::RadiusFirstResultSet<float, uint32_t> result(radius);
+            tree.findNeighbors(result, q + 3*i, nanoflann::SearchParams());
+            if (result.found)
+              s += result.index + 1;
+          }
+        }
+        sums[c] = s;
+      }
+    }
+    double ms = benchNow() - start;
+    best = run ? std::min(best, ms) : ms;
+  }
+  *checksum = 0;
+  for (long c = 0; c < chunks; ++c)
+    *checksum += sums[c];
+  return best;
+}
 
-  // FILE* fid = fopen("/Users/tomasz/Desktop/vols.txt","w");
+/* The flat tree and the growing index take no search parameters */
+struct kdflat_bench_t {
+  const kdflat_t& flat;
+  template <class RESULT>
+  void findNeighbors(RESULT& result, const float* q, const nanoflann::SearchParams&) const {
+    flat.findNeighbors(result, q);
+  }
+};
 
-  // for (std::map<std::tuple<int,int,int>,int>::const_iterator i = occupied_counts.begin(); i!=occupied_counts.end(); ++i) {
+struct kdlog_bench_t {
+  const kdlog_t& log;
+  template <class RESULT>
+  void findNeighbors(RESULT& result, const float* q, const nanoflann::SearchParams&) const {
+    log.findNeighbors(result, q);
+  }
+};
 
-  //   double pocc = (double)i->second / double(sum_counts[i->first]+.000001);
-  //   occupied_prob[i->first] = pocc;
-    
-  //   fprintf(fid,"%f %f %f %f\n",
-  //           CUBE_SIZE*std::get<0>(i->first),
-  //           CUBE_SIZE*std::get<1>(i->first),
-  //           CUBE_SIZE*std::get<2>(i->first),
-  //           pocc);
-    
-  // }
+/*******************************************************************************
+ *         Name:  bench_kdtree
+ *  Description:  Time kNN, radius, count and first-hit queries of every
+ *                g_icp_skip-th point of the enabled clouds in world
+ *                coordinates against the pointer layout of their kd-tree,
+ *                its flat copy and a growing index the clouds are appended
+ *                to one by one, and write the timings.
+ ******************************************************************************/
+int bench_kdtree(const char* filename) {
 
-  // fclose(fid);
-  
-  // std::cout<<"GOT HERE"<<std::flush<<std::endl;
-  // std::cout<<"volume size is " <<occupied_counts.size()<<std::endl;
-  // std::cout<<"ids size is " <<occupied_ids.size()<<std::endl;
-  // std::cout<<"sum counts size is " <<sum_counts.size()<<std::endl;
-  // std::cout<<"Optimizing KDtree"<<std::endl;
-
-  // exit(1);
-  // tree.optimize();
-  // const int skip = 100;
-
-  // // const double limit_close = .02;
-  // // std::cout<<"BALL RADIUS CLOSE = "<<limit_close<<std::endl;
-  // // std::map<std::pair<int,int>,int> hits_close;
-  // // for (int i = 0; i < valid_inds.size(); ++i) {
-  // //   int target = valid_inds[i];
-  // //   get_nn_indices(tree, limit_close, target, skip, hits_close);
-  // //   std::cout<<"."<<std::flush;
-  // // }
-
-  // const double limit_far = .1;
-  // std::cout<<"BALL RADIUS FAR = "<<limit_far<<std::endl;
-  // std::map<std::pair<int,int>,int> hits_far;
-  // for (int i = 0; i < valid_inds.size(); ++i) {
-  //   int target = valid_inds[i];
-  //   get_nn_indices(tree, limit_far, target, skip, hits_far);
-  //   std::cout<<"."<<std::flush;
-  // }
-  
-  // for (std::map<std::pair<int,int>,int>::const_iterator i = hits_far.begin(); i!=hits_far.end(); i++) {
-  //   //int val_close = hits_close[i->first];    
-  //   fprintf(f,"%d %d %d\n",i->first.first,i->first.second,i->second);//,val_close);
-  //   //std::cout<< i->first.first << " " << i->first.second << " " << i->second<<std::endl;
-  // }
+  if (filename == 0)
+    return -1;
+  std::vector<size_t> first(g_cloudcount + 1, 0);
+  for (int i = 0; i < g_cloudcount; ++i)
+    first[i+1] = first[i] + (g_clouds[i].enabled ? g_clouds[i].pointcount : 0);
+  size_t n = first[g_cloudcount];
+  if (!n)
+    return -1;
+  float* world = (float*)malloc(3*n*sizeof(float));
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < g_cloudcount; ++i) {
+    if (!g_clouds[i].enabled)
+      continue;
+    affine_t T;
+    xformAffine(g_clouds[i].mat, &T);
+    xformPoints(&T, g_clouds[i].vertices, world + 3*first[i], g_clouds[i].pointcount);
+  }
+  size_t nq = (n + g_icp_skip - 1) / g_icp_skip;
+  float* q = (float*)malloc(3*nq*sizeof(float));
+  for (size_t i = 0; i < nq; ++i)
+    memcpy(q + 3*i, world + 3*i*g_icp_skip, 3*sizeof(float));
+
+  kdpoints_t points = { world, n };
+  kdtree_t tree(3, points, nanoflann::KDTreeSingleIndexAdaptorParams(KDTREE_LEAF));
+  double start = benchNow();
+  tree.buildIndex();
+  double build = benchNow() - start;
+  kdflat_t flat;
+  start = benchNow();
+  if (!kdflatBuild(&flat, &tree)) {
+    free(q);
+    free(world);
+    return -1;
+  }
+  double copy = benchNow() - start;
+  kdflat_bench_t fb = { flat };
+
+  // the same points appended cloud by cloud to a growing index, their
+  // stream positions are their positions in world
+  kdlog_t log;
+  if (!kdlogInit(&log)) {
+    kdflatFree(&flat);
+    free(q);
+    free(world);
+    return -1;
+  }
+  start = benchNow();
+  for (int i = 0; i < g_cloudcount; ++i)
+    if (first[i+1] > first[i] &&
+        !kdlogAppend(&log, world + 3*first[i], first[i+1] - first[i])) {
+      fprintf(stderr, "Could not append cloud %d to the growing index!\n", i);
+      kdlogFree(&log);
+      kdflatFree(&flat);
+      free(q);
+      free(world);
+      return -1;
+    }
+  double grow = benchNow() - start;
+  kdlog_bench_t lb = { log };
 
-  // fclose(f);
+  std::cout<<"Writing kd-tree benchmark to " << std::string(filename)<<std::endl;
+  outbuf_t* f = outbufOpen(filename, OUTBUF_SIZE);
+  if (!f) {
+    kdlogFree(&log);
+    kdflatFree(&flat);
+    free(q);
+    free(world);
+    return -1;
+  }
+  outbufPrintf(f, "# %zu points, %zu queries, build %.1f ms, flat copy %.1f ms, "
+               "appended per cloud %.1f ms\n", n, nq, build, copy, grow);
+  outbufPrintf(f, "# layout query ms checksum\n");
+  const int k = g_outlier_k > 0 ? g_outlier_k : 8;
+  for (int r = 0; r < 4; ++r) {
+    uint64_t sp, sf, sl;
+    int kk = r ? 1 - r : k;
+    double tp = bench_queries(tree, q, nq, kk, g_icp_radius*g_icp_radius, &sp);
+    double tf = bench_queries(fb, q, nq, kk, g_icp_radius*g_icp_radius, &sf);
+    double tl = bench_queries(lb, q, nq, kk, g_icp_radius*g_icp_radius, &sl);
+    char name[32];
+    if (kk > 0)
+      snprintf(name, sizeof(name), "knn%d", kk);
+    else
+      snprintf(name, sizeof(name), "%s%g", kk == 0 ? "radius" : kk == -1 ? "count" : "first",
+               g_icp_radius);
+    outbufPrintf(f, "pointer %s %.2f %llu\n", name, tp, (unsigned long long)sp);
+    outbufPrintf(f, "flat %s %.2f %llu\n", name, tf, (unsigned long long)sf);
+    outbufPrintf(f, "appended %s %.2f %llu\n", name, tl, (unsigned long long)sl);
+    // the appended index breaks kNN ties and finds a first hit in the order
+    // of its trees
+    bool same = sp == sf && (kk > 0 || kk == -2 || sp == sl);
+    printf("%s: pointer %.2f ms, flat %.2f ms, appended %.2f ms%s\n", name, tp, tf, tl,
+           same ? "" : " (results differ)");
+  }
+  kdlogFree(&log);
+  kdflatFree(&flat);
+  free(q);
+  free(world);
+  if (!outbufClose(f)) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
+  return 1;
+}
+
+/*******************************************************************************
+ *         Name:  dump_occupancy
+ *  Description:  Write the occupancy probability of the voxels hit by the
+ *                enabled clouds, as text for .txt files and as a binary
+ *                grid otherwise.
+ ******************************************************************************/
+int dump_occupancy(const char* filename) {
+
+  if (filename == 0)
+    return -1;
+  std::cout<<"Dumping occupancy to " << std::string(filename)<<std::endl;
+  std::vector<voxelinput_t> in(g_cloudcount);
+  for (int i = 0; i < g_cloudcount; ++i) {
+    in[i].vertices = g_clouds[i].vertices;
+    in[i].colors   = NULL;
+    in[i].count    = g_clouds[i].enabled ? g_clouds[i].pointcount : 0;
+    in[i].mat      = g_clouds[i].mat;
+  }
+  occgrid_t grid;
+  if (!occupancyBuild(&in[0], g_cloudcount, &g_occupancy, &grid))
+    return -1;
+  printf("Occupancy grid %g: %zu occupied voxels, %zu free\n", grid.size,
+         grid.count, grid.carved);
+  size_t len = strlen(filename);
+  int ok = len > 4 && !strcasecmp(filename + len - 4, ".txt")
+    ? occupancyWriteText(filename, &grid) : occupancyWriteGrid(filename, &grid);
+  occupancyFree(&grid);
+  if (!ok) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
+  return 1;
+}
+
+/*******************************************************************************
+ *         Name:  refine_poses
+ *  Description:  Refine the poses of the enabled clouds by ICP against their
+ *                neighbours and write them as a reconstruction file.
+ ******************************************************************************/
+int refine_poses(const char* filename, int numimages, double score) {
+
+  if (filename == 0)
+    return -1;
+  std::vector<icpscan_t> scans(g_cloudcount);
+  for (int i = 0; i < g_cloudcount; ++i) {
+    scans[i].vertices = g_clouds[i].vertices;
+    scans[i].count    = g_clouds[i].enabled ? g_clouds[i].pointcount : 0;
+    scans[i].mat      = g_clouds[i].mat;
+  }
+  std::string index;
+  icpRefine(&scans[0], g_cloudcount, &g_icp, index_file("icp", index));
+  return write_reconstruction(filename, numimages, score);
+}
+
+/*******************************************************************************
+ *         Name:  find_loops
+ *  Description:  Loop closure candidates among the posed clouds: the pairs
+ *                of clouds which are not consecutive, whose world boxes come
+ *                within g_icp_radius of each other and which have at least
+ *                g_loops_min points within g_icp_radius of each other, by a
+ *                dual-tree walk of their kd-trees. The boxes are paired by
+ *                a sweep along the axis of their largest spread.
+ ******************************************************************************/
+static void find_loops(const icpmodel_t* model, const std::vector<double*>& poses,
+                       std::vector<std::pair<int,int> >& loops) {
+  std::vector<kdframe_t> frames;
+  for (int i = 0; i < g_cloudcount; ++i) {
+    kdframe_t f;
+    if (poses[i] && forestFrame(&model->forest, i, g_clouds[i].mat, g_clouds[i].invmat, &f))
+      frames.push_back(f);
+  }
+  int axis = 0;
+  float spread = -1;
+  for (int q = 0; q < 3 && !frames.empty(); ++q) {
+    float lo = frames[0].min[q], hi = frames[0].max[q];
+    for (size_t a = 1; a < frames.size(); ++a) {
+      lo = std::min(lo, frames[a].min[q]);
+      hi = std::max(hi, frames[a].max[q]);
+    }
+    if (hi - lo > spread) {
+      spread = hi - lo;
+      axis = q;
+    }
+  }
+  std::vector<std::pair<float,int> > sweep(frames.size());
+  for (size_t a = 0; a < frames.size(); ++a)
+    sweep[a] = std::make_pair(frames[a].min[axis], (int)a);
+  std::sort(sweep.begin(), sweep.end());
+
+  // a box can only meet the boxes starting before its end along the axis
+  std::vector<std::pair<int,int> > pairs;
+  #pragma omp parallel
+  {
+    std::vector<std::pair<int,int> > own;
+    #pragma omp for schedule(dynamic, 64)
+    for (long s = 0; s < (long)sweep.size(); ++s) {
+      const kdframe_t& a = frames[sweep[s].second];
+      float end = a.max[axis] + g_icp_radius;
+      for (size_t t = s + 1; t < sweep.size() && sweep[t].first <= end; ++t) {
+        kdframe_t f = frames[sweep[t].second];
+        if (abs(f.scan - a.scan) >= 2 && forestSelect(&f, 1, a.min, a.max, g_icp_radius))
+          own.push_back(std::make_pair(std::min(a.scan, f.scan), std::max(a.scan, f.scan)));
+      }
+    }
+    #pragma omp critical
+    pairs.insert(pairs.end(), own.begin(), own.end());
+  }
+  // in the order of the pairwise search, for the same pose graph
+  std::sort(pairs.begin(), pairs.end());
+  std::vector<char> overlap(pairs.size(), 0);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (long k = 0; k < (long)pairs.size(); ++k) {
+    int i = pairs[k].first, j = pairs[k].second;
+    double rel[16];
+    Eigen::Map<Eigen::Matrix4d> R(rel);
+    R = Eigen::Map<Eigen::Matrix4d>(g_clouds[i].invmat) *
+        Eigen::Map<Eigen::Matrix4d>(g_clouds[j].mat);
+    overlap[k] = kdtreeOverlap(model->forest.trees[i], model->forest.trees[j], rel,
+                               g_icp_radius, g_loops_min) >= (size_t)g_loops_min;
+  }
+  for (size_t k = 0; k < pairs.size(); ++k)
+    if (overlap[k])
+      loops.push_back(pairs[k]);
+  std::cout<<loops.size()<<" of "<<pairs.size()<<" pairs with overlapping boxes overlap"
+           <<std::endl;
+}
+
+/*******************************************************************************
+ *         Name:  optimize_poses
+ *  Description:  Optimise the poses of the enabled clouds over a pose graph
+ *                of odometry edges between consecutive clouds and loop
+ *                closures between the overlapping clouds of g_loops_file,
+ *                or found by find_loops without it, measured by ICP, and
+ *                write them as a reconstruction file.
+ ******************************************************************************/
+int optimize_poses(const char* filename, int numimages, double score) {
+
+  if (filename == 0)
+    return -1;
+  std::vector<pgedge_t> edges;
+  std::vector<double*> poses(g_cloudcount, (double*)0);
+  int last = -1;
+  for (int i = 0; i < g_cloudcount; ++i) {
+    if (!g_clouds[i].enabled || !g_clouds[i].mat)
+      continue;
+    poses[i] = g_clouds[i].mat;
+    if (last >= 0) {
+      pgedge_t e;
+      e.i = last;
+      e.j = i;
+      e.weight = 1;
+      Eigen::Map<Eigen::Matrix4d>(e.z) =
+        Eigen::Map<Eigen::Matrix4d>(g_clouds[last].invmat) *
+        Eigen::Map<Eigen::Matrix4d>(g_clouds[i].mat);
+      edges.push_back(e);
+    }
+    last = i;
+  }
+  size_t odometry = edges.size();
+
+  // loop closure candidates: overlapping pairs which are not consecutive
+  std::vector<std::pair<int,int> > loops;
+  if (g_loops_file) {
+    FILE* lf = fopen(g_loops_file, "r");
+    if (!lf) {
+      fprintf(stderr, "Cannot read %s\n", g_loops_file);
+      return -1;
+    }
+    unsigned int i, j;
+    unsigned long long count;
+    while (fscanf(lf, "%u %u %llu", &i, &j, &count) == 3) {
+      if (i > j)
+        std::swap(i, j);
+      if (j >= (unsigned int)g_cloudcount || j - i < 2 ||
+          count < (unsigned long long)g_loops_min || !poses[i] || !poses[j])
+        continue;
+      loops.push_back(std::make_pair((int)i, (int)j));
+    }
+    fclose(lf);
+    std::sort(loops.begin(), loops.end());
+    loops.erase(std::unique(loops.begin(), loops.end()), loops.end());
+  }
+
+  // align the later scan of a candidate against the earlier one, accept it
+  // if it ends up well within the matching distance
+  std::vector<icpscan_t> scans(g_cloudcount);
+  for (int i = 0; i < g_cloudcount; ++i) {
+    scans[i].vertices = g_clouds[i].vertices;
+    scans[i].count    = poses[i] ? g_clouds[i].pointcount : 0;
+    scans[i].mat      = g_clouds[i].mat;
+  }
+  icpmodel_t model;
+  std::string index;
+  bool search = !g_loops_file && last > 0;
+  if ((search || !loops.empty()) &&
+      !icpModelBuild(&model, &scans[0], g_cloudcount, &g_icp, index_file("icp", index)))
+    return -1;
+  if (search)
+    find_loops(&model, poses, loops);
+  std::vector<pgedge_t> closures(loops.size());
+  std::vector<char> accepted(loops.size(), 0);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (long k = 0; k < (long)loops.size(); ++k) {
+    int i = loops[k].first, j = loops[k].second;
+    double mat[16], rms[2];
+    memcpy(mat, g_clouds[j].mat, sizeof(mat));
+    if (!icpPair(&model, &scans[0], j, i, &g_icp, mat, rms) ||
+        rms[1] > 0.5 * g_icp.distance)
+      continue;
+    pgedge_t* e = &closures[k];
+    e->i = i;
+    e->j = j;
+    e->weight = 1;
+    Eigen::Map<Eigen::Matrix4d>(e->z) =
+      Eigen::Map<Eigen::Matrix4d>(g_clouds[i].invmat) *
+      Eigen::Map<Eigen::Matrix4d>(mat);
+    accepted[k] = 1;
+  }
+  for (size_t k = 0; k < loops.size(); ++k)
+    if (accepted[k])
+      edges.push_back(closures[k]);
+  if (search || !loops.empty())
+    icpModelFree(&model);
+  std::cout<<odometry<<" odometry edges, "<<edges.size() - odometry<<" of "
+           <<loops.size()<<" loop closures accepted"<<std::endl;
+
+  if (!pgOptimize(&poses[0], g_cloudcount, edges.empty() ? 0 : &edges[0],
+                  edges.size(), &g_posegraph))
+    return -1;
+  return write_reconstruction(filename, numimages, score);
+}
+
+/*******************************************************************************
+ *         Name:  write_reconstruction
+ *  Description:  Write the poses of the clouds as a reconstruction file and
+ *                update their inverses.
+ ******************************************************************************/
+int write_reconstruction(const char* filename, int numimages, double score) {
+
+  std::cout<<"Writing reconstruction to " << std::string(filename)<<std::endl;
+  outbuf_t* f = outbufOpen(filename, OUTBUF_SIZE);
+  if (!f)
+    return -1;
+  outbufWrite(f, &numimages, sizeof(int));
+  outbufWrite(f, &score, sizeof(double));
+  for (int i = 0; i < g_cloudcount; ++i) {
+    if (!g_clouds[i].mat)
+      continue;
+    // matlab indices
+    int index = i + 1;
+    outbufWrite(f, &index, sizeof(int));
+    outbufWrite(f, g_clouds[i].mat, 16*sizeof(double));
+    Eigen::Map<Eigen::Matrix4d>(g_clouds[i].invmat) =
+      Eigen::Map<Eigen::Matrix4d>(g_clouds[i].mat).inverse();
+  }
+  if (!outbufClose(f)) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
   return 1;
 }
 
@@ -1084,7 +2756,7 @@ int dump_ply_camera(const char* filename, const char* points_file, const char* r
   if (filename == 0)
     return -1;
   std::cout<<"Dumping ply file to " << std::string(filename)<<std::endl;
-  FILE* f = fopen(filename,"w");
+  outbuf_t* f = outbufOpen(filename, OUTBUF_SIZE);
   if (!f) {
     fprintf(stderr, "Cannot read %s\n",filename);
     return -1;
@@ -1105,19 +2777,19 @@ int dump_ply_camera(const char* filename, const char* points_file, const char* r
 
   int size = valid_inds.size() + (valid_inds.size()-1)*NCUT + valid_inds.size()*NCUT_visible;
 
-  fprintf (f, "ply\n");
-  fprintf (f, "format binary_little_endian 1.0\n");
-  fprintf (f, "comment Made by Tomasz Malisiewicz (tomasz@csail.mit.edu)\n");
-  fprintf (f, "comment Made with ptsviewer %s %s\n", points_file, reconstruction_file);
-  fprintf (f, "comment This is the camera centers file\n");
-  fprintf (f, "element vertex %d\n", size);
-  fprintf (f, "property float x\n");
-  fprintf (f, "property float y\n");
-  fprintf (f, "property float z\n");
-  fprintf (f, "property uchar red\n");
-  fprintf (f, "property uchar green\n");
-  fprintf (f, "property uchar blue\n");
-  fprintf (f, "end_header\n");
+  outbufPrintf(f, "ply\n");
+  outbufPrintf(f, "format binary_little_endian 1.0\n");
+  outbufPrintf(f, "comment Made by Tomasz Malisiewicz (tomasz@csail.mit.edu)\n");
+  outbufPrintf(f, "comment Made with ptsviewer %s %s\n", points_file, reconstruction_file);
+  outbufPrintf(f, "comment This is the camera centers file\n");
+  outbufPrintf(f, "element vertex %d\n", size);
+  outbufPrintf(f, "property float x\n");
+  outbufPrintf(f, "property float y\n");
+  outbufPrintf(f, "property float z\n");
+  outbufPrintf(f, "property uchar red\n");
+  outbufPrintf(f, "property uchar green\n");
+  outbufPrintf(f, "property uchar blue\n");
+  outbufPrintf(f, "end_header\n");
 
   for (int iii = 0; iii < valid_inds.size(); ++iii) {
     int i = valid_inds[iii];
@@ -1127,11 +2799,11 @@ int dump_ply_camera(const char* filename, const char* points_file, const char* r
       T(q) = (g_clouds[i].mat[q]);
     
     for (int j = 0; j < 3; ++j) {
-      fwrite((void*)(&T(j,3)),sizeof(float),1,f);
+      outbufWrite(f, &T(j,3), sizeof(float));
     }
     COLOUR res = GetColour(iii,0,valid_inds.size()-1);
     uint8_t cols[3] = {res.r*255,res.g*255,res.b*255};
-    fwrite((void*)(&cols),sizeof(uint8_t),3,f);
+    outbufWrite(f, cols, 3);
   }
 
   for (int iii = 0; iii < valid_inds.size()-1; ++iii) {
@@ -1176,7 +2848,10 @@ int dump_ply_camera(const char* filename, const char* points_file, const char* r
 
   }
 
-  fclose(f);
+  if (!outbufClose(f)) {
+    fprintf(stderr, "Error writing %s\n", filename);
+    return -1;
+  }
   return 1;
 }
 
@@ -1208,7 +2883,7 @@ COLOUR GetColour(double v,double vmin,double vmax)
    return(c);
 }
 
-void write_point_chunk(FILE* f, double* point1, double* point2, int NCUT, uint8_t* cols) {
+void write_point_chunk(outbuf_t* f, double* point1, double* point2, int NCUT, uint8_t* cols) {
 
   float diff0 = (point2[0]-point1[0]) / (NCUT+1);
   float diff1 = (point2[1]-point1[1]) / (NCUT+1);
@@ -1218,11 +2893,11 @@ void write_point_chunk(FILE* f, double* point1, double* point2, int NCUT, uint8_
     float x0 = point1[0]+diff0*i;
     float x1 = point1[1]+diff1*i;
     float x2 = point1[2]+diff2*i;
-    fwrite((void*)&x0,sizeof(float),1,f);
-    fwrite((void*)&x1,sizeof(float),1,f);
-    fwrite((void*)&x2,sizeof(float),1,f);
+    outbufWrite(f, &x0, sizeof(float));
+    outbufWrite(f, &x1, sizeof(float));
+    outbufWrite(f, &x2, sizeof(float));
 
-    fwrite((void*)(cols),sizeof(uint8_t),3,f);
+    outbufWrite(f, cols, 3);
   }
 
 }
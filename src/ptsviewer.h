@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
@@ -26,6 +27,12 @@
 
 #include <float.h>
 #include <Eigen/Dense>
+#include "bench.h"
+#include "voxel.h"
+#include "filter.h"
+#include "occupancy.h"
+#include "icp.h"
+#include "posegraph.h"
 //#include "Eigen/PlainObjectBase.h"
 
 // when enabled, dumps out colors indicating scan time, and not raw RGB values
@@ -36,6 +43,12 @@ static int color_time_mode = 0;
 #define FILE_FORMAT_PLY  2
 #define FILE_FORMAT_TXT  3
 
+/* Exported PLY vertex: float x, y, z and uchar red, green, blue */
+#define PLY_VERTEX_SIZE 15
+
+/* Points of a PLY export run, a multiple of XFORM_BLOCK within OUTBUF_SIZE */
+#define PLY_RUN_POINTS ( 8 * XFORM_BLOCK )
+
 /* Functions */
 
 void mouseMoved( int x, int y );
@@ -98,9 +111,88 @@ int       g_showcoord       =                  0;
 char      g_selection[1024] =                 "";
 float     g_movespeed       =                  1;
 int       g_left            =                -75;
+int       g_winwidth        =                640;
+int       g_winheight       =                480;
+int       g_hud_dirty       =                  1;
+int       g_perf_overlay    =                  0;
+
+/* Camera-path replay */
+viewstate_t * g_bench_views = NULL;
+double *      g_bench_times = NULL;
+int           g_bench_count =    0;
 
 int current_ply_index = -1;
 
+/* World-space vertex/color buffers holding all posed clouds in scan order.
+ * g_world_offsets[i] is the first vertex of cloud i, clouds without a pose
+ * occupy an empty range. Clouds are uploaded on demand, only the first
+ * g_world_filled clouds are valid. */
+GLuint    g_world_vbo[2]    =             { 0, 0 };
+GLint *   g_world_offsets   =               NULL;
+int       g_world_filled    =                  0;
+
+/* Voxel-grid reduction. Exports are reduced if g_voxel_export is set. The
+ * voxel display buffers hold all posed clouds reduced, ordered by the scan
+ * each voxel was first seen in, g_voxel_offsets works like
+ * g_world_offsets. */
+float     g_voxel_leaf      =              0.01f;
+int       g_voxel_mode      =      VOXEL_AVERAGE;
+int       g_voxel_export    =                  0;
+int       g_voxel_display   =                  0;
+GLuint    g_voxel_vbo[2]    =             { 0, 0 };
+GLint *   g_voxel_offsets   =               NULL;
+
+/* LAS export: version 1.2 or 1.4, point format 3 with GPS time or 2 */
+int       g_las_minor       =                  2;
+int       g_las_gps         =                  0;
+
+/* Tiled export if > 0: size of the square XY tiles */
+float     g_tile_size       =                  0;
+
+/* Export filter: box, scan range and subsample */
+filter_t  g_filter;
+
+/* Statistical outlier removal if g_outlier_k > 0: k neighbours and the
+ * deviation limit. g_outlier_keep holds the flags of each cloud. */
+int       g_outlier_k       =                  0;
+float     g_outlier_sigma   =               1.0f;
+uint8_t **g_outlier_keep    =               NULL;
+
+/* Overlap graph of the icp mode: ball radius and query stride */
+float     g_icp_radius      =               0.1f;
+int       g_icp_skip        =                100;
+
+/* Occupancy mode: voxel size, free space from 3 cm in front of a point,
+ * sampled every 10 cm over 1 m towards the camera */
+occparams_t g_occupancy     = { 0.01f, 0.03f, 0.1f, 1.0f };
+
+/* Refine mode: two neighbours on either side, 20 iterations, matches up to
+ * 10 cm from every 4th point, normals from 8 neighbours */
+icpparams_t g_icp           = { 2, 20, 0.1f, 4, 8 };
+
+/* Posegraph mode: overlap graph of the loop closure candidates, NULL to
+ * find them from the scans, the overlap count a candidate needs, and 2 cm /
+ * 0.01 rad edges optimised for up to 20 iterations, relinearised after 1e-3
+ * of motion */
+const char *g_loops_file    =               NULL;
+int       g_loops_min       =                100;
+pgparams_t g_posegraph      = { 0.02, 0.01, 20, 1e-3 };
+
+/* Built kd-trees are kept next to the points file if set, by --kdcache */
+const char *g_kdcache       =               NULL;
+
+/* Define time-window modes */
+
+#define WINDOW_MODE_OFF      0
+#define WINDOW_MODE_RANGE    1
+#define WINDOW_MODE_TRAILING 2
+#define WINDOW_MODE_ACCUM    3
+
+int g_window_mode  = WINDOW_MODE_OFF;
+int g_window_start =   0;
+int g_window_end   =  99;
+int g_window_trail = 100;
+
 boundingbox_t g_bb = { 
   { DBL_MAX, DBL_MAX, DBL_MAX }, 
   { DBL_MIN, DBL_MIN, DBL_MIN } };
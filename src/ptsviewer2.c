@@ -16,6 +16,7 @@
  ******************************************************************************/
 
 #include "ptsviewer.h"
+#include "hudtext.h"
 //#include "lodepng.h"
 
 
@@ -368,12 +369,77 @@ void mousePress( int button, int state, int x, int y ) {
 }
 
 
+/*******************************************************************************
+ *         Name:  buildHud
+ *  Description:  Collect the status of all clouds, folded into ranges of
+ *                clouds with equal state, and the current mode into one HUD
+ *                text batch.
+ ******************************************************************************/
+void buildHud() {
+
+	hudClear();
+
+	char buf[1100];
+	int x = HUD_GLYPH_W;
+	int y = 4;
+	int lines = 1;
+	int i = 0;
+	while ( i < g_cloudcount ) {
+		int j = i;
+		while ( j + 1 < g_cloudcount
+				&& !g_clouds[j+1].enabled  == !g_clouds[i].enabled
+				&& !g_clouds[j+1].selected == !g_clouds[i].selected ) {
+			j++;
+		}
+		if ( j > i ) {
+			sprintf( buf, "%d-%d ", i, j );
+		} else {
+			sprintf( buf, "%d ", i );
+		}
+		if ( x + (int) strlen( buf ) * HUD_GLYPH_W > g_winwidth ) {
+			/* Do not cover the whole scene with pathological patterns. */
+			if ( lines == 4 ) {
+				hudPrint( x, y, 0.6, 0.6, 0.6, "..." );
+				break;
+			}
+			x = HUD_GLYPH_W;
+			y += HUD_GLYPH_H;
+			lines++;
+		}
+		if ( g_clouds[i].selected ) {
+			x = hudPrint( x, y, g_clouds[i].enabled ? 1.0 : 0.6, 0.0, 0.0, buf );
+		} else if ( g_clouds[i].enabled ) {
+			x = hudPrint( x, y, 1.0, 1.0, 1.0, buf );
+		} else {
+			x = hudPrint( x, y, 0.6, 0.6, 0.6, buf );
+		}
+		i = j + 1;
+	}
+
+	/* Print selection or mode sign at the bottom of the window. */
+	y = g_winheight - HUD_GLYPH_H - 4;
+	if ( g_mode == VIEWER_MODE_SELECT ) {
+		sprintf( buf, "SELECT: %s", g_selection );
+		hudPrint( HUD_GLYPH_W, y, 1.0, 1.0, 1.0, buf );
+	} else if ( g_mode == VIEWER_MODE_MOVESEL ) {
+		hudPrint( HUD_GLYPH_W, y, 1.0, 1.0, 1.0,
+				"MOVE (Press 'm' to leave this mode)" );
+	}
+
+	hudUpload();
+
+}
+
+
 /*******************************************************************************
  *         Name:  drawScene
  *  Description:  Display point cloud.
  ******************************************************************************/
 void drawScene() {
 
+	/* The atlas is rendered into the back buffer, thus before clearing it. */
+	hudInit();
+
   //glColor4f(1.0, 1.0, 1.0, 1.0);
 	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
@@ -479,59 +545,12 @@ void drawScene() {
 
 
 
-	/* Print status of clouds at the top of the window. */
-	glLoadIdentity();
-	//glTranslatef( 0, 0, -100 );
-
-	char buf[64];
-	int xpos = g_left;
-	for ( i = 0; i < g_cloudcount; i++ ) {
-		if ( g_clouds[i].selected ) {
-			glColor3f( g_clouds[i].enabled ? 1.0 : 0.6, 0.0, 0.0 );
-		} else {
-			if ( g_clouds[i].enabled ) {
-				glColor3f( 1.0, 1.0, 1.0 );
-			} else {
-				glColor3f( 0.6, 0.6, 0.6 );
-			}
-		}
-		glRasterPos2i( xpos, 54 );
-		sprintf( buf, "%d", i );
-		int j;
-		for ( j = 0; j < strlen( buf ); j++ ) {
-			glutBitmapCharacter( GLUT_BITMAP_8_BY_13, buf[j] );
-			xpos += 2;
-		}
-		xpos += 2;
-	}
-
-	/* Print selection at the bottom of the window. */
-	if ( g_mode == VIEWER_MODE_SELECT ) {
-		glLoadIdentity();
-		glTranslatef( 0, 0, -100 );
-		glColor4f( 1.0, 1.0, 1.0, 0.0 );
-		glRasterPos2i( g_left, -54 );
-		strcpy( buf, "SELECT: " );
-		for ( i = 0; i < strlen( buf ); i++ ) {
-			glutBitmapCharacter( GLUT_BITMAP_8_BY_13, buf[i] );
-		}
-		for ( i = 0; i < strlen( g_selection ); i++ ) {
-			glutBitmapCharacter( GLUT_BITMAP_8_BY_13, g_selection[i] );
-		}
-	
-	}
-
-	/* Print mode sign at the bottom of the window. */
-	if ( g_mode == VIEWER_MODE_MOVESEL ) {
-		glLoadIdentity();
-		glTranslatef( 0, 0, -100 );
-		glColor4f( 1.0, 1.0, 1.0, 0.0 );
-		glRasterPos2i( g_left, -54 );
-		strcpy( buf, "MOVE (Press 'm' to leave this mode)" );
-		for ( i = 0; i < strlen( buf ); i++ ) {
-			glutBitmapCharacter( GLUT_BITMAP_8_BY_13, buf[i] );
-		}
+	/* Print status of clouds and mode. Rebuilt only after state changes. */
+	if ( g_hud_dirty ) {
+		buildHud();
+		g_hud_dirty = 0;
 	}
+	hudDraw( g_winwidth, g_winheight );
 
 	/* Draw coordinate axis */
 	if ( g_showcoord ) {
@@ -730,6 +749,9 @@ void moveKeyPressed( unsigned char key ) {
  ******************************************************************************/
 void keyPressed( unsigned char key, int x, int y ) {
 
+	/* Selection, visibility and mode only change on key events. */
+	g_hud_dirty = 1;
+
 	if ( g_mode == VIEWER_MODE_SELECT ) {
 		selectionKey( key );
 		return;
@@ -819,6 +841,9 @@ void keyPressed( unsigned char key, int x, int y ) {
 void resizeScene( int w, int h ) {
   fprintf(stdout,"Resize scene called w=%d d=%d\n",w,h);
 	glViewport( 0, 0, w, h );
+	g_winwidth  = w;
+	g_winheight = h;
+	g_hud_dirty = 1;
 	glMatrixMode( GL_PROJECTION );
 	glLoadIdentity();
 
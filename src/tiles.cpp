@@ -0,0 +1,452 @@
+/*******************************************************************************
+ *
+ *       Filename:  tiles.cpp
+ *
+ *    Description:  Tiled export.
+ *
+ *                  Points are binned in a single pass. Tiles are found by
+ *                  their indices in an open-addressing hash. An open tile
+ *                  has its file and a buffer of TILES_BUFFER bytes which is
+ *                  appended to the file when full. At most TILES_MAX_OPEN
+ *                  tiles are open; when another tile needs to be opened,
+ *                  the least recently used one is flushed and closed and
+ *                  hands over its buffer, so memory and file handles stay
+ *                  bounded however many tiles there are. The point count of
+ *                  a tile is only known in the end, so every file starts
+ *                  with a header of fixed size which is rewritten when the
+ *                  export is closed.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tiles.h"
+
+#define TILES_PLY_HEADER 512
+#define TILES_PLY_RECORD  15
+
+
+static const char * tilesSuffix( const tileset_t * set ) {
+
+  return set->format == TILES_LAS ? "las" : "ply";
+
+}
+
+
+static void tilesFilename( const tileset_t * set, const tile_t * t,
+    char * name, size_t size ) {
+
+  snprintf( name, size, "%s_%d_%d.%s", set->prefix, t->tx, t->ty,
+      tilesSuffix( set ) );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  tilesHeader
+ *  Description:  Build the current header of a tile. PLY headers are padded
+ *                with a comment to TILES_PLY_HEADER bytes.
+ ******************************************************************************/
+static void tilesHeader( const tileset_t * set, tile_t * t, char * header ) {
+
+  if ( set->format == TILES_LAS ) {
+    double min[3], max[3];
+    int q;
+    for ( q = 0; q < 3; q++ ) {
+      min[q] = t->count ? t->min[q] : 0;
+      max[q] = t->count ? t->max[q] : 0;
+    }
+    lasSetCount( &t->las, t->count, min, max );
+    memcpy( header, &t->las, set->header );
+    return;
+  }
+
+  int n = snprintf( header, TILES_PLY_HEADER,
+      "ply\n"
+      "format binary_little_endian 1.0\n"
+      "comment Made with ptsviewer\n"
+      "comment tile %d %d of size %g\n"
+      "element vertex %llu\n"
+      "property float x\n"
+      "property float y\n"
+      "property float z\n"
+      "property uchar red\n"
+      "property uchar green\n"
+      "property uchar blue\n"
+      "comment ", t->tx, t->ty, set->size, (unsigned long long) t->count );
+  const char * end = "\nend_header\n";
+  memset( header + n, ' ', TILES_PLY_HEADER - n - strlen( end ) );
+  memcpy( header + TILES_PLY_HEADER - strlen( end ), end, strlen( end ) );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  tilesFlush
+ *  Description:  Append the buffer of an open tile to its file.
+ ******************************************************************************/
+static void tilesFlush( tileset_t * set, tile_t * t ) {
+
+  set->error |= !outbufPwrite( t->fd, t->buf, t->used, t->end );
+  t->end += t->used;
+  t->used = 0;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  tilesActivate
+ *  Description:  Open the file of a tile and give it a buffer, taken from
+ *                the least recently used open tile if TILES_MAX_OPEN tiles
+ *                are open. The file is created with a preliminary header
+ *                when the tile is first opened. Returns 0 on error.
+ ******************************************************************************/
+static int tilesActivate( tileset_t * set, tile_t * t ) {
+
+  char * buf = NULL;
+  int slot = set->open;
+  if ( set->open == TILES_MAX_OPEN ) {
+    int i;
+    slot = 0;
+    for ( i = 1; i < set->open; i++ ) {
+      if ( set->tiles[ set->active[i] ].used_at
+          < set->tiles[ set->active[slot] ].used_at ) {
+        slot = i;
+      }
+    }
+    tile_t * lru = set->tiles + set->active[slot];
+    tilesFlush( set, lru );
+    set->error |= close( lru->fd ) != 0;
+    buf = lru->buf;
+    lru->fd  = -1;
+    lru->buf = NULL;
+    set->open--;
+  } else {
+    buf = (char *) malloc( TILES_BUFFER );
+    if ( !buf ) {
+      fprintf( stderr, "error: Out of memory for tile buffers.\n" );
+      set->error = 1;
+      return 0;
+    }
+  }
+
+  char name[4096];
+  tilesFilename( set, t, name, sizeof( name ) );
+  t->fd = open( name, O_WRONLY | ( t->end ? 0 : O_CREAT | O_TRUNC ), 0644 );
+  if ( t->fd < 0 ) {
+    fprintf( stderr, "error: Could not open »%s«: %s\n", name,
+        strerror( errno ) );
+    set->error = 1;
+    free( buf );
+    if ( slot < set->open ) {
+      set->active[slot] = set->active[ set->open ];
+    }
+    return 0;
+  }
+  if ( !t->end ) {
+    char header[ TILES_PLY_HEADER > sizeof( lasheader_t )
+      ? TILES_PLY_HEADER : sizeof( lasheader_t ) ];
+    tilesHeader( set, t, header );
+    set->error |= !outbufPwrite( t->fd, header, set->header, 0 );
+    t->end = set->header;
+  }
+  t->buf  = buf;
+  t->used = 0;
+  set->active[slot] = t - set->tiles;
+  set->open++;
+  return 1;
+
+}
+
+
+tileset_t * tilesOpen( const char * prefix, float size, int format,
+    int las_minor, int gps ) {
+
+  if ( size <= 0 ) {
+    fprintf( stderr, "error: Invalid tile size %f.\n", size );
+    return NULL;
+  }
+  if ( format == TILES_LAS && las_minor != 2 && las_minor != 4 ) {
+    fprintf( stderr, "error: LAS version 1.%d is not supported.\n", las_minor );
+    return NULL;
+  }
+  tileset_t * set = (tileset_t *) calloc( 1, sizeof( tileset_t ) );
+  if ( set ) {
+    set->prefix = strdup( prefix );
+    set->mask   = 255;
+    set->slots  = (int *) calloc( set->mask + 1, sizeof( int ) );
+  }
+  if ( !set || !set->prefix || !set->slots ) {
+    fprintf( stderr, "error: Out of memory for the tiles.\n" );
+    if ( set ) {
+      free( set->prefix );
+      free( set->slots );
+    }
+    free( set );
+    return NULL;
+  }
+  set->format    = format;
+  set->las_minor = las_minor;
+  set->gps       = gps;
+  set->size      = size;
+  set->last      = -1;
+  if ( format == TILES_LAS ) {
+    lasheader_t h;
+    double zero[3] = { 0, 0, 0 };
+    lasInitHeader( &h, las_minor, gps, 0, zero, zero );
+    set->record = h.point_record_length;
+    set->header = h.header_size;
+  } else {
+    set->record = TILES_PLY_RECORD;
+    set->header = TILES_PLY_HEADER;
+  }
+  return set;
+
+}
+
+
+static inline size_t tilesHash( int tx, int ty ) {
+
+  uint64_t key = (uint64_t) (uint32_t) tx << 32 | (uint32_t) ty;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  tilesFind
+ *  Description:  Get the tile with the given indices, adding it if needed.
+ *                Points come in scan order, so the previous tile is checked
+ *                before the hash. Returns -1 on error.
+ ******************************************************************************/
+static int tilesFind( tileset_t * set, int tx, int ty ) {
+
+  if ( set->last >= 0 && set->tiles[ set->last ].tx == tx
+      && set->tiles[ set->last ].ty == ty ) {
+    return set->last;
+  }
+  size_t s = tilesHash( tx, ty ) & set->mask;
+  while ( set->slots[s] ) {
+    const tile_t * t = set->tiles + set->slots[s] - 1;
+    if ( t->tx == tx && t->ty == ty ) {
+      return set->last = set->slots[s] - 1;
+    }
+    s = ( s + 1 ) & set->mask;
+  }
+
+  if ( set->count == set->capacity ) {
+    int capacity = set->capacity ? 2 * set->capacity : 64;
+    tile_t * tiles = (tile_t *) realloc( set->tiles, capacity * sizeof( tile_t ) );
+    if ( !tiles ) {
+      fprintf( stderr, "error: Out of memory for the tiles.\n" );
+      set->error = 1;
+      return -1;
+    }
+    set->tiles    = tiles;
+    set->capacity = capacity;
+  }
+
+  /* Keep the hash at most half full */
+  if ( 2 * (size_t) ( set->count + 1 ) > set->mask + 1 ) {
+    size_t mask = 2 * set->mask + 1;
+    int * slots = (int *) calloc( mask + 1, sizeof( int ) );
+    if ( !slots ) {
+      fprintf( stderr, "error: Out of memory for the tiles.\n" );
+      set->error = 1;
+      return -1;
+    }
+    int i;
+    for ( i = 0; i < set->count; i++ ) {
+      size_t r = tilesHash( set->tiles[i].tx, set->tiles[i].ty ) & mask;
+      while ( slots[r] ) {
+        r = ( r + 1 ) & mask;
+      }
+      slots[r] = i + 1;
+    }
+    free( set->slots );
+    set->slots = slots;
+    set->mask  = mask;
+    s = tilesHash( tx, ty ) & mask;
+    while ( slots[s] ) {
+      s = ( s + 1 ) & mask;
+    }
+  }
+  set->slots[s] = set->count + 1;
+
+  tile_t * t = set->tiles + set->count;
+  memset( t, 0, sizeof( tile_t ) );
+  t->tx  = tx;
+  t->ty  = ty;
+  t->fd  = -1;
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    t->min[q] =  INFINITY;
+    t->max[q] = -INFINITY;
+  }
+  if ( set->format == TILES_LAS ) {
+    /* Offset in the tile center, z is assumed to stay within what the
+     * scale for the tile size allows, about 100 km. */
+    double min[3] = { tx * set->size, ty * set->size, -set->size };
+    double max[3] = { ( tx + 1 ) * set->size, ( ty + 1 ) * set->size, set->size };
+    lasInitHeader( &t->las, set->las_minor, set->gps, 0, min, max );
+  }
+  return set->last = set->count++;
+
+}
+
+
+void tilesAdd( tileset_t * set, const float * vertices,
+    const uint8_t * colors, size_t n, uint16_t source, double gps_time ) {
+
+  const float inv = 1.0f / set->size;
+  size_t i = 0;
+  while ( i < n ) {
+    const float * p = vertices + 3 * i;
+    int tx = (int) floorf( p[0] * inv );
+    int ty = (int) floorf( p[1] * inv );
+    int k = tilesFind( set, tx, ty );     /* may move set->tiles */
+    if ( k < 0 ) {
+      return;
+    }
+    tile_t * t = set->tiles + k;
+    if ( !t->buf && !tilesActivate( set, t ) ) {
+      /* Drop the points of the tile, the error is reported */
+      do {
+        i++;
+      } while ( i < n && (int) floorf( vertices[ 3 * i ] * inv ) == tx
+          && (int) floorf( vertices[ 3 * i + 1 ] * inv ) == ty );
+      continue;
+    }
+    t->used_at = set->clock++;
+
+    /* Run of points in the same tile which fits into the buffer */
+    size_t room = ( TILES_BUFFER - t->used ) / set->record;
+    if ( !room ) {
+      tilesFlush( set, t );
+      room = TILES_BUFFER / set->record;
+    }
+    size_t j = i;
+    do {
+      const float * r = vertices + 3 * j;
+      int q;
+      for ( q = 0; q < 3; q++ ) {
+        t->min[q] = fminf( t->min[q], r[q] );
+        t->max[q] = fmaxf( t->max[q], r[q] );
+      }
+      j++;
+    } while ( j < n && j - i < room
+        && (int) floorf( vertices[ 3 * j ] * inv ) == tx
+        && (int) floorf( vertices[ 3 * j + 1 ] * inv ) == ty );
+
+    const uint8_t * c = colors ? colors + 3 * i : NULL;
+    char * rec = t->buf + t->used;
+    if ( set->format == TILES_LAS ) {
+      lasPackPoints( &t->las, p, c, j - i, source, gps_time, rec );
+    } else {
+      size_t k;
+      for ( k = 0; k < j - i; k++, rec += TILES_PLY_RECORD ) {
+        memcpy( rec, p + 3 * k, 12 );
+        if ( c ) {
+          memcpy( rec + 12, c + 3 * k, 3 );
+        } else {
+          memset( rec + 12, 255, 3 );
+        }
+      }
+    }
+    t->used  += ( j - i ) * set->record;
+    t->count += j - i;
+    i = j;
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  tilesClose
+ *  Description:  Flush all tiles, fix their headers and write the index.
+ ******************************************************************************/
+int tilesClose( tileset_t * set ) {
+
+  int i;
+  for ( i = 0; i < set->open; i++ ) {
+    tile_t * t = set->tiles + set->active[i];
+    tilesFlush( set, t );
+    set->error |= close( t->fd ) != 0;
+    free( t->buf );
+    t->fd  = -1;
+    t->buf = NULL;
+  }
+  set->open = 0;
+
+  /* Final headers, one file at a time */
+  for ( i = 0; i < set->count; i++ ) {
+    tile_t * t = set->tiles + i;
+    if ( !t->end ) {
+      continue;
+    }
+    char name[4096];
+    tilesFilename( set, t, name, sizeof( name ) );
+    if ( set->format == TILES_LAS && set->las_minor == 2 && t->count > UINT32_MAX ) {
+      fprintf( stderr, "error: %llu points of »%s« do not fit into LAS 1.2, "
+          "use --las14.\n", (unsigned long long) t->count, name );
+      set->error = 1;
+    }
+    int fd = open( name, O_WRONLY );
+    if ( fd < 0 ) {
+      fprintf( stderr, "error: Could not open »%s«: %s\n", name,
+          strerror( errno ) );
+      set->error = 1;
+      continue;
+    }
+    char header[ TILES_PLY_HEADER > sizeof( lasheader_t )
+      ? TILES_PLY_HEADER : sizeof( lasheader_t ) ];
+    tilesHeader( set, t, header );
+    set->error |= !outbufPwrite( fd, header, set->header, 0 );
+    set->error |= close( fd ) != 0;
+  }
+
+  char name[4096];
+  snprintf( name, sizeof( name ), "%s.json", set->prefix );
+  FILE * f = fopen( name, "w" );
+  if ( !f ) {
+    fprintf( stderr, "error: Could not open »%s«.\n", name );
+    set->error = 1;
+  } else {
+    const char * base = strrchr( set->prefix, '/' );
+    base = base ? base + 1 : set->prefix;
+    uint64_t total = 0;
+    fprintf( f, "{\n  \"tile_size\": %g,\n  \"format\": \"%s\",\n"
+        "  \"tiles\": [\n", set->size, tilesSuffix( set ) );
+    for ( i = 0; i < set->count; i++ ) {
+      const tile_t * t = set->tiles + i;
+      fprintf( f, "    { \"file\": \"%s_%d_%d.%s\", \"x\": %d, \"y\": %d, "
+          "\"points\": %llu,\n      \"min\": [ %.9g, %.9g, %.9g ], "
+          "\"max\": [ %.9g, %.9g, %.9g ] }%s\n", base, t->tx, t->ty,
+          tilesSuffix( set ), t->tx, t->ty, (unsigned long long) t->count,
+          t->min[0], t->min[1], t->min[2], t->max[0], t->max[1], t->max[2],
+          i + 1 < set->count ? "," : "" );
+      total += t->count;
+    }
+    fprintf( f, "  ],\n  \"points\": %llu\n}\n", (unsigned long long) total );
+    set->error |= fclose( f ) != 0;
+    printf( "Wrote %d tiles with %llu points, index %s\n", set->count,
+        (unsigned long long) total, name );
+  }
+
+  int ok = !set->error;
+  free( set->slots );
+  free( set->tiles );
+  free( set->prefix );
+  free( set );
+  return ok;
+
+}
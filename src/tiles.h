@@ -0,0 +1,76 @@
+/*******************************************************************************
+ *
+ *       Filename:  tiles.h
+ *
+ *    Description:  Tiled export. Points in world coordinates are binned into
+ *                  square XY tiles, each tile is written to its own PLY or
+ *                  LAS file and a JSON index lists all tiles.
+ *
+ ******************************************************************************/
+
+#ifndef TILES_H
+#define TILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "las.h"
+
+#define TILES_PLY 0
+#define TILES_LAS 1
+
+/* Bytes buffered per open tile before they are written */
+#define TILES_BUFFER ( 256 << 10 )
+
+/* Tiles with an open file and a buffer at the same time */
+#define TILES_MAX_OPEN 64
+
+typedef struct {
+  int         tx, ty;        /* tile covers [tx, tx + 1) * size in x */
+  int         fd;            /* -1 while closed */
+  long        used_at;       /* for closing the least recently used */
+  char *      buf;           /* NULL while closed */
+  size_t      used;
+  off_t       end;           /* bytes in the file */
+  uint64_t    count;
+  float       min[3];
+  float       max[3];
+  lasheader_t las;
+} tile_t;
+
+typedef struct {
+  char *   prefix;
+  int      format;
+  int      las_minor;
+  int      gps;
+  float    size;
+  size_t   record;           /* bytes per point */
+  size_t   header;           /* bytes of the file header */
+  tile_t * tiles;
+  int      count;
+  int      capacity;
+  int *    slots;            /* hash of the tile indices, tile + 1 or 0 */
+  size_t   mask;             /* slots - 1, a power of two */
+  int      active[TILES_MAX_OPEN];   /* the open tiles */
+  int      open;
+  long     clock;
+  int      last;             /* tile of the previous point */
+  int      error;
+} tileset_t;
+
+/* Start a tiled export. The tiles are written to prefix_X_Y.ply (or .las)
+ * where X and Y are the tile indices. las_minor and gps are used for LAS
+ * tiles only. */
+tileset_t * tilesOpen( const char * prefix, float size, int format,
+    int las_minor, int gps );
+
+/* Bin n points in world coordinates. colors may be NULL. The point source ID
+ * and GPS time are used for LAS tiles only. */
+void tilesAdd( tileset_t * set, const float * vertices,
+    const uint8_t * colors, size_t n, uint16_t source, double gps_time );
+
+/* Flush all tiles, write their final headers and the JSON index
+ * prefix.json. Returns 0 on error. */
+int  tilesClose( tileset_t * set );
+
+#endif /* TILES_H */
@@ -0,0 +1,319 @@
+/*******************************************************************************
+ *
+ *       Filename:  voxel.cpp
+ *
+ *    Description:  Voxel-grid downsampling of posed clouds.
+ *
+ *                  Voxel coordinates are rounded to integers and packed into
+ *                  a 64 bit key, 21 bits per axis. The keys are spread over
+ *                  VOXEL_SHARDS open-addressing hash tables by their hash.
+ *                  Every thread fills its own set of shard tables from a
+ *                  static range of inputs, afterwards the shards are merged
+ *                  in parallel, one thread per shard.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "voxel.h"
+#include "xform.h"
+
+#define VOXEL_SHARD_BITS 6
+#define VOXEL_SHARDS     ( 1 << VOXEL_SHARD_BITS )
+#define VOXEL_EMPTY      UINT64_MAX
+#define VOXEL_AXIS_BITS  21
+#define VOXEL_AXIS_MAX   ( ( 1 << ( VOXEL_AXIS_BITS - 1 ) ) - 1 )
+
+typedef struct {
+  uint64_t key;
+  uint64_t id;        /* input << 32 | point, of the first point */
+  double   sum[3];
+  uint32_t rgb[3];
+  uint32_t n;
+  float    first[3];
+  uint8_t  firstrgb[3];
+} voxel_t;
+
+typedef struct {
+  voxel_t * slots;
+  size_t    mask;     /* capacity - 1, capacity is a power of two */
+  size_t    used;
+} voxeltable_t;
+
+
+static inline uint64_t voxelHash( uint64_t key ) {
+
+  /* splitmix64 finalizer */
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+
+}
+
+
+static inline uint64_t voxelKey( const float * p, float inv ) {
+
+  uint64_t key = 0;
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    long c = lroundf( p[q] * inv );
+    if ( c < -VOXEL_AXIS_MAX ) {
+      c = -VOXEL_AXIS_MAX;
+    } else if ( c > VOXEL_AXIS_MAX ) {
+      c = VOXEL_AXIS_MAX;
+    }
+    key = ( key << VOXEL_AXIS_BITS ) | (uint64_t) ( c + VOXEL_AXIS_MAX );
+  }
+  return key;
+
+}
+
+
+static void voxelTableInit( voxeltable_t * t, size_t capacity ) {
+
+  t->slots = (voxel_t *) malloc( capacity * sizeof( voxel_t ) );
+  t->mask  = capacity - 1;
+  t->used  = 0;
+  size_t i;
+  for ( i = 0; i < capacity; i++ ) {
+    t->slots[i].key = VOXEL_EMPTY;
+  }
+
+}
+
+
+static voxel_t * voxelFind( voxeltable_t * t, uint64_t key, uint64_t hash );
+
+
+/*******************************************************************************
+ *         Name:  voxelGrow
+ *  Description:  Double the capacity and reinsert all voxels.
+ ******************************************************************************/
+static void voxelGrow( voxeltable_t * t ) {
+
+  voxeltable_t old = *t;
+  voxelTableInit( t, ( old.mask + 1 ) * 2 );
+  t->used = old.used;
+  size_t i;
+  for ( i = 0; i <= old.mask; i++ ) {
+    if ( old.slots[i].key != VOXEL_EMPTY ) {
+      *voxelFind( t, old.slots[i].key, voxelHash( old.slots[i].key ) )
+        = old.slots[i];
+    }
+  }
+  free( old.slots );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  voxelFind
+ *  Description:  Linear probing. Returns the slot holding key or the empty
+ *                slot it belongs into, the caller has to fill it.
+ ******************************************************************************/
+static voxel_t * voxelFind( voxeltable_t * t, uint64_t key, uint64_t hash ) {
+
+  size_t i = hash & t->mask;
+  while ( t->slots[i].key != key && t->slots[i].key != VOXEL_EMPTY ) {
+    i = ( i + 1 ) & t->mask;
+  }
+  return t->slots + i;
+
+}
+
+
+/*******************************************************************************
+ *         Name:  voxelAdd
+ *  Description:  Accumulate a point or a partial voxel of another table.
+ ******************************************************************************/
+static void voxelAdd( voxeltable_t * t, const voxel_t * v, uint64_t hash ) {
+
+  if ( 2 * ( t->used + 1 ) > t->mask + 1 ) {
+    voxelGrow( t );
+  }
+  voxel_t * s = voxelFind( t, v->key, hash );
+  if ( s->key == VOXEL_EMPTY ) {
+    *s = *v;
+    t->used++;
+    return;
+  }
+  int q;
+  for ( q = 0; q < 3; q++ ) {
+    s->sum[q] += v->sum[q];
+    s->rgb[q] += v->rgb[q];
+  }
+  s->n += v->n;
+  if ( v->id < s->id ) {
+    s->id = v->id;
+    memcpy( s->first,    v->first,    sizeof( s->first ) );
+    memcpy( s->firstrgb, v->firstrgb, sizeof( s->firstrgb ) );
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  voxelReduce
+ *  Description:  Transform, hash and reduce all inputs.
+ ******************************************************************************/
+int voxelReduce( const voxelinput_t * in, int n, float leaf, int mode,
+    voxelcloud_t * out ) {
+
+  if ( leaf <= 0 ) {
+    fprintf( stderr, "error: Invalid voxel size %f.\n", leaf );
+    return 0;
+  }
+  const float inv = 1.0f / leaf;
+
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  std::vector<voxeltable_t> tables( nthreads * VOXEL_SHARDS );
+
+  /* Every thread reduces its inputs into its own shard tables. */
+  #pragma omp parallel num_threads( nthreads )
+  {
+    int t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    voxeltable_t * own = &tables[ t * VOXEL_SHARDS ];
+    int s;
+    for ( s = 0; s < VOXEL_SHARDS; s++ ) {
+      voxelTableInit( own + s, 1024 );
+    }
+#ifdef _OPENMP
+    /* The team can be smaller than asked for, only its tables are merged */
+    #pragma omp single
+    nthreads = omp_get_num_threads();
+#endif
+    float * block = (float *) malloc( 3 * XFORM_BLOCK * sizeof( float ) );
+
+    #pragma omp for schedule( static )
+    for ( int i = 0; i < n; i++ ) {
+      if ( !in[i].count ) {
+        continue;
+      }
+      affine_t T;
+      xformAffine( in[i].mat, &T );
+      size_t first;
+      for ( first = 0; first < in[i].count; first += XFORM_BLOCK ) {
+        size_t m = std::min( (size_t) XFORM_BLOCK, in[i].count - first );
+        xformPoints( &T, in[i].vertices + 3 * first, block, m );
+        size_t j;
+        for ( j = 0; j < m; j++ ) {
+          const float * p = block + 3 * j;
+          const uint8_t * c = in[i].colors ? in[i].colors + 3 * ( first + j ) : NULL;
+          voxel_t v;
+          v.key = voxelKey( p, inv );
+          v.id  = ( (uint64_t) i << 32 ) | ( first + j );
+          v.n   = 1;
+          int q;
+          for ( q = 0; q < 3; q++ ) {
+            v.sum[q]      = p[q];
+            v.first[q]    = p[q];
+            v.firstrgb[q] = c ? c[q] : 0;
+            v.rgb[q]      = v.firstrgb[q];
+          }
+          uint64_t hash = voxelHash( v.key );
+          voxelAdd( own + ( hash >> ( 64 - VOXEL_SHARD_BITS ) ), &v, hash );
+        }
+      }
+    }
+    free( block );
+  }
+
+  /* Merge the tables of all threads shard by shard. */
+  #pragma omp parallel for schedule( dynamic, 1 ) num_threads( nthreads )
+  for ( int s = 0; s < VOXEL_SHARDS; s++ ) {
+    voxeltable_t * merged = &tables[s];
+    int t;
+    for ( t = 1; t < nthreads; t++ ) {
+      voxeltable_t * part = &tables[ t * VOXEL_SHARDS + s ];
+      size_t k;
+      for ( k = 0; k <= part->mask; k++ ) {
+        if ( part->slots[k].key != VOXEL_EMPTY ) {
+          voxelAdd( merged, part->slots + k, voxelHash( part->slots[k].key ) );
+        }
+      }
+      free( part->slots );
+    }
+  }
+
+  /* Order the voxels by their first point. */
+  std::vector<std::pair<uint64_t, const voxel_t *> > order;
+  int s;
+  for ( s = 0; s < VOXEL_SHARDS; s++ ) {
+    size_t k;
+    for ( k = 0; k <= tables[s].mask; k++ ) {
+      if ( tables[s].slots[k].key != VOXEL_EMPTY ) {
+        order.push_back( std::make_pair( tables[s].slots[k].id,
+              tables[s].slots + k ) );
+      }
+    }
+  }
+  std::sort( order.begin(), order.end() );
+
+  out->count    = order.size();
+  out->vertices = (float *)   malloc( 3 * out->count * sizeof( float ) );
+  out->colors   = (uint8_t *) malloc( 3 * out->count * sizeof( uint8_t ) );
+  out->offsets  = (size_t *)  calloc( n + 1, sizeof( size_t ) );
+  if ( !out->vertices || !out->colors || !out->offsets ) {
+    fprintf( stderr, "error: Could not allocate memory for voxels.\n" );
+    return 0;
+  }
+
+  #pragma omp parallel for schedule( static ) num_threads( nthreads )
+  for ( long k = 0; k < (long) out->count; k++ ) {
+    const voxel_t * v = order[k].second;
+    int q;
+    for ( q = 0; q < 3; q++ ) {
+      if ( mode == VOXEL_FIRST ) {
+        out->vertices[ 3 * k + q ] = v->first[q];
+        out->colors[ 3 * k + q ]   = v->firstrgb[q];
+      } else {
+        out->vertices[ 3 * k + q ] = (float) ( v->sum[q] / v->n );
+        out->colors[ 3 * k + q ]   = (uint8_t) ( ( v->rgb[q] + v->n / 2 ) / v->n );
+      }
+    }
+  }
+
+  size_t k;
+  for ( k = 0; k < out->count; k++ ) {
+    out->offsets[ ( order[k].first >> 32 ) + 1 ]++;
+  }
+  int i;
+  for ( i = 0; i < n; i++ ) {
+    out->offsets[ i + 1 ] += out->offsets[i];
+  }
+
+  for ( s = 0; s < VOXEL_SHARDS; s++ ) {
+    free( tables[s].slots );
+  }
+  return 1;
+
+}
+
+
+void voxelFree( voxelcloud_t * cloud ) {
+
+  free( cloud->vertices );
+  free( cloud->colors );
+  free( cloud->offsets );
+  memset( cloud, 0, sizeof( voxelcloud_t ) );
+
+}
@@ -0,0 +1,45 @@
+/*******************************************************************************
+ *
+ *       Filename:  voxel.h
+ *
+ *    Description:  Voxel-grid downsampling of posed clouds. Points are
+ *                  transformed into world coordinates and reduced to one
+ *                  point per occupied voxel, which removes the near-duplicate
+ *                  points of overlapping scans.
+ *
+ ******************************************************************************/
+
+#ifndef VOXEL_H
+#define VOXEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reduction of the points in a voxel */
+#define VOXEL_AVERAGE 0   /* mean position and color */
+#define VOXEL_FIRST   1   /* first point of the earliest input */
+
+typedef struct {
+  const float *   vertices;
+  const uint8_t * colors;   /* may be NULL */
+  size_t          count;
+  const double *  mat;      /* column-major 4x4 pose, unused if count is 0 */
+} voxelinput_t;
+
+typedef struct {
+  float *   vertices;       /* xyz per voxel in world coordinates */
+  uint8_t * colors;         /* rgb per voxel */
+  size_t *  offsets;        /* voxels first seen in input i are
+                               offsets[i] to offsets[i+1] - 1 */
+  size_t    count;
+} voxelcloud_t;
+
+/* Reduce the n inputs on a grid with the given leaf size. The voxels are
+ * ordered by the input and point they were first seen in, independent of
+ * the number of threads. Returns 0 on error. */
+int  voxelReduce( const voxelinput_t * in, int n, float leaf, int mode,
+    voxelcloud_t * out );
+
+void voxelFree( voxelcloud_t * cloud );
+
+#endif /* VOXEL_H */
@@ -0,0 +1,436 @@
+/*******************************************************************************
+ *
+ *       Filename:  xform.cpp
+ *
+ *    Description:  Batched affine transformation of xyz point blocks.
+ *
+ *                  The SIMD kernels load four (SSE) or eight (AVX2) points
+ *                  as three registers, shuffle them into x, y and z
+ *                  registers, apply the 3x4 matrix and shuffle the result
+ *                  back into xyz order. All kernels use the same order of
+ *                  multiplications and additions and no FMA, so they produce
+ *                  identical results.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+
+#include "xform.h"
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define XFORM_X86
+#include <immintrin.h>
+#endif
+
+typedef void ( * xformkernel_t )( const affine_t *, const float *, float *, size_t );
+typedef size_t ( * clipkernel_t )( const affine_t *, const affine_t *,
+    const float *, float *, uint32_t *, size_t, uint32_t );
+
+
+void xformAffine( const double * mat, affine_t * a ) {
+
+  int c, r;
+  for ( c = 0; c < 4; c++ ) {
+    for ( r = 0; r < 3; r++ ) {
+      a->m[ c * 3 + r ] = (float) mat[ c * 4 + r ];
+    }
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  xformScalar
+ *  Description:  Reference kernel, also used for the remainder of a block.
+ ******************************************************************************/
+static void xformScalar( const affine_t * a, const float * src, float * dst,
+    size_t n ) {
+
+  const float * m = a->m;
+  size_t i;
+  for ( i = 0; i < n; i++ ) {
+    float x = src[ 3 * i ];
+    float y = src[ 3 * i + 1 ];
+    float z = src[ 3 * i + 2 ];
+    dst[ 3 * i     ] = m[0] * x + m[3] * y + m[6] * z + m[ 9];
+    dst[ 3 * i + 1 ] = m[1] * x + m[4] * y + m[7] * z + m[10];
+    dst[ 3 * i + 2 ] = m[2] * x + m[5] * y + m[8] * z + m[11];
+  }
+
+}
+
+
+/*******************************************************************************
+ *         Name:  clipScalar
+ *  Description:  Reference clip kernel. first is added to the kept indices,
+ *                the SIMD kernels use it for their remainder.
+ ******************************************************************************/
+static size_t clipScalar( const affine_t * a, const affine_t * clip,
+    const float * src, float * dst, uint32_t * index, size_t n,
+    uint32_t first ) {
+
+  const float * m = a->m;
+  const float * c = clip->m;
+  size_t i, k = 0;
+  for ( i = 0; i < n; i++ ) {
+    float x = src[ 3 * i ];
+    float y = src[ 3 * i + 1 ];
+    float z = src[ 3 * i + 2 ];
+    float u = c[0] * x + c[3] * y + c[6] * z + c[ 9];
+    float v = c[1] * x + c[4] * y + c[7] * z + c[10];
+    float w = c[2] * x + c[5] * y + c[8] * z + c[11];
+    if ( fabsf( u ) <= 1.0f && fabsf( v ) <= 1.0f && fabsf( w ) <= 1.0f ) {
+      dst[ 3 * k     ] = m[0] * x + m[3] * y + m[6] * z + m[ 9];
+      dst[ 3 * k + 1 ] = m[1] * x + m[4] * y + m[7] * z + m[10];
+      dst[ 3 * k + 2 ] = m[2] * x + m[5] * y + m[8] * z + m[11];
+      index[k++] = first + i;
+    }
+  }
+  return k;
+
+}
+
+
+#ifdef XFORM_X86
+
+/* Shuffles shared by the SSE and AVX2 kernel, which works on two independent
+ * 128 bit lanes. a, b, c hold x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3. */
+#define XFORM_DEINTERLEAVE( SHUF, a, b, c, X, Y, Z ) \
+  X = SHUF( a, SHUF( b, c, _MM_SHUFFLE( 0, 1, 0, 2 ) ), _MM_SHUFFLE( 2, 0, 3, 0 ) ); \
+  Y = SHUF( SHUF( a, b, _MM_SHUFFLE( 0, 0, 0, 1 ) ), \
+            SHUF( b, c, _MM_SHUFFLE( 0, 2, 0, 3 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) ); \
+  Z = SHUF( SHUF( a, b, _MM_SHUFFLE( 0, 1, 0, 2 ) ), \
+            SHUF( c, c, _MM_SHUFFLE( 0, 3, 0, 0 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) );
+
+#define XFORM_INTERLEAVE( SHUF, UNPACKLO, UNPACKHI, X, Y, Z, a, b, c ) \
+  a = SHUF( UNPACKLO( X, Y ), SHUF( Z, X, _MM_SHUFFLE( 0, 1, 0, 0 ) ), \
+            _MM_SHUFFLE( 2, 0, 1, 0 ) ); \
+  b = SHUF( SHUF( Y, Z, _MM_SHUFFLE( 0, 1, 0, 1 ) ), UNPACKHI( X, Y ), \
+            _MM_SHUFFLE( 1, 0, 2, 0 ) ); \
+  c = SHUF( SHUF( Z, X, _MM_SHUFFLE( 0, 3, 0, 2 ) ), \
+            SHUF( Y, Z, _MM_SHUFFLE( 0, 3, 0, 3 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) );
+
+/*******************************************************************************
+ *         Name:  xformSSE
+ *  Description:  Four points per iteration, SSE is always there on x86-64.
+ ******************************************************************************/
+static void xformSSE( const affine_t * a, const float * src, float * dst,
+    size_t n ) {
+
+  __m128 m[12];
+  int k;
+  for ( k = 0; k < 12; k++ ) {
+    m[k] = _mm_set1_ps( a->m[k] );
+  }
+
+  size_t i;
+  for ( i = 0; i + 4 <= n; i += 4 ) {
+    __m128 p0 = _mm_loadu_ps( src + 3 * i );
+    __m128 p1 = _mm_loadu_ps( src + 3 * i + 4 );
+    __m128 p2 = _mm_loadu_ps( src + 3 * i + 8 );
+    __m128 x, y, z;
+    XFORM_DEINTERLEAVE( _mm_shuffle_ps, p0, p1, p2, x, y, z );
+
+    __m128 ox = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( m[0], x ),
+            _mm_mul_ps( m[3], y ) ), _mm_mul_ps( m[6], z ) ), m[ 9] );
+    __m128 oy = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( m[1], x ),
+            _mm_mul_ps( m[4], y ) ), _mm_mul_ps( m[7], z ) ), m[10] );
+    __m128 oz = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( m[2], x ),
+            _mm_mul_ps( m[5], y ) ), _mm_mul_ps( m[8], z ) ), m[11] );
+
+    XFORM_INTERLEAVE( _mm_shuffle_ps, _mm_unpacklo_ps, _mm_unpackhi_ps,
+        ox, oy, oz, p0, p1, p2 );
+    _mm_storeu_ps( dst + 3 * i,     p0 );
+    _mm_storeu_ps( dst + 3 * i + 4, p1 );
+    _mm_storeu_ps( dst + 3 * i + 8, p2 );
+  }
+  xformScalar( a, src + 3 * i, dst + 3 * i, n - i );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  clipSSE
+ *  Description:  Four points per iteration. The clip coordinates give a lane
+ *                mask, kept lanes are copied from the transformed points.
+ ******************************************************************************/
+static size_t clipSSE( const affine_t * a, const affine_t * clip,
+    const float * src, float * dst, uint32_t * index, size_t n,
+    uint32_t first ) {
+
+  __m128 m[12], c[12];
+  int k;
+  for ( k = 0; k < 12; k++ ) {
+    m[k] = _mm_set1_ps( a->m[k] );
+    c[k] = _mm_set1_ps( clip->m[k] );
+  }
+  const __m128 one  = _mm_set1_ps( 1.0f );
+  const __m128 sign = _mm_set1_ps( -0.0f );
+
+  float tmp[12];
+  size_t i, kept = 0;
+  for ( i = 0; i + 4 <= n; i += 4 ) {
+    __m128 p0 = _mm_loadu_ps( src + 3 * i );
+    __m128 p1 = _mm_loadu_ps( src + 3 * i + 4 );
+    __m128 p2 = _mm_loadu_ps( src + 3 * i + 8 );
+    __m128 x, y, z;
+    XFORM_DEINTERLEAVE( _mm_shuffle_ps, p0, p1, p2, x, y, z );
+
+    __m128 u = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( c[0], x ),
+            _mm_mul_ps( c[3], y ) ), _mm_mul_ps( c[6], z ) ), c[ 9] );
+    __m128 v = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( c[1], x ),
+            _mm_mul_ps( c[4], y ) ), _mm_mul_ps( c[7], z ) ), c[10] );
+    __m128 w = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( c[2], x ),
+            _mm_mul_ps( c[5], y ) ), _mm_mul_ps( c[8], z ) ), c[11] );
+    __m128 in = _mm_and_ps( _mm_and_ps(
+          _mm_cmple_ps( _mm_andnot_ps( sign, u ), one ),
+          _mm_cmple_ps( _mm_andnot_ps( sign, v ), one ) ),
+          _mm_cmple_ps( _mm_andnot_ps( sign, w ), one ) );
+    int bits = _mm_movemask_ps( in );
+    if ( !bits ) {
+      continue;
+    }
+
+    __m128 ox = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( m[0], x ),
+            _mm_mul_ps( m[3], y ) ), _mm_mul_ps( m[6], z ) ), m[ 9] );
+    __m128 oy = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( m[1], x ),
+            _mm_mul_ps( m[4], y ) ), _mm_mul_ps( m[7], z ) ), m[10] );
+    __m128 oz = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( m[2], x ),
+            _mm_mul_ps( m[5], y ) ), _mm_mul_ps( m[8], z ) ), m[11] );
+
+    XFORM_INTERLEAVE( _mm_shuffle_ps, _mm_unpacklo_ps, _mm_unpackhi_ps,
+        ox, oy, oz, p0, p1, p2 );
+    _mm_storeu_ps( tmp,     p0 );
+    _mm_storeu_ps( tmp + 4, p1 );
+    _mm_storeu_ps( tmp + 8, p2 );
+    while ( bits ) {
+      int j = __builtin_ctz( bits );
+      bits &= bits - 1;
+      dst[ 3 * kept     ] = tmp[ 3 * j     ];
+      dst[ 3 * kept + 1 ] = tmp[ 3 * j + 1 ];
+      dst[ 3 * kept + 2 ] = tmp[ 3 * j + 2 ];
+      index[ kept++ ] = first + i + j;
+    }
+  }
+  return kept + clipScalar( a, clip, src + 3 * i, dst + 3 * kept,
+      index + kept, n - i, first + i );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  xformAVX2
+ *  Description:  Eight points per iteration. The low lanes hold points 0-3,
+ *                the high lanes points 4-7, so the SSE shuffles apply.
+ ******************************************************************************/
+__attribute__(( target( "avx2" ) ))
+static void xformAVX2( const affine_t * a, const float * src, float * dst,
+    size_t n ) {
+
+  __m256 m[12];
+  int k;
+  for ( k = 0; k < 12; k++ ) {
+    m[k] = _mm256_set1_ps( a->m[k] );
+  }
+
+#define XFORM_LOAD2( lo, hi ) \
+  _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( lo ) ), \
+      _mm_loadu_ps( hi ), 1 )
+
+  size_t i;
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    const float * s = src + 3 * i;
+    __m256 p0 = XFORM_LOAD2( s,     s + 12 );
+    __m256 p1 = XFORM_LOAD2( s + 4, s + 16 );
+    __m256 p2 = XFORM_LOAD2( s + 8, s + 20 );
+    __m256 x, y, z;
+    XFORM_DEINTERLEAVE( _mm256_shuffle_ps, p0, p1, p2, x, y, z );
+
+    __m256 ox = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( m[0], x ), _mm256_mul_ps( m[3], y ) ),
+          _mm256_mul_ps( m[6], z ) ), m[ 9] );
+    __m256 oy = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( m[1], x ), _mm256_mul_ps( m[4], y ) ),
+          _mm256_mul_ps( m[7], z ) ), m[10] );
+    __m256 oz = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( m[2], x ), _mm256_mul_ps( m[5], y ) ),
+          _mm256_mul_ps( m[8], z ) ), m[11] );
+
+    XFORM_INTERLEAVE( _mm256_shuffle_ps, _mm256_unpacklo_ps,
+        _mm256_unpackhi_ps, ox, oy, oz, p0, p1, p2 );
+    float * d = dst + 3 * i;
+    _mm_storeu_ps( d,      _mm256_castps256_ps128( p0 ) );
+    _mm_storeu_ps( d +  4, _mm256_castps256_ps128( p1 ) );
+    _mm_storeu_ps( d +  8, _mm256_castps256_ps128( p2 ) );
+    _mm_storeu_ps( d + 12, _mm256_extractf128_ps( p0, 1 ) );
+    _mm_storeu_ps( d + 16, _mm256_extractf128_ps( p1, 1 ) );
+    _mm_storeu_ps( d + 20, _mm256_extractf128_ps( p2, 1 ) );
+  }
+  xformSSE( a, src + 3 * i, dst + 3 * i, n - i );
+
+}
+
+
+/*******************************************************************************
+ *         Name:  clipAVX2
+ *  Description:  Eight points per iteration, see clipSSE.
+ ******************************************************************************/
+__attribute__(( target( "avx2" ) ))
+static size_t clipAVX2( const affine_t * a, const affine_t * clip,
+    const float * src, float * dst, uint32_t * index, size_t n,
+    uint32_t first ) {
+
+  __m256 m[12], c[12];
+  int k;
+  for ( k = 0; k < 12; k++ ) {
+    m[k] = _mm256_set1_ps( a->m[k] );
+    c[k] = _mm256_set1_ps( clip->m[k] );
+  }
+  const __m256 one  = _mm256_set1_ps( 1.0f );
+  const __m256 sign = _mm256_set1_ps( -0.0f );
+
+  float tmp[24];
+  size_t i, kept = 0;
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    const float * s = src + 3 * i;
+    __m256 p0 = XFORM_LOAD2( s,     s + 12 );
+    __m256 p1 = XFORM_LOAD2( s + 4, s + 16 );
+    __m256 p2 = XFORM_LOAD2( s + 8, s + 20 );
+    __m256 x, y, z;
+    XFORM_DEINTERLEAVE( _mm256_shuffle_ps, p0, p1, p2, x, y, z );
+
+    __m256 u = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( c[0], x ), _mm256_mul_ps( c[3], y ) ),
+          _mm256_mul_ps( c[6], z ) ), c[ 9] );
+    __m256 v = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( c[1], x ), _mm256_mul_ps( c[4], y ) ),
+          _mm256_mul_ps( c[7], z ) ), c[10] );
+    __m256 w = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( c[2], x ), _mm256_mul_ps( c[5], y ) ),
+          _mm256_mul_ps( c[8], z ) ), c[11] );
+    __m256 in = _mm256_and_ps( _mm256_and_ps(
+          _mm256_cmp_ps( _mm256_andnot_ps( sign, u ), one, _CMP_LE_OQ ),
+          _mm256_cmp_ps( _mm256_andnot_ps( sign, v ), one, _CMP_LE_OQ ) ),
+          _mm256_cmp_ps( _mm256_andnot_ps( sign, w ), one, _CMP_LE_OQ ) );
+    int bits = _mm256_movemask_ps( in );
+    if ( !bits ) {
+      continue;
+    }
+
+    __m256 ox = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( m[0], x ), _mm256_mul_ps( m[3], y ) ),
+          _mm256_mul_ps( m[6], z ) ), m[ 9] );
+    __m256 oy = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( m[1], x ), _mm256_mul_ps( m[4], y ) ),
+          _mm256_mul_ps( m[7], z ) ), m[10] );
+    __m256 oz = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( m[2], x ), _mm256_mul_ps( m[5], y ) ),
+          _mm256_mul_ps( m[8], z ) ), m[11] );
+
+    XFORM_INTERLEAVE( _mm256_shuffle_ps, _mm256_unpacklo_ps,
+        _mm256_unpackhi_ps, ox, oy, oz, p0, p1, p2 );
+    _mm_storeu_ps( tmp,      _mm256_castps256_ps128( p0 ) );
+    _mm_storeu_ps( tmp +  4, _mm256_castps256_ps128( p1 ) );
+    _mm_storeu_ps( tmp +  8, _mm256_castps256_ps128( p2 ) );
+    _mm_storeu_ps( tmp + 12, _mm256_extractf128_ps( p0, 1 ) );
+    _mm_storeu_ps( tmp + 16, _mm256_extractf128_ps( p1, 1 ) );
+    _mm_storeu_ps( tmp + 20, _mm256_extractf128_ps( p2, 1 ) );
+    while ( bits ) {
+      int j = __builtin_ctz( bits );
+      bits &= bits - 1;
+      dst[ 3 * kept     ] = tmp[ 3 * j     ];
+      dst[ 3 * kept + 1 ] = tmp[ 3 * j + 1 ];
+      dst[ 3 * kept + 2 ] = tmp[ 3 * j + 2 ];
+      index[ kept++ ] = first + i + j;
+    }
+  }
+  return kept + clipSSE( a, clip, src + 3 * i, dst + 3 * kept,
+      index + kept, n - i, first + i );
+
+}
+#undef XFORM_LOAD2
+
+#endif /* XFORM_X86 */
+
+
+typedef struct {
+  xformkernel_t xform;
+  clipkernel_t  clip;
+  const char *  name;
+} xformkernels_t;
+
+
+/*******************************************************************************
+ *         Name:  xformSelect
+ *  Description:  Pick the widest kernel the CPU supports.
+ ******************************************************************************/
+static xformkernels_t xformSelect() {
+
+#ifdef XFORM_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    xformkernels_t k = { xformAVX2, clipAVX2, "avx2" };
+    return k;
+  }
+  xformkernels_t k = { xformSSE, clipSSE, "sse" };
+#else
+  xformkernels_t k = { xformScalar, clipScalar, "scalar" };
+#endif
+  return k;
+
+}
+
+
+/* Selected once on first use, the initialisation of a local static is
+ * thread-safe */
+static inline const xformkernels_t & xformKernels() {
+
+  static const xformkernels_t kernels = xformSelect();
+  return kernels;
+
+}
+
+
+void xformPoints( const affine_t * a, const float * src, float * dst,
+    size_t n ) {
+
+  xformKernels().xform( a, src, dst, n );
+
+}
+
+
+size_t xformClip( const affine_t * a, const affine_t * clip, const float * src,
+    float * dst, uint32_t * index, size_t n ) {
+
+  return xformKernels().clip( a, clip, src, dst, index, n, 0 );
+
+}
+
+
+void xformBounds( const affine_t * a, const float * src, size_t n,
+    float * block, float * min, float * max ) {
+
+  size_t first;
+  for ( first = 0; first < n; first += XFORM_BLOCK ) {
+    size_t m = n - first < XFORM_BLOCK ? n - first : XFORM_BLOCK;
+    xformPoints( a, src + 3 * first, block, m );
+    size_t i;
+    int q;
+    for ( i = 0; i < m; i++ ) {
+      for ( q = 0; q < 3; q++ ) {
+        float v = block[ 3 * i + q ];
+        min[q] = v < min[q] ? v : min[q];
+        max[q] = v > max[q] ? v : max[q];
+      }
+    }
+  }
+
+}
+
+
+const char * xformKernelName() {
+
+  return xformKernels().name;
+
+}
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ *
+ *       Filename:  xform.h
+ *
+ *    Description:  Batched affine transformation of xyz point blocks.
+ *
+ ******************************************************************************/
+
+#ifndef XFORM_H
+#define XFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Points transformed per block by the exporters. */
+#define XFORM_BLOCK 65536
+
+/* Affine 3x4 part of a column-major 4x4 pose matrix, column-major as well:
+ * three rotation columns followed by the translation. */
+typedef struct {
+  float m[12];
+} affine_t;
+
+/* Take the affine part of a column-major 4x4 matrix. */
+void xformAffine( const double * mat, affine_t * a );
+
+/* dst = R * src + t for n interleaved xyz points. src and dst must not
+ * overlap. The kernel is chosen on first use by the CPU features. */
+void xformPoints( const affine_t * a, const float * src, float * dst, size_t n );
+
+/* Transform n points with a and keep those which clip maps into the cube
+ * [-1, 1]^3. Kept points are packed into dst, their positions in src into
+ * index. Kept points are identical to those of xformPoints. Returns the
+ * number of kept points. */
+size_t xformClip( const affine_t * a, const affine_t * clip, const float * src,
+    float * dst, uint32_t * index, size_t n );
+
+/* Extend min/max by the n points transformed with a. block is scratch space
+ * for 3 * XFORM_BLOCK floats. */
+void xformBounds( const affine_t * a, const float * src, size_t n,
+    float * block, float * min, float * max );
+
+/* Name of the kernel used by xformPoints. */
+const char * xformKernelName();
+
+#endif /* XFORM_H */